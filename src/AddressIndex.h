@@ -0,0 +1,118 @@
+#ifndef _SO_REBUILDER_ADDRESSINDEX_H_
+#define _SO_REBUILDER_ADDRESSINDEX_H_
+
+#include <vector>
+#include <algorithm>
+#include "exutil.h"
+
+/**
+ * Address intervals of the segments, sections and symbols of one file,
+ * each kind in a flat array sorted by start address. A lookup is a
+ * binary search without branches in its loop, so millions of addresses
+ * cost little more than the memory reads.
+ *   find(addr)      ==>  the interval containing addr
+ *   nearest(addr)   ==>  the last one starting at or before addr
+ *   next(addr)      ==>  the first one starting after addr
+ *   overlaps(f)     ==>  f(a, b) for every interval b starting inside a
+ * The id given to add() is what comes back, kNone if nothing matches.
+ */
+template <typename ELF>
+class AddressIndex{
+
+public:
+	ELF_TYPEDEFS(ELF);
+
+	enum Kind{ kSegment, kSection, kSymbol, kKindCount };
+	static const Elf_Word kNone = ~(Elf_Word)0;
+
+	AddressIndex() {}
+
+	void clear(Kind kind){
+		starts[kind].clear();
+		entries[kind].clear();
+	}
+
+	void add(Kind kind, Elf_Addr start, Elf_Xword size, Elf_Word id){
+		starts[kind].push_back(start);
+		entries[kind].push_back({start + size, id});
+	}
+
+	// Sort after adding, intervals with the same start keep their order.
+	void build(Kind kind){
+		std::vector<Elf_Addr>& s = starts[kind];
+		std::vector<Entry>& e = entries[kind];
+		std::vector<size_t> order(s.size());
+		for(size_t i = 0; i < order.size(); i++) { order[i] = i; }
+		std::stable_sort(order.begin(), order.end(), [&s](size_t a, size_t b){ return s[a] < s[b]; });
+		std::vector<Elf_Addr> sortedStarts(s.size());
+		std::vector<Entry> sortedEntries(e.size());
+		for(size_t i = 0; i < order.size(); i++){
+			sortedStarts[i] = s[order[i]];
+			sortedEntries[i] = e[order[i]];
+		}
+		s.swap(sortedStarts);
+		e.swap(sortedEntries);
+	}
+
+	Elf_Word find(Kind kind, Elf_Addr addr) const {
+		const std::vector<Elf_Addr>& s = starts[kind];
+		size_t i = upperBound(s, addr);
+		// empty ones may share the start of the one holding addr
+		while(i > 1 && s[i-2] == s[i-1] && entries[kind][i-1].end <= addr) { i--; }
+		return i > 0 && addr < entries[kind][i-1].end ? entries[kind][i-1].id : kNone;
+	}
+
+	Elf_Word nearest(Kind kind, Elf_Addr addr) const {
+		size_t i = upperBound(starts[kind], addr);
+		return i > 0 ? entries[kind][i-1].id : kNone;
+	}
+
+	// Start of the first interval after addr is stored to start.
+	Elf_Word next(Kind kind, Elf_Addr addr, Elf_Addr* start) const {
+		size_t i = upperBound(starts[kind], addr);
+		if(i == starts[kind].size()) return kNone;
+		*start = starts[kind][i];
+		return entries[kind][i].id;
+	}
+
+	// f(a, b) with a before b in address order. b is compared with the
+	// interval before it, which is how sections follow each other.
+	template <typename F>
+	size_t overlaps(Kind kind, F f) const {
+		size_t count = 0;
+		for(size_t i = 1; i < starts[kind].size(); i++){
+			if(starts[kind][i] < entries[kind][i-1].end){
+				f(entries[kind][i-1].id, entries[kind][i].id);
+				count++;
+			}
+		}
+		return count;
+	}
+
+	size_t size(Kind kind) const { return starts[kind].size(); }
+
+private:
+	struct Entry{
+		Elf_Addr end;
+		Elf_Word id;
+	};
+
+	// Number of starts <= addr. The loop only picks one of two pointers,
+	// which compiles to a conditional move instead of a branch.
+	static size_t upperBound(const std::vector<Elf_Addr>& s, Elf_Addr addr){
+		size_t n = s.size();
+		if(n == 0) return 0;
+		const Elf_Addr* base = &s[0];
+		while(n > 1){
+			size_t half = n / 2;
+			base = base[half] <= addr ? base + half : base;
+			n -= half;
+		}
+		return (base - &s[0]) + (*base <= addr);
+	}
+
+	std::vector<Elf_Addr> starts[kKindCount];
+	std::vector<Entry> entries[kKindCount];
+};
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef _SO_REBUILDER_ARCHPOLICY_H_
+#define _SO_REBUILDER_ARCHPOLICY_H_
+
+#include "elf.h"
+
+/**
+ * Per-architecture facts, keyed on e_machine.
+ *
+ * The relocation types are what the un-relocation cares about, the
+ * TLS ones only tell which words are GOT entries. The rest is the 
+ * PLT/GOT layout the linkers of this architecture produce:
+ *   kPltHeaderSize, kPltEntrySize	PLT0 and every following entry
+ *   kGotPltReserved				words in front of the first JUMP_SLOT
+ *   kSplitGotPlt					if .got.plt is a section of its own
+ *   kLazyEntryOffset				where an unbound JUMP_SLOT points to,
+ *									inside its own PLT entry. -1 for PLT0.
+ *   kSymbolicRelative				if kRelative with a symbol is symbolic,
+ *									see isRelative().
+ *
+ * The un-relocation loops are instantiated once per policy, so the type
+ * checks in there are against constants.
+ */
+template <int Machine>
+struct ArchPolicy;
+
+template <>
+struct ArchPolicy<EM_ARM> {
+	static const Elf32_Half kMachine = EM_ARM;
+	static const Elf32_Word kRelative = R_ARM_RELATIVE;
+	static const Elf32_Word kJumpSlot = R_ARM_JUMP_SLOT;
+	static const Elf32_Word kGlobDat = R_ARM_GLOB_DAT;
+	static const Elf32_Word kAbs = R_ARM_ABS32;
+	static const Elf32_Word kTlsDtpMod = R_ARM_TLS_DTPMOD32;
+	static const Elf32_Word kTlsDtpOff = R_ARM_TLS_DTPOFF32;
+	static const Elf32_Word kTlsTpOff = R_ARM_TLS_TPOFF32;
+	static const Elf32_Word kTlsDesc = R_ARM_TLS_DESC;
+	static const unsigned kPltHeaderSize = 20;
+	static const unsigned kPltEntrySize = 12;
+	static const unsigned kGotPltReserved = 3;
+	static const bool kSplitGotPlt = false;
+	static const int kLazyEntryOffset = -1;
+	static const bool kSymbolicRelative = false;
+	static const bool kHasExidx = true;
+};
+
+template <>
+struct ArchPolicy<EM_386> {
+	static const Elf32_Half kMachine = EM_386;
+	static const Elf32_Word kRelative = R_386_RELATIVE;
+	static const Elf32_Word kJumpSlot = R_386_JUMP_SLOT;
+	static const Elf32_Word kGlobDat = R_386_GLOB_DAT;
+	static const Elf32_Word kAbs = R_386_32;
+	static const Elf32_Word kTlsDtpMod = R_386_TLS_DTPMOD32;
+	static const Elf32_Word kTlsDtpOff = R_386_TLS_DTPOFF32;
+	static const Elf32_Word kTlsTpOff = R_386_TLS_TPOFF;
+	static const Elf32_Word kTlsDesc = R_386_TLS_DESC;
+	static const unsigned kPltHeaderSize = 16;
+	static const unsigned kPltEntrySize = 16;
+	static const unsigned kGotPltReserved = 3;
+	static const bool kSplitGotPlt = true;
+	static const int kLazyEntryOffset = 6;		// the push after "jmp *slot"
+	static const bool kSymbolicRelative = false;
+	static const bool kHasExidx = false;
+};
+
+template <>
+struct ArchPolicy<EM_AARCH64> {
+	static const Elf32_Half kMachine = EM_AARCH64;
+	static const Elf32_Word kRelative = R_AARCH64_RELATIVE;
+	static const Elf32_Word kJumpSlot = R_AARCH64_JUMP_SLOT;
+	static const Elf32_Word kGlobDat = R_AARCH64_GLOB_DAT;
+	static const Elf32_Word kAbs = R_AARCH64_ABS64;
+	static const Elf32_Word kTlsDtpMod = R_AARCH64_TLS_DTPMOD64;
+	static const Elf32_Word kTlsDtpOff = R_AARCH64_TLS_DTPREL64;
+	static const Elf32_Word kTlsTpOff = R_AARCH64_TLS_TPREL64;
+	static const Elf32_Word kTlsDesc = R_AARCH64_TLSDESC;
+	static const unsigned kPltHeaderSize = 32;
+	static const unsigned kPltEntrySize = 16;
+	static const unsigned kGotPltReserved = 3;
+	static const bool kSplitGotPlt = true;
+	static const int kLazyEntryOffset = -1;
+	static const bool kSymbolicRelative = false;
+	static const bool kHasExidx = false;
+};
+
+template <>
+struct ArchPolicy<EM_X86_64> {
+	static const Elf32_Half kMachine = EM_X86_64;
+	static const Elf32_Word kRelative = R_X86_64_RELATIVE;
+	static const Elf32_Word kJumpSlot = R_X86_64_JUMP_SLOT;
+	static const Elf32_Word kGlobDat = R_X86_64_GLOB_DAT;
+	static const Elf32_Word kAbs = R_X86_64_64;
+	static const Elf32_Word kTlsDtpMod = R_X86_64_DTPMOD64;
+	static const Elf32_Word kTlsDtpOff = R_X86_64_DTPOFF64;
+	static const Elf32_Word kTlsTpOff = R_X86_64_TPOFF64;
+	static const Elf32_Word kTlsDesc = R_X86_64_TLSDESC;
+	static const unsigned kPltHeaderSize = 16;
+	static const unsigned kPltEntrySize = 16;
+	static const unsigned kGotPltReserved = 3;
+	static const bool kSplitGotPlt = true;
+	static const int kLazyEntryOffset = 6;		// the push after "jmp *slot(%rip)"
+	static const bool kSymbolicRelative = false;
+	static const bool kHasExidx = false;
+};
+
+// Only the 32-bit o32 ABI, the 64-bit one packs 3 types into r_info.
+template <>
+struct ArchPolicy<EM_MIPS> {
+	static const Elf32_Half kMachine = EM_MIPS;
+	static const Elf32_Word kRelative = R_MIPS_REL32;
+	static const Elf32_Word kJumpSlot = R_MIPS_JUMP_SLOT;
+	static const Elf32_Word kGlobDat = R_MIPS_GLOB_DAT;
+	static const Elf32_Word kAbs = R_MIPS_32;
+	static const Elf32_Word kTlsDtpMod = R_MIPS_TLS_DTPMOD32;
+	static const Elf32_Word kTlsDtpOff = R_MIPS_TLS_DTPREL32;
+	static const Elf32_Word kTlsTpOff = R_MIPS_TLS_TPREL32;
+	static const Elf32_Word kTlsDesc = R_MIPS_NONE;
+	static const unsigned kPltHeaderSize = 32;
+	static const unsigned kPltEntrySize = 16;
+	static const unsigned kGotPltReserved = 2;
+	static const bool kSplitGotPlt = true;
+	static const int kLazyEntryOffset = -1;
+	static const bool kSymbolicRelative = true;
+	static const bool kHasExidx = false;
+};
+
+/**
+ * MIPS has no RELATIVE type, R_MIPS_REL32 against symbol 0 is used 
+ * instead. With a symbol it is an ordinary symbolic relocation.
+ */
+template <typename Arch>
+inline bool isRelative(Elf32_Word type, Elf32_Word sym){
+	return type == Arch::kRelative && (sym == 0 || !Arch::kSymbolicRelative);
+}
+
+/**
+ * The same facts as plain values, for the code which only needs them
+ * once or twice, like building the section headers.
+ */
+struct ArchInfo {
+	Elf32_Half machine = EM_NONE;
+	bool known = false;
+	Elf32_Word relative_type = 0;	// R_*_RELATIVE of this machine
+	Elf32_Word jump_slot_type = 0;	// R_*_JUMP_SLOT of this machine
+	Elf32_Word glob_dat_type = 0;	// R_*_GLOB_DAT of this machine
+	Elf32_Word abs_type = 0;		// R_*_ABS32 or R_*_64 of this machine
+	Elf32_Word tls_types[4] = {};	// DTPMOD, DTPOFF, TPOFF and TLSDESC, they all live in .got
+	unsigned plt_header_size = ArchPolicy<EM_ARM>::kPltHeaderSize;
+	unsigned plt_entry_size = ArchPolicy<EM_ARM>::kPltEntrySize;
+	unsigned gotplt_reserved = ArchPolicy<EM_ARM>::kGotPltReserved;
+	bool split_gotplt = ArchPolicy<EM_ARM>::kSplitGotPlt;
+	bool has_exidx = ArchPolicy<EM_ARM>::kHasExidx;
+
+	template <typename Arch>
+	static ArchInfo from(){
+		ArchInfo info;
+		info.machine = Arch::kMachine;
+		info.known = true;
+		info.relative_type = Arch::kRelative;
+		info.jump_slot_type = Arch::kJumpSlot;
+		info.glob_dat_type = Arch::kGlobDat;
+		info.abs_type = Arch::kAbs;
+		info.tls_types[0] = Arch::kTlsDtpMod;
+		info.tls_types[1] = Arch::kTlsDtpOff;
+		info.tls_types[2] = Arch::kTlsTpOff;
+		info.tls_types[3] = Arch::kTlsDesc;
+		info.plt_header_size = Arch::kPltHeaderSize;
+		info.plt_entry_size = Arch::kPltEntrySize;
+		info.gotplt_reserved = Arch::kGotPltReserved;
+		info.split_gotplt = Arch::kSplitGotPlt;
+		info.has_exidx = Arch::kHasExidx;
+		return info;
+	}
+
+	bool isTlsType(Elf32_Word type) const {
+		for(int i = 0; i < 4; i++){
+			if(tls_types[i] != 0 && tls_types[i] == type) return true;
+		}
+		return false;
+	}
+
+	// Unknown machines keep the ARM layout the project started with,
+	// but no relocation type will match.
+	static ArchInfo of(Elf32_Half machine){
+		switch(machine){
+			case EM_ARM: return from<ArchPolicy<EM_ARM> >();
+			case EM_386: return from<ArchPolicy<EM_386> >();
+			case EM_AARCH64: return from<ArchPolicy<EM_AARCH64> >();
+			case EM_X86_64: return from<ArchPolicy<EM_X86_64> >();
+			case EM_MIPS: return from<ArchPolicy<EM_MIPS> >();
+			default:{
+				ArchInfo info;
+				info.machine = machine;
+				return info;
+			}
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef _SO_REBUILDER_BUILDINDEX_H_
+#define _SO_REBUILDER_BUILDINDEX_H_
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "exutil.h"
+#include "Log.h"
+
+/**
+ * Intact builds of libraries we have seen, keyed by a fingerprint of
+ * the program header table and .dynamic. A damaged file with the same
+ * fingerprint is the same build: every section lies at the same place,
+ * so the section table of the intact one fits it as it is.
+ *
+ * Only the headers and .dynamic of a reference are read to index it.
+ * The whole file is read once it matches.
+ */
+template <typename ELF>
+class BuildIndex{
+
+public:
+	ELF_TYPEDEFS(ELF);
+
+	struct Entry{
+		std::string path;
+		Elf_Off loadEnd;		// end of the file data loaded by PT_LOAD
+	};
+
+	BuildIndex() {}
+
+	// Index a library, or every library of a directory.
+	void add(const char* path){
+		struct stat st;
+		if(stat(path, &st) != 0){
+			VLOG("Reference \"%s\" not found.", path);
+			return;
+		}
+		if(!S_ISDIR(st.st_mode)){
+			addFile(path);
+			return;
+		}
+		DIR* dir = opendir(path);
+		if(dir == NULL) return;
+		struct dirent* ent;
+		while((ent = readdir(dir)) != NULL){
+			std::string name = ent->d_name;
+			if(name.size() < 3 || name.compare(name.size() - 3, 3, ".so") != 0) continue;
+			addFile((std::string(path) + "/" + name).c_str());
+		}
+		closedir(dir);
+	}
+
+	size_t size() { return entries.size(); }
+
+	const Entry* find(uint64_t fp){
+		auto it = entries.find(fp);
+		return it == entries.end() ? nullptr : &it->second;
+	}
+
+	/**
+	 * Fingerprint of an open file, from e_machine, every field of the 
+	 * program headers except p_paddr, and the .dynamic entries up to DT_NULL.
+	 * Return false if the headers cannot be read or are of another elf class.
+	 */
+	static bool fingerprint(FILE* fp, uint64_t* out, Elf_Off* loadEnd){
+		Elf_Ehdr ehdr;
+		std::vector<Elf_Phdr> phdrs;
+		if(!readHeaders(fp, ehdr, phdrs)) return false;
+
+		uint64_t h = kFnvBasis;
+		mix(h, ehdr.e_machine);
+		const Elf_Phdr* dynamic = nullptr;
+		*loadEnd = 0;
+		for(const Elf_Phdr& phdr : phdrs){
+			mix(h, phdr.p_type);
+			mix(h, phdr.p_flags);
+			mix(h, phdr.p_offset);
+			mix(h, phdr.p_vaddr);
+			mix(h, phdr.p_filesz);
+			mix(h, phdr.p_memsz);
+			mix(h, phdr.p_align);
+			if(phdr.p_type == PT_DYNAMIC && dynamic == nullptr) dynamic = &phdr;
+			if(phdr.p_type == PT_LOAD && phdr.p_offset + phdr.p_filesz > *loadEnd){
+				*loadEnd = phdr.p_offset + phdr.p_filesz;
+			}
+		}
+		if(dynamic == nullptr) return false;
+
+		size_t count = dynamic->p_filesz / sizeof(Elf_Dyn);
+		std::vector<Elf_Dyn> dyns(count);
+		if(count == 0 || !readAt(fp, dynamic->p_offset, &dyns[0], count * sizeof(Elf_Dyn))) return false;
+		for(const Elf_Dyn& dyn : dyns){
+			if(dyn.d_tag == DT_NULL) break;
+			mix(h, dyn.d_tag);
+			mix(h, dyn.d_un.d_val);
+		}
+		*out = h;
+		return true;
+	}
+
+	// Read a whole file, return false if it cannot be read.
+	static bool readFile(const char* path, std::vector<uint8_t>& data){
+		FILE* fp = fopen(path, "rb");
+		if(fp == NULL) return false;
+		fseek(fp, 0, SEEK_END);
+		long size = ftell(fp);
+		bool ok = size > 0;
+		if(ok){
+			data.resize(size);
+			ok = readAt(fp, 0, &data[0], size);
+		}
+		fclose(fp);
+		return ok;
+	}
+
+private:
+	void addFile(const char* path){
+		FILE* fp = fopen(path, "rb");
+		if(fp == NULL) return;
+		uint64_t fp_hash = 0;
+		Entry entry;
+		entry.path = path;
+		// other elf classes are skipped quietly, a directory may hold both
+		bool ok = fingerprint(fp, &fp_hash, &entry.loadEnd);
+		bool usable = ok && hasSections(fp);
+		fclose(fp);
+		if(ok && !usable){
+			VLOG("Reference \"%s\" skipped, it has no usable section table.", path);
+		}
+		if(!usable) return;
+		if(entries.insert(std::make_pair(fp_hash, entry)).second){
+			DLOG("Reference \"%s\" indexed as %016llx.", path, (unsigned long long)fp_hash);
+		}
+	}
+
+	static bool readHeaders(FILE* fp, Elf_Ehdr& ehdr, std::vector<Elf_Phdr>& phdrs){
+		if(!readAt(fp, 0, &ehdr, sizeof(ehdr)) || !ehdr.checkMagic() ||
+		   ehdr.getFileClass() != ELF::kElfClass || ehdr.getDataEncoding() != ELF::kElfData){
+			return false;
+		}
+		size_t phnum = ehdr.e_phnum;
+		if(phnum < 1 || phnum > 65536/sizeof(Elf_Phdr)) return false;
+		phdrs.resize(phnum);
+		return readAt(fp, ehdr.e_phoff, &phdrs[0], phnum * sizeof(Elf_Phdr));
+	}
+
+	/**
+	 * A reference must be intact, or it would hand its damage on. Every 
+	 * allocated section has to lie in a PT_LOAD, at the file offset 
+	 * matching its address, and every name in .shstrtab.
+	 */
+	static bool hasSections(FILE* fp){
+		Elf_Ehdr ehdr;
+		std::vector<Elf_Phdr> phdrs;
+		if(!readHeaders(fp, ehdr, phdrs)) return false;
+		size_t shnum = ehdr.e_shnum;
+		if(shnum < 2 || ehdr.e_shentsize != sizeof(Elf_Shdr) ||
+		   ehdr.e_shstrndx == SHN_UNDEF || ehdr.e_shstrndx >= shnum){
+			return false;
+		}
+		std::vector<Elf_Shdr> shdrs(shnum);
+		if(!readAt(fp, ehdr.e_shoff, &shdrs[0], shnum * sizeof(Elf_Shdr))) return false;
+		const Elf_Shdr& shstrtab = shdrs[ehdr.e_shstrndx];
+		if(shdrs[0].sh_type != SHT_NULL || shdrs[0].sh_size != 0 || 
+		   shstrtab.sh_type != SHT_STRTAB || shstrtab.sh_offset == 0){
+			return false;
+		}
+
+		for(size_t i = 1; i < shnum; i++){
+			const Elf_Shdr& shdr = shdrs[i];
+			if(shdr.sh_name >= shstrtab.sh_size) return false;
+			if(!(shdr.sh_flags & SHF_ALLOC)) continue;
+			// the elf header is at address 0, no section is
+			if(shdr.sh_addr == 0) return false;
+			bool inside = false;
+			for(const Elf_Phdr& phdr : phdrs){
+				if(phdr.p_type != PT_LOAD) continue;
+				if(shdr.sh_addr < phdr.p_vaddr || shdr.sh_addr + shdr.sh_size > phdr.p_vaddr + phdr.p_memsz) continue;
+				inside = shdr.sh_type == SHT_NOBITS || 
+						 shdr.sh_addr - phdr.p_vaddr == shdr.sh_offset - phdr.p_offset;
+				break;
+			}
+			// .tbss takes no space, it may lie past the end of the segment
+			if(!inside && !(shdr.sh_type == SHT_NOBITS && (shdr.sh_flags & SHF_TLS))) return false;
+		}
+		return true;
+	}
+
+	static bool readAt(FILE* fp, Elf_Off offset, void* buf, size_t size){
+		return fseek(fp, offset, SEEK_SET) == 0 && fread(buf, 1, size, fp) == size;
+	}
+
+	// FNV-1a over the bytes of v
+	static const uint64_t kFnvBasis = 0xcbf29ce484222325ULL;
+	static void mix(uint64_t& h, uint64_t v){
+		for(int i = 0; i < 8; i++){
+			h ^= (v >> (i * 8)) & 0xff;
+			h *= 0x100000001b3ULL;
+		}
+	}
+
+	std::unordered_map<uint64_t, Entry> entries;
+};
+
+#endif
@@ -0,0 +1,299 @@
+#ifndef _SO_REBUILDER_BYTEORDER_H_
+#define _SO_REBUILDER_BYTEORDER_H_
+
+#include <stdint.h>
+#include <cstring>
+#include "elf.h"
+
+/**
+ * A field stored big-endian. It reads and writes like a plain T, the
+ * bytes are swapped on the way. The host is little-endian.
+ *
+ * The big-endian ELF traits below build the ELF structures out of it,
+ * so the code templated on ELF class traits is not aware of the byte
+ * order at all. Little-endian traits keep the plain structures from
+ * elf.h, no swap is ever compiled in for them.
+ */
+template <typename T>
+struct BigEndian {
+	T raw;
+
+	operator T() const { return swap(raw); }
+	BigEndian& operator=(T v) { raw = swap(v); return *this; }
+	BigEndian& operator+=(T v) { return *this = T(*this) + v; }
+	BigEndian& operator-=(T v) { return *this = T(*this) - v; }
+	BigEndian& operator|=(T v) { return *this = T(*this) | v; }
+	BigEndian& operator&=(T v) { return *this = T(*this) & v; }
+	BigEndian& operator++() { return *this = T(*this) + 1; }
+	T operator++(int) { T old = *this; *this = old + 1; return old; }
+
+	static T swap(T v){
+		switch(sizeof(T)){
+			case 2: return static_cast<T>(__builtin_bswap16(static_cast<uint16_t>(v)));
+			case 4: return static_cast<T>(__builtin_bswap32(static_cast<uint32_t>(v)));
+			case 8: return static_cast<T>(__builtin_bswap64(static_cast<uint64_t>(v)));
+			default: return v;
+		}
+	}
+};
+
+// Big-endian mirrors of the elf.h structures, same layout and names.
+
+struct Elf32BE_Ehdr {
+	unsigned char e_ident[EI_NIDENT];
+	BigEndian<Elf32_Half> e_type;
+	BigEndian<Elf32_Half> e_machine;
+	BigEndian<Elf32_Word> e_version;
+	BigEndian<Elf32_Addr> e_entry;
+	BigEndian<Elf32_Off> e_phoff;
+	BigEndian<Elf32_Off> e_shoff;
+	BigEndian<Elf32_Word> e_flags;
+	BigEndian<Elf32_Half> e_ehsize;
+	BigEndian<Elf32_Half> e_phentsize;
+	BigEndian<Elf32_Half> e_phnum;
+	BigEndian<Elf32_Half> e_shentsize;
+	BigEndian<Elf32_Half> e_shnum;
+	BigEndian<Elf32_Half> e_shstrndx;
+	bool checkMagic() const {
+		return (memcmp(e_ident, ElfMagic, strlen(ElfMagic))) == 0;
+	}
+	unsigned char getFileClass() const { return e_ident[EI_CLASS]; }
+	unsigned char getDataEncoding() const { return e_ident[EI_DATA]; }
+};
+
+struct Elf64BE_Ehdr {
+	unsigned char e_ident[EI_NIDENT];
+	BigEndian<Elf64_Half> e_type;
+	BigEndian<Elf64_Half> e_machine;
+	BigEndian<Elf64_Word> e_version;
+	BigEndian<Elf64_Addr> e_entry;
+	BigEndian<Elf64_Off> e_phoff;
+	BigEndian<Elf64_Off> e_shoff;
+	BigEndian<Elf64_Word> e_flags;
+	BigEndian<Elf64_Half> e_ehsize;
+	BigEndian<Elf64_Half> e_phentsize;
+	BigEndian<Elf64_Half> e_phnum;
+	BigEndian<Elf64_Half> e_shentsize;
+	BigEndian<Elf64_Half> e_shnum;
+	BigEndian<Elf64_Half> e_shstrndx;
+	bool checkMagic() const {
+		return (memcmp(e_ident, ElfMagic, strlen(ElfMagic))) == 0;
+	}
+	unsigned char getFileClass() const { return e_ident[EI_CLASS]; }
+	unsigned char getDataEncoding() const { return e_ident[EI_DATA]; }
+};
+
+struct Elf32BE_Shdr {
+	BigEndian<Elf32_Word> sh_name;
+	BigEndian<Elf32_Word> sh_type;
+	BigEndian<Elf32_Word> sh_flags;
+	BigEndian<Elf32_Addr> sh_addr;
+	BigEndian<Elf32_Off> sh_offset;
+	BigEndian<Elf32_Word> sh_size;
+	BigEndian<Elf32_Word> sh_link;
+	BigEndian<Elf32_Word> sh_info;
+	BigEndian<Elf32_Word> sh_addralign;
+	BigEndian<Elf32_Word> sh_entsize;
+};
+
+struct Elf64BE_Shdr {
+	BigEndian<Elf64_Word> sh_name;
+	BigEndian<Elf64_Word> sh_type;
+	BigEndian<Elf64_Xword> sh_flags;
+	BigEndian<Elf64_Addr> sh_addr;
+	BigEndian<Elf64_Off> sh_offset;
+	BigEndian<Elf64_Xword> sh_size;
+	BigEndian<Elf64_Word> sh_link;
+	BigEndian<Elf64_Word> sh_info;
+	BigEndian<Elf64_Xword> sh_addralign;
+	BigEndian<Elf64_Xword> sh_entsize;
+};
+
+struct Elf32BE_Sym {
+	BigEndian<Elf32_Word> st_name;
+	BigEndian<Elf32_Addr> st_value;
+	BigEndian<Elf32_Word> st_size;
+	unsigned char st_info;
+	unsigned char st_other;
+	BigEndian<Elf32_Half> st_shndx;
+
+	unsigned char getBinding() const { return st_info >> 4; }
+	unsigned char getType() const { return st_info & 0x0f; }
+	void setBinding(unsigned char b) { setBindingAndType(b, getType()); }
+	void setType(unsigned char t) { setBindingAndType(getBinding(), t); }
+	void setBindingAndType(unsigned char b, unsigned char t) {
+		st_info = (b << 4) + (t & 0x0f);
+	}
+};
+
+struct Elf64BE_Sym {
+	BigEndian<Elf64_Word> st_name;
+	unsigned char st_info;
+	unsigned char st_other;
+	BigEndian<Elf64_Half> st_shndx;
+	BigEndian<Elf64_Addr> st_value;
+	BigEndian<Elf64_Xword> st_size;
+
+	unsigned char getBinding() const { return st_info >> 4; }
+	unsigned char getType() const { return st_info & 0x0f; }
+	void setBinding(unsigned char b) { setBindingAndType(b, getType()); }
+	void setType(unsigned char t) { setBindingAndType(getBinding(), t); }
+	void setBindingAndType(unsigned char b, unsigned char t) {
+		st_info = (b << 4) + (t & 0x0f);
+	}
+};
+
+struct Elf32BE_Rel {
+	BigEndian<Elf32_Addr> r_offset;
+	BigEndian<Elf32_Word> r_info;
+
+	Elf32_Word getSymbol() const { return (r_info >> 8); }
+	unsigned char getType() const { return (unsigned char) (r_info & 0x0ff); }
+	void setSymbol(Elf32_Word s) { setSymbolAndType(s, getType()); }
+	void setType(unsigned char t) { setSymbolAndType(getSymbol(), t); }
+	void setSymbolAndType(Elf32_Word s, unsigned char t) {
+		r_info = (s << 8) + t;
+	}
+};
+
+struct Elf32BE_Rela {
+	BigEndian<Elf32_Addr> r_offset;
+	BigEndian<Elf32_Word> r_info;
+	BigEndian<Elf32_Sword> r_addend;
+
+	Elf32_Word getSymbol() const { return (r_info >> 8); }
+	unsigned char getType() const { return (unsigned char) (r_info & 0x0ff); }
+	void setSymbol(Elf32_Word s) { setSymbolAndType(s, getType()); }
+	void setType(unsigned char t) { setSymbolAndType(getSymbol(), t); }
+	void setSymbolAndType(Elf32_Word s, unsigned char t) {
+		r_info = (s << 8) + t;
+	}
+};
+
+struct Elf64BE_Rel {
+	BigEndian<Elf64_Addr> r_offset;
+	BigEndian<Elf64_Xword> r_info;
+
+	Elf64_Word getSymbol() const { return (r_info >> 32); }
+	Elf64_Word getType() const { return (Elf64_Word) (r_info & 0xffffffffL); }
+	void setSymbol(Elf64_Word s) { setSymbolAndType(s, getType()); }
+	void setType(Elf64_Word t) { setSymbolAndType(getSymbol(), t); }
+	void setSymbolAndType(Elf64_Word s, Elf64_Word t) {
+		r_info = ((Elf64_Xword)s << 32) + (t&0xffffffffL);
+	}
+};
+
+struct Elf64BE_Rela {
+	BigEndian<Elf64_Addr> r_offset;
+	BigEndian<Elf64_Xword> r_info;
+	BigEndian<Elf64_Sxword> r_addend;
+
+	Elf64_Word getSymbol() const { return (r_info >> 32); }
+	Elf64_Word getType() const { return (Elf64_Word) (r_info & 0xffffffffL); }
+	void setSymbol(Elf64_Word s) { setSymbolAndType(s, getType()); }
+	void setType(Elf64_Word t) { setSymbolAndType(getSymbol(), t); }
+	void setSymbolAndType(Elf64_Word s, Elf64_Word t) {
+		r_info = ((Elf64_Xword)s << 32) + (t&0xffffffffL);
+	}
+};
+
+struct Elf32BE_Phdr {
+	BigEndian<Elf32_Word> p_type;
+	BigEndian<Elf32_Off> p_offset;
+	BigEndian<Elf32_Addr> p_vaddr;
+	BigEndian<Elf32_Addr> p_paddr;
+	BigEndian<Elf32_Word> p_filesz;
+	BigEndian<Elf32_Word> p_memsz;
+	BigEndian<Elf32_Word> p_flags;
+	BigEndian<Elf32_Word> p_align;
+};
+
+struct Elf64BE_Phdr {
+	BigEndian<Elf64_Word> p_type;
+	BigEndian<Elf64_Word> p_flags;
+	BigEndian<Elf64_Off> p_offset;
+	BigEndian<Elf64_Addr> p_vaddr;
+	BigEndian<Elf64_Addr> p_paddr;
+	BigEndian<Elf64_Xword> p_filesz;
+	BigEndian<Elf64_Xword> p_memsz;
+	BigEndian<Elf64_Xword> p_align;
+};
+
+struct Elf32BE_Dyn {
+	BigEndian<Elf32_Sword> d_tag;
+	union {
+		BigEndian<Elf32_Word> d_val;
+		BigEndian<Elf32_Addr> d_ptr;
+	} d_un;
+};
+
+struct Elf64BE_Dyn {
+	BigEndian<Elf64_Sxword> d_tag;
+	union {
+		BigEndian<Elf64_Xword> d_val;
+		BigEndian<Elf64_Addr> d_ptr;
+	} d_un;
+};
+
+struct ElfBE_Verdef {
+	BigEndian<Elf32_Half> vd_version;
+	BigEndian<Elf32_Half> vd_flags;
+	BigEndian<Elf32_Half> vd_ndx;
+	BigEndian<Elf32_Half> vd_cnt;
+	BigEndian<Elf32_Word> vd_hash;
+	BigEndian<Elf32_Word> vd_aux;
+	BigEndian<Elf32_Word> vd_next;
+};
+
+struct ElfBE_Verdaux {
+	BigEndian<Elf32_Word> vda_name;
+	BigEndian<Elf32_Word> vda_next;
+};
+
+struct ElfBE_Verneed {
+	BigEndian<Elf32_Half> vn_version;
+	BigEndian<Elf32_Half> vn_cnt;
+	BigEndian<Elf32_Word> vn_file;
+	BigEndian<Elf32_Word> vn_aux;
+	BigEndian<Elf32_Word> vn_next;
+};
+
+struct ElfBE_Vernaux {
+	BigEndian<Elf32_Word> vna_hash;
+	BigEndian<Elf32_Half> vna_flags;
+	BigEndian<Elf32_Half> vna_other;
+	BigEndian<Elf32_Word> vna_name;
+	BigEndian<Elf32_Word> vna_next;
+};
+
+struct ElfTypes32BE : public ElfTypes32 {
+	typedef Elf32BE_Ehdr Ehdr;
+	typedef Elf32BE_Shdr Shdr;
+	typedef Elf32BE_Sym Sym;
+	typedef Elf32BE_Rel Rel;
+	typedef Elf32BE_Rela Rela;
+	typedef Elf32BE_Phdr Phdr;
+	typedef Elf32BE_Dyn Dyn;
+	typedef ElfBE_Verdef Verdef;
+	typedef ElfBE_Verdaux Verdaux;
+	typedef ElfBE_Verneed Verneed;
+	typedef ElfBE_Vernaux Vernaux;
+	template <typename T> using Field = BigEndian<T>;
+};
+
+struct ElfTypes64BE : public ElfTypes64 {
+	typedef Elf64BE_Ehdr Ehdr;
+	typedef Elf64BE_Shdr Shdr;
+	typedef Elf64BE_Sym Sym;
+	typedef Elf64BE_Rel Rel;
+	typedef Elf64BE_Rela Rela;
+	typedef Elf64BE_Phdr Phdr;
+	typedef Elf64BE_Dyn Dyn;
+	typedef ElfBE_Verdef Verdef;
+	typedef ElfBE_Verdaux Verdaux;
+	typedef ElfBE_Verneed Verneed;
+	typedef ElfBE_Vernaux Vernaux;
+	template <typename T> using Field = BigEndian<T>;
+};
+
+#endif
@@ -0,0 +1,415 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "DependencyGraph.h"
+#include "exutil.h"
+#include "Log.h"
+
+uint32_t StringPool::intern(const std::string& s){
+	auto it = ids.find(s);
+	if(it != ids.end()) return it->second;
+	uint32_t id = strings.size();
+	strings.push_back(s);
+	ids.insert(std::make_pair(s, id));
+	return id;
+}
+
+static std::string baseName(const std::string& path){
+	size_t slash = path.rfind('/');
+	return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+static std::string dirName(const std::string& path){
+	size_t slash = path.rfind('/');
+	return slash == std::string::npos ? std::string(".") : path.substr(0, slash);
+}
+
+// Every *.so under dir, the subdirectories too.
+static void listLibraries(const std::string& dir, std::vector<std::string>& paths){
+	DIR* d = opendir(dir.c_str());
+	if(d == NULL) return;
+	struct dirent* ent;
+	while((ent = readdir(d)) != NULL){
+		std::string name = ent->d_name;
+		if(name == "." || name == "..") continue;
+		std::string path = dir + "/" + name;
+		struct stat st;
+		if(stat(path.c_str(), &st) != 0) continue;
+		if(S_ISDIR(st.st_mode)){
+			listLibraries(path, paths);
+		} else if(S_ISREG(st.st_mode) && name.size() > 3 && name.compare(name.size() - 3, 3, ".so") == 0){
+			paths.push_back(path);
+		}
+	}
+	closedir(d);
+}
+
+/**
+ * Pick the names out of a library read into memory. Addresses are
+ * mapped to file offsets through PT_LOAD, every access is bounds
+ * checked, a broken file only loses what can't be read.
+ */
+template <typename ELF>
+static bool readLibrary(const std::vector<uint8_t>& file, LibraryInfo& info){
+	typedef typename ELF::Addr Elf_Addr;
+	typedef typename ELF::Off Elf_Off;
+	typedef typename ELF::Word Elf_Word;
+	typedef typename ELF::Ehdr Elf_Ehdr;
+	typedef typename ELF::Phdr Elf_Phdr;
+	typedef typename ELF::Dyn Elf_Dyn;
+	typedef typename ELF::Sym Elf_Sym;
+	typedef typename ELF::template Field<uint32_t> Elf_Word32;
+	const uint8_t* data = &file[0];
+	size_t size = file.size();
+	if(size < sizeof(Elf_Ehdr)) return false;
+	const Elf_Ehdr* ehdr = reinterpret_cast<const Elf_Ehdr*>(data);
+	Elf_Off phoff = ehdr->e_phoff;
+	size_t phnum = ehdr->e_phnum;
+	if(phnum == 0 || phoff > size || phnum * sizeof(Elf_Phdr) > size - phoff) return false;
+	const Elf_Phdr* phdr = reinterpret_cast<const Elf_Phdr*>(data + phoff);
+	info.elfClass = ELF::kElfClass;
+	info.machine = ehdr->e_machine;
+
+	// File bytes behind a virtual address, 0 if it is not in the file.
+	auto avail = [&](Elf_Addr addr, Elf_Off* off) -> size_t {
+		for(size_t i = 0; i < phnum; i++){
+			if(phdr[i].p_type != PT_LOAD || addr < phdr[i].p_vaddr || addr - phdr[i].p_vaddr >= phdr[i].p_filesz) continue;
+			*off = phdr[i].p_offset + (addr - phdr[i].p_vaddr);
+			if(*off >= size) return 0;
+			return std::min<size_t>(phdr[i].p_filesz - (addr - phdr[i].p_vaddr), size - *off);
+		}
+		return 0;
+	};
+	auto at = [&](Elf_Addr addr, size_t len) -> const uint8_t* {
+		Elf_Off off = 0;
+		return addr != 0 && avail(addr, &off) >= len ? data + off : nullptr;
+	};
+
+	const Elf_Dyn* dyn = nullptr;
+	size_t dyn_count = 0;
+	for(size_t i = 0; i < phnum; i++){
+		if(phdr[i].p_type != PT_DYNAMIC) continue;
+		if(phdr[i].p_offset < size && phdr[i].p_filesz <= size - phdr[i].p_offset){
+			dyn = reinterpret_cast<const Elf_Dyn*>(data + phdr[i].p_offset);
+			dyn_count = phdr[i].p_filesz / sizeof(Elf_Dyn);
+		}
+		break;
+	}
+	if(dyn == nullptr) return false;
+
+	Elf_Addr strtab_addr = 0, symtab_addr = 0, hash = 0, gnu_hash = 0;
+	size_t strsz = 0;
+	std::vector<Elf_Addr> needed;
+	Elf_Addr soname = ~(Elf_Addr)0;
+	for(size_t i = 0; i < dyn_count && dyn[i].d_tag != DT_NULL; i++){
+		switch(dyn[i].d_tag){
+			case DT_NEEDED: needed.push_back(dyn[i].d_un.d_val); break;
+			case DT_SONAME: soname = dyn[i].d_un.d_val; break;
+			case DT_STRTAB: strtab_addr = dyn[i].d_un.d_ptr; break;
+			case DT_STRSZ: strsz = dyn[i].d_un.d_val; break;
+			case DT_SYMTAB: symtab_addr = dyn[i].d_un.d_ptr; break;
+			case DT_HASH: hash = dyn[i].d_un.d_ptr; break;
+			case DT_GNU_HASH: gnu_hash = dyn[i].d_un.d_ptr; break;
+			default: break;
+		}
+	}
+	const char* strtab = reinterpret_cast<const char*>(at(strtab_addr, strsz));
+	if(strtab == nullptr || strsz == 0) return false;
+	auto name = [&](Elf_Addr off) -> std::string {
+		if(off >= strsz) return std::string();
+		return std::string(strtab + off, strnlen(strtab + off, strsz - off));
+	};
+
+	for(Elf_Addr off : needed){
+		std::string s = name(off);
+		if(!s.empty()) info.needed.push_back(s);
+	}
+	info.soname = soname != ~(Elf_Addr)0 ? name(soname) : std::string();
+	if(info.soname.empty()) info.soname = baseName(info.path);
+
+	// Number of symbols, the same ways ELFRebuilder::countDynsym() goes.
+	size_t nsyms = 0;
+	if(const uint8_t* p = at(hash, 2 * sizeof(Elf_Word))){
+		nsyms = reinterpret_cast<const Elf_Word32*>(p)[1];
+	} else if(const uint8_t* p = at(gnu_hash, 4 * sizeof(uint32_t))){
+		const Elf_Word32* header = reinterpret_cast<const Elf_Word32*>(p);
+		uint32_t nbucket = header[0], symndx = header[1], maskwords = header[2];
+		Elf_Addr buckets = gnu_hash + 4 * sizeof(uint32_t) + (Elf_Addr)maskwords * sizeof(Elf_Addr);
+		const Elf_Word32* bucket = reinterpret_cast<const Elf_Word32*>(at(buckets, nbucket * sizeof(uint32_t)));
+		uint32_t last = 0;
+		for(uint32_t i = 0; bucket != nullptr && i < nbucket; i++){
+			last = std::max<uint32_t>(last, bucket[i]);
+		}
+		nsyms = symndx;
+		Elf_Off off = 0;
+		Elf_Addr chain = buckets + (Elf_Addr)nbucket * sizeof(uint32_t) + (Elf_Addr)(last - symndx) * sizeof(uint32_t);
+		size_t n = last >= symndx ? avail(chain, &off) / sizeof(uint32_t) : 0;
+		const Elf_Word32* entry = reinterpret_cast<const Elf_Word32*>(data + off);
+		for(size_t i = 0; i < n; i++){
+			if(entry[i] & 1){
+				nsyms = last + i + 1;
+				break;
+			}
+		}
+	} else if(strtab_addr > symtab_addr){
+		nsyms = (strtab_addr - symtab_addr) / sizeof(Elf_Sym);
+	}
+	Elf_Off symoff = 0;
+	nsyms = std::min(nsyms, symtab_addr != 0 ? avail(symtab_addr, &symoff) / sizeof(Elf_Sym) : 0);
+	const Elf_Sym* syms = reinterpret_cast<const Elf_Sym*>(data + symoff);
+
+	for(size_t i = 1; i < nsyms; i++){
+		const Elf_Sym& sym = syms[i];
+		if(sym.getBinding() == STB_LOCAL || sym.getType() == STT_SECTION || sym.getType() == STT_FILE) continue;
+		std::string s = name(sym.st_name);
+		if(s.empty()) continue;
+		if(sym.st_shndx == SHN_UNDEF){
+			info.imports.push_back(s);
+		} else{
+			info.exports.push_back(s);
+		}
+	}
+	return true;
+}
+
+static bool readLibraryFile(const std::string& path, LibraryInfo& info){
+	FILE* fp = fopen(path.c_str(), "rb");
+	if(fp == NULL) return false;
+	std::vector<uint8_t> file;
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	bool ok = size > EI_NIDENT;
+	if(ok){
+		file.resize(size);
+		ok = fseek(fp, 0, SEEK_SET) == 0 && fread(&file[0], 1, size, fp) == (size_t)size;
+	}
+	fclose(fp);
+	if(!ok || memcmp(&file[0], ElfMagic, strlen(ElfMagic)) != 0) return false;
+
+	info.path = path;
+	unsigned char cls = file[EI_CLASS], data = file[EI_DATA];
+	if(cls == ELFCLASS32 && data == ELFDATA2LSB) return readLibrary<ELF32>(file, info);
+	if(cls == ELFCLASS64 && data == ELFDATA2LSB) return readLibrary<ELF64>(file, info);
+	if(cls == ELFCLASS32 && data == ELFDATA2MSB) return readLibrary<ELF32BE>(file, info);
+	if(cls == ELFCLASS64 && data == ELFDATA2MSB) return readLibrary<ELF64BE>(file, info);
+	return false;
+}
+
+/**
+ * Read every library under dir. Files are handed out to one worker per
+ * core, each reads its files once and keeps plain strings. They are
+ * interned afterwards by build(), so the workers share nothing.
+ * Return the number of libraries read.
+ */
+size_t DependencyGraph::scan(const std::string& dir){
+	std::string root = dir;
+	while(root.size() > 1 && root[root.size()-1] == '/') root.erase(root.size()-1);
+	std::vector<std::string> paths;
+	listLibraries(root, paths);
+	// Sorted, so the graph comes out the same on every run.
+	std::sort(paths.begin(), paths.end());
+
+	infos.assign(paths.size(), LibraryInfo());
+	std::vector<char> ok(paths.size(), 0);
+	std::atomic<size_t> next(0);
+	auto worker = [&](){
+		for(size_t i = next++; i < paths.size(); i = next++){
+			ok[i] = readLibraryFile(paths[i], infos[i]);
+		}
+	};
+	size_t count = std::max(1u, std::thread::hardware_concurrency());
+	count = std::min(count, paths.size());
+	std::vector<std::thread> threads;
+	for(size_t i = 0; i < count; i++){
+		threads.push_back(std::thread(worker));
+	}
+	for(std::thread& t : threads){
+		t.join();
+	}
+
+	size_t kept = 0;
+	for(size_t i = 0; i < paths.size(); i++){
+		if(!ok[i]){
+			VLOG("\"%s\" has no dynamic section, skipped.", paths[i].c_str());
+			continue;
+		}
+		if(kept != i) infos[kept] = std::move(infos[i]);
+		kept++;
+	}
+	infos.resize(kept);
+	DLOG("%zu of %zu libraries read with %zu threads.", kept, paths.size(), count);
+	return kept;
+}
+
+void DependencyGraph::build(){
+	libs.clear();
+	edges.clear();
+	byName.clear();
+
+	libs.resize(infos.size());
+	for(size_t i = 0; i < infos.size(); i++){
+		const LibraryInfo& info = infos[i];
+		Library& lib = libs[i];
+		lib.path = pool.intern(info.path);
+		lib.soname = pool.intern(info.soname);
+		lib.dir = pool.intern(dirName(info.path));
+		lib.elfClass = info.elfClass;
+		lib.machine = info.machine;
+		for(const std::string& s : info.needed) lib.needed.push_back(pool.intern(s));
+		for(const std::string& s : info.exports) lib.exports.push_back(pool.intern(s));
+		for(const std::string& s : info.imports) lib.imports.push_back(pool.intern(s));
+		std::sort(lib.exports.begin(), lib.exports.end());
+		lib.exports.erase(std::unique(lib.exports.begin(), lib.exports.end()), lib.exports.end());
+
+		// DT_NEEDED names the SONAME, but a file name is a good match too.
+		byName[lib.soname].push_back(i);
+		uint32_t base = pool.intern(baseName(info.path));
+		if(base != lib.soname) byName[base].push_back(i);
+	}
+	infos.clear();
+
+	for(size_t i = 0; i < libs.size(); i++){
+		for(uint32_t name : libs[i].needed){
+			Edge edge;
+			edge.from = i;
+			edge.to = resolve(libs[i], name);
+			edge.name = name;
+			edge.bound = 0;
+			if(edge.to != kExternal){
+				const std::vector<uint32_t>& exports = libs[edge.to].exports;
+				for(uint32_t sym : libs[i].imports){
+					edge.bound += std::binary_search(exports.begin(), exports.end(), sym);
+				}
+			}
+			edges.push_back(edge);
+		}
+	}
+}
+
+/**
+ * The library a DT_NEEDED entry loads. It must be of the same class and
+ * machine, one in the same directory wins, like the ABI directories of
+ * an APK.
+ */
+uint32_t DependencyGraph::resolve(const Library& lib, uint32_t name){
+	auto it = byName.find(name);
+	if(it == byName.end()) return kExternal;
+	uint32_t found = kExternal;
+	for(uint32_t idx : it->second){
+		const Library& cand = libs[idx];
+		if(&cand == &lib || cand.elfClass != lib.elfClass || cand.machine != lib.machine) continue;
+		if(cand.dir == lib.dir) return idx;
+		if(found == kExternal) found = idx;
+	}
+	return found;
+}
+
+size_t DependencyGraph::getExternalCount(){
+	size_t count = 0;
+	for(const Edge& edge : edges){
+		count += edge.to == kExternal;
+	}
+	return count;
+}
+
+static std::string dotEscape(const std::string& s){
+	std::string out;
+	for(char c : s){
+		if(c == '"' || c == '\\') out.push_back('\\');
+		out.push_back(c);
+	}
+	return out;
+}
+
+/**
+ * Libraries are boxes labelled with their SONAME, a DT_NEEDED which is
+ * not in the corpus is a dashed box. An edge is labelled with the
+ * number of imports the needed library exports.
+ */
+bool DependencyGraph::writeDot(const char* path){
+	FILE* fp = fopen(path, "w");
+	if(fp == NULL) return false;
+	fprintf(fp, "digraph needed {\n\tnode [shape=box];\n");
+	for(size_t i = 0; i < libs.size(); i++){
+		const Library& lib = libs[i];
+		fprintf(fp, "\tL%zu [label=\"%s\", tooltip=\"%s\\nexports %zu, imports %zu\"];\n", i,
+				dotEscape(pool.get(lib.soname)).c_str(), dotEscape(pool.get(lib.path)).c_str(),
+				lib.exports.size(), lib.imports.size());
+	}
+	std::vector<char> external(pool.size(), 0);
+	for(const Edge& edge : edges){
+		if(edge.to != kExternal || external[edge.name]) continue;
+		external[edge.name] = 1;
+		fprintf(fp, "\tX%u [label=\"%s\", style=dashed];\n", edge.name, dotEscape(pool.get(edge.name)).c_str());
+	}
+	for(const Edge& edge : edges){
+		if(edge.to == kExternal){
+			fprintf(fp, "\tL%u -> X%u [style=dashed];\n", edge.from, edge.name);
+		} else{
+			fprintf(fp, "\tL%u -> L%u [label=\"%u\"];\n", edge.from, edge.to, edge.bound);
+		}
+	}
+	fprintf(fp, "}\n");
+	fclose(fp);
+	return true;
+}
+
+static void putWord(std::vector<uint8_t>& out, uint32_t v){
+	for(int i = 0; i < 4; i++){
+		out.push_back((v >> (i * 8)) & 0xff);
+	}
+}
+
+static void putList(std::vector<uint8_t>& out, const std::vector<uint32_t>& list){
+	putWord(out, list.size());
+	for(uint32_t v : list) putWord(out, v);
+}
+
+/**
+ * All words are 32-bit little-endian, strings are referred to by index.
+ *   "SBDG"  version(1)
+ *   string count, then each string with its '\0'
+ *   library count, each: path, soname, elf class, machine,
+ *                        needed list, export list, import list
+ *                        (a list is its length followed by the indexes)
+ *   edge count, each: from, to (0xffffffff if not in the corpus),
+ *                     DT_NEEDED string, imports bound
+ */
+bool DependencyGraph::writeBinary(const char* path){
+	std::vector<uint8_t> out;
+	out.insert(out.end(), {'S', 'B', 'D', 'G'});
+	putWord(out, 1);
+	putWord(out, pool.size());
+	for(size_t i = 0; i < pool.size(); i++){
+		const std::string& s = pool.get(i);
+		out.insert(out.end(), s.begin(), s.end());
+		out.push_back('\0');
+	}
+	putWord(out, libs.size());
+	for(const Library& lib : libs){
+		putWord(out, lib.path);
+		putWord(out, lib.soname);
+		putWord(out, lib.elfClass);
+		putWord(out, lib.machine);
+		putList(out, lib.needed);
+		putList(out, lib.exports);
+		putList(out, lib.imports);
+	}
+	putWord(out, edges.size());
+	for(const Edge& edge : edges){
+		putWord(out, edge.from);
+		putWord(out, edge.to);
+		putWord(out, edge.name);
+		putWord(out, edge.bound);
+	}
+
+	FILE* fp = fopen(path, "wb");
+	if(fp == NULL) return false;
+	bool ok = fwrite(&out[0], 1, out.size(), fp) == out.size();
+	fclose(fp);
+	return ok;
+}
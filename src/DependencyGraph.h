@@ -0,0 +1,84 @@
+#ifndef _SO_REBUILDER_DEPENDENCYGRAPH_H_
+#define _SO_REBUILDER_DEPENDENCYGRAPH_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+/**
+ * The DT_NEEDED graph of every library under a directory, like the
+ * lib/ of an unpacked APK. It tells which library pulls in which, so
+ * repair and symbol resolution can go in dependency order.
+ *
+ *   scan()    ==>  read the libraries in parallel, one pass each
+ *   build()   ==>  intern every name, resolve DT_NEEDED to the
+ *                  libraries found and count the symbols bound
+ *   write*()  ==>  DOT, or the compact binary form described at
+ *                  writeBinary()
+ */
+
+/* What one library says about itself and its dependencies. */
+struct LibraryInfo{
+	std::string path;
+	std::string soname;			// DT_SONAME, or the file name without it
+	unsigned char elfClass = 0;
+	unsigned machine = 0;
+	std::vector<std::string> needed;
+	std::vector<std::string> exports;	// defined global and weak symbols
+	std::vector<std::string> imports;	// undefined ones
+};
+
+/* Every name is stored once and referred to by its index. */
+class StringPool{
+public:
+	uint32_t intern(const std::string& s);
+	const std::string& get(uint32_t id) const { return strings[id]; }
+	size_t size() const { return strings.size(); }
+private:
+	std::unordered_map<std::string, uint32_t> ids;
+	std::vector<std::string> strings;
+};
+
+class DependencyGraph{
+
+public:
+	static const uint32_t kExternal = 0xffffffff;	// DT_NEEDED not found in the corpus
+
+	size_t scan(const std::string& dir);
+	void build();
+	bool writeDot(const char* path);
+	bool writeBinary(const char* path);
+
+	size_t getLibraryCount() { return libs.size(); }
+	size_t getEdgeCount() { return edges.size(); }
+	size_t getExternalCount();
+
+private:
+	struct Library{
+		uint32_t path;
+		uint32_t soname;
+		uint32_t dir;
+		unsigned char elfClass;
+		unsigned machine;
+		std::vector<uint32_t> needed;
+		std::vector<uint32_t> exports;	// sorted by id
+		std::vector<uint32_t> imports;
+	};
+	struct Edge{
+		uint32_t from;			// library index
+		uint32_t to;			// library index, or kExternal
+		uint32_t name;			// the DT_NEEDED string
+		uint32_t bound;			// imports of from exported by to
+	};
+
+	uint32_t resolve(const Library& lib, uint32_t name);
+
+	std::vector<LibraryInfo> infos;
+	StringPool pool;
+	std::vector<Library> libs;
+	std::vector<Edge> edges;
+	std::unordered_map<uint32_t, std::vector<uint32_t> > byName;	// soname or file name -> libraries
+};
+
+#endif
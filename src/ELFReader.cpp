@@ -1,15 +1,21 @@
 #include <cstdio>
 #include <cstdint>
+#include <cinttypes>
 #include <cstdlib>
 #include <cstring>
+#include <cstdarg>
+#include <algorithm>
 #include "ELFReader.h"
+#include "SegmentIndex.h"
 #include "Log.h"
+#include "Stats.h"
 #include "exutil.h"
 
-ELFReader::ELFReader(const char *filename)
+template <typename ELF>
+ELFReader<ELF>::ELFReader(const char *filename)
 	: filename(filename), inputFile(NULL), damageLevel(-1), didLoad(false), didRead(false), 
 	  phdr_table(NULL), phdr_entrySize(0), phdr_num(0), phdr_size(0), 
-	  midPart_start(0), midPart_end(0), midPart_size(0), 
+	  midPart(NULL), midPart_start(0), midPart_end(0), midPart_size(0), 
 	  shdr_table(NULL), shdr_entrySize(0), shdr_num(0), shdr_size(0), 
 	  load_start(NULL), load_size(0), load_bias(0){
 
@@ -20,17 +26,37 @@ ELFReader::ELFReader(const char *filename)
 	}
 }
 
-ELFReader::~ELFReader(){
+template <typename ELF>
+ELFReader<ELF>::ELFReader(const char *name, const uint8_t* data, size_t size)
+	: filename(name), inputFile(NULL), damageLevel(-1), didLoad(false), didRead(false), 
+	  phdr_table(NULL), phdr_entrySize(0), phdr_num(0), phdr_size(0), 
+	  midPart(NULL), midPart_start(0), midPart_end(0), midPart_size(0), 
+	  shdr_table(NULL), shdr_entrySize(0), shdr_num(0), shdr_size(0), 
+	  load_start(NULL), load_size(0), load_bias(0){
+
+	// A stream over the buffer, so everything below reads it like a file.
+	inputFile = fmemopen(const_cast<uint8_t*>(data), size, "rb");
+	if(inputFile == NULL){
+		ELOG("\"%s\" cannot be read from memory.", name);
+		exit(EXIT_FAILURE);
+	}
+}
+
+template <typename ELF>
+ELFReader<ELF>::~ELFReader(){
+	if(inputFile != NULL){ fclose(inputFile); }
 	if(load_start != NULL){	delete [](uint8_t*)load_start; }
 	if(phdr_table != NULL){ delete [](uint8_t*)phdr_table; }
 	if(midPart != NULL){ delete [](uint8_t*)midPart; }
 	if(shdr_table != NULL){ delete [](uint8_t*)shdr_table; }
 }
 
-bool ELFReader::read(){
+template <typename ELF>
+bool ELFReader<ELF>::read(){
+	PhaseTimer timer(kPhaseRead);
 	if(!(readElfHeader()&&verifyElfHeader()&&readProgramHeader())){
 		ELOG("so-file invalid.");
-		exit(EXIT_FAILURE);
+		return false;
 	}
 
 	// try to figure out which plan should use to repair the so-file.
@@ -39,7 +65,7 @@ bool ELFReader::read(){
 		checkSectionHeader();
 		if(!readOtherPart()){
 			ELOG("Read other part data failed.");
-			exit(EXIT_FAILURE);
+			return false;
 		}
 	} else{
 		damageLevel = 2;
@@ -51,30 +77,33 @@ bool ELFReader::read(){
 /**
  * load function should be called after readSofile()
  */ 
-bool ELFReader::load(){
-	if(!didRead){
-		read();
+template <typename ELF>
+bool ELFReader<ELF>::load(){
+	if(!didRead && !read()){
+		return false;
 	}
+	PhaseTimer timer(kPhaseLoad);
 	if(reserveAddressSpace() && loadSegments() && findPhdr()){
 		didLoad = true;
 		return didLoad;
 	}
 	ELOG("Load segment failed.");
-	exit(EXIT_FAILURE);
+	return false;
 }
 
 // Reserve a virtual address range big enough to hold all loadable
 // segments of a program header table. This is done by creating a
 // private anonymous mmap() with PROT_NONE.
-bool ELFReader::reserveAddressSpace(){
+template <typename ELF>
+bool ELFReader<ELF>::reserveAddressSpace(){
 	Elf_Addr min_vaddr;
-	load_size = phdr_table_get_load_size(phdr_table, phdr_num, &min_vaddr);
+	load_size = phdr_table_get_load_size<ELF>(phdr_table, phdr_num, &min_vaddr);
     if (load_size == 0) {
         ELOG("\"%s\" has no loadable segments\n", filename);
         return false;
     }
 
-    uint8_t* addr = reinterpret_cast<uint8_t*>(min_vaddr);
+    uint8_t* addr = reinterpret_cast<uint8_t*>(static_cast<uintptr_t>(min_vaddr));
     // alloc map data, and load in addr
     void* start = new uint8_t[load_size];
 
@@ -87,7 +116,8 @@ bool ELFReader::reserveAddressSpace(){
  * Map all loadable segments in process' address space.
  * This assume you already called reserveAddressSpace.
  */ 
-bool ELFReader::loadSegments(){
+template <typename ELF>
+bool ELFReader<ELF>::loadSegments(){
 	for(int i=0;i<phdr_num;i++){
 		const Elf_Phdr *phdr = &phdr_table[i];
 		if(phdr->p_type != PT_LOAD){
@@ -112,7 +142,7 @@ bool ELFReader::loadSegments(){
 
 		if(file_length != 0){
 			// memory data loading
-			void* load_point = (uint8_t*)seg_page_start + load_bias;
+			void* load_point = (uint8_t*)load_bias + seg_page_start;
 			if(!loadFileData(load_point, file_length, file_page_start)){
 				ELOG("couldn't map \"%s\" segment %d", filename, i);
 				return false;
@@ -122,7 +152,7 @@ bool ELFReader::loadSegments(){
 		// if the segment is writable, and does not end on a page boundary,
 		// zero-fill it until the page limit.
 		if((phdr->p_flags & PF_W) != 0 && PAGE_OFFSET(seg_file_end) > 0){
-			memset((uint8_t*)seg_file_end + load_bias, 0, PAGE_SIZE - PAGE_OFFSET(seg_file_end));
+			memset((uint8_t*)load_bias + seg_file_end, 0, PAGE_SIZE - PAGE_OFFSET(seg_file_end));
 		}
 		seg_file_end = PAGE_END(seg_file_end);
 
@@ -143,7 +173,8 @@ bool ELFReader::loadSegments(){
  * segments in memory. This is in contrast with 'phdr_table_' which
  * is temporary and will be released before the library is relocated.
  */
-bool ELFReader::findPhdr() {
+template <typename ELF>
+bool ELFReader<ELF>::findPhdr() {
     const Elf_Phdr *phdr_limit = phdr_table + phdr_num;
 
 	// If there is a PT_PHDR, use it directly
@@ -159,10 +190,10 @@ bool ELFReader::findPhdr() {
 	for(const Elf_Phdr* phdr = phdr_table; phdr < phdr_limit; phdr++){
 		if(phdr->p_type == PT_LOAD){
 			if(phdr->p_offset == 0){
-				Elf_Addr elf_addr = load_bias + phdr->p_vaddr;
+				uintptr_t elf_addr = load_bias + phdr->p_vaddr;
 				const Elf_Ehdr* ehdr = (const Elf_Ehdr*)(void *)elf_addr;
-				Elf_Addr offset = ehdr->e_phoff;
-				return checkPhdr((Elf_Addr)ehdr + offset);
+				Elf_Off offset = ehdr->e_phoff;
+				return checkPhdr((uintptr_t)ehdr + offset);
 			}
 			break;
 		}
@@ -176,25 +207,27 @@ bool ELFReader::findPhdr() {
  * segment. This should help catch badly-formed ELF files that 
  * would cause the linker to crash later when trying to access it.
  */
-bool ELFReader::checkPhdr(Elf_Addr loaded){
+template <typename ELF>
+bool ELFReader<ELF>::checkPhdr(uintptr_t loaded){
 	const Elf_Phdr* phdr_limit = phdr_table + phdr_num;
-	Elf_Addr loaded_end = loaded + (phdr_num * sizeof(Elf_Phdr));
+	uintptr_t loaded_end = loaded + (phdr_num * sizeof(Elf_Phdr));
 	for(Elf_Phdr* phdr = phdr_table; phdr < phdr_limit; phdr++){
 		if(phdr->p_type != PT_LOAD){
 			continue;
 		}
-		Elf_Addr seg_start = phdr->p_vaddr + load_bias;
-		Elf_Addr seg_end = seg_start + phdr->p_filesz;
+		uintptr_t seg_start = phdr->p_vaddr + load_bias;
+		uintptr_t seg_end = seg_start + phdr->p_filesz;
 		if(seg_start <= loaded && loaded_end <= seg_end){
 			loaded_phdr = reinterpret_cast<const Elf_Phdr*>(loaded);
 			return true;
 		}
 	}
-	ELOG("\"%s\" loaded phdr %x not in loadable segment", filename, loaded);
+	ELOG("\"%s\" loaded phdr %" PRIx64 " not in loadable segment", filename, (uint64_t)loaded);
 	return false;
 }
 
-void ELFReader::damagePrint(){
+template <typename ELF>
+void ELFReader<ELF>::damagePrint(){
 	switch(damageLevel){
 		case -1:
 			LOG("Not verify yet."); break;
@@ -209,8 +242,10 @@ void ELFReader::damagePrint(){
 	}
 }
 
-bool ELFReader::readElfHeader(){
+template <typename ELF>
+bool ELFReader<ELF>::readElfHeader(){
 	size_t sz = fread(&elf_header, sizeof(char), sizeof(elf_header), inputFile);
+	STAT_COUNT(kBytesRead, sz);
 	
 	if(sz < 0){
 		ELOG("Cannot read file \"%s\"", filename);
@@ -226,26 +261,22 @@ bool ELFReader::readElfHeader(){
 }
 
 /* Assume that elf header have been read successful. */
-bool ELFReader::verifyElfHeader(){
+template <typename ELF>
+bool ELFReader<ELF>::verifyElfHeader(){
 	
 	if(!elf_header.checkMagic()){ // using the function elf.h support
 		ELOG("\"%s\" has bad elf magic number. May not an elf file", filename);
 		return false;
 	}
 	
-	if(elf_header.getFileClass() == ELFCLASS64){
-		ELOG("Not support 64-bit so repair temporary.");
+	if(elf_header.getFileClass() != ELF::kElfClass){
+		ELOG("\"%s\" is not a %d-bit file", filename, ELF::kBits);
 		return false;
 	}
+	VLOG("%d-bit file \"%s\" read.", ELF::kBits, filename);
 	
-	if(elf_header.getFileClass() != ELFCLASS32){
-		ELOG("\"%s\" is not a 32-bit file", filename);
-		return false;
-	}
-	VLOG("32-bit file \"%s\" read.", filename);
-	
-	if(elf_header.getDataEncoding() != ELFDATA2LSB){
-		ELOG("\"%s\" not little-endian. Unsupport.", filename);
+	if(elf_header.getDataEncoding() != ELF::kElfData){
+		ELOG("\"%s\" is not %s-endian.", filename, ELF::kElfData == ELFDATA2LSB ? "little" : "big");
 		return false;
 	}
 	
@@ -264,7 +295,8 @@ bool ELFReader::verifyElfHeader(){
 }
 
 
-bool ELFReader::readProgramHeader(){
+template <typename ELF>
+bool ELFReader<ELF>::readProgramHeader(){
 	phdr_num = elf_header.e_phnum;
 	phdr_entrySize = elf_header.e_phentsize;
 
@@ -286,7 +318,8 @@ bool ELFReader::readProgramHeader(){
 	return true;
 }
 
-bool ELFReader::readSectionHeader(){
+template <typename ELF>
+bool ELFReader<ELF>::readSectionHeader(){
 	if(elf_header.e_shnum < 1){
 		// Because program valid is necessary. So we use ELOG print the error message.
 		// But section need to be repaired. So we accept it invalid.
@@ -321,7 +354,8 @@ bool ELFReader::readSectionHeader(){
  * Just for build the new file.
  * So we can assume that program header and section header valid here. 
  */
-bool ELFReader::readOtherPart(){
+template <typename ELF>
+bool ELFReader<ELF>::readOtherPart(){
 	midPart_start = elf_header.e_phoff + phdr_num*phdr_entrySize;
 	midPart_end = elf_header.e_shoff;
 	midPart_size = midPart_end - midPart_start;
@@ -340,7 +374,8 @@ bool ELFReader::readOtherPart(){
  * Just verify the status of section header.
  * Do not try to repair it.
  */
-bool ELFReader::checkSectionHeader(){
+template <typename ELF>
+bool ELFReader<ELF>::checkSectionHeader(){
 	//check SHN_UNDEF section
 	Elf_Shdr temp;
 	memset((void *)&temp, 0, sizeof(Elf_Shdr));
@@ -350,15 +385,18 @@ bool ELFReader::checkSectionHeader(){
 		return false;
 	}
 
-	// Get the two load segment index at phdr_table.
+	// Get the first two load segments.
 	// Thus wo can use segment load address and offset 
 	// to check the section header.
-	int loadIndex[2] = {-1, -1};
-	for(int i=0, j=0;i<phdr_num;i++){
-		if(phdr_table[i].p_type == PT_LOAD){
-			loadIndex[j++] = i;
-		}
+	SegmentIndex<ELF> segments;
+	segments.build(phdr_table, phdr_num, elf_header.e_machine);
+	if(segments.loads.size() < 2){
+		VLOG("Less than two LOAD segments, the section mapping cannot be checked.");
+		damageLevel = 2;
+		return false;
 	}
+	const Elf_Phdr* firstLoad = segments.loads[0];
+	const Elf_Phdr* secondLoad = segments.loads[1];
 
 	bool isShdrValid = true;
 	size_t firstAddress = sizeof(Elf_Ehdr) + getPhdrSize();
@@ -395,7 +433,7 @@ bool ELFReader::checkSectionHeader(){
 			// bits align
 			while(curAddr & (shdr_table[i].sh_addralign-1)) { curAddr++; }
 			while(curOffset & (shdr_table[i].sh_addralign-1)) {curOffset++;}
-			if(curOffset >= phdr_table[loadIndex[0]].p_filesz) { break; }
+			if(curOffset >= firstLoad->p_filesz) { break; }
 
 			if(curAddr != shdr_table[i].sh_addr || curOffset != shdr_table[i].sh_offset){
 				VLOG("Not valid section address or offset at section index %d", i);
@@ -411,8 +449,8 @@ bool ELFReader::checkSectionHeader(){
 	if(isShdrValid){
 		// Because we have already check sh_size in previous loop.
 		// We don't need to check again with this section.
-		if(shdr_table[i].sh_addr != phdr_table[loadIndex[1]].p_paddr ||
-		   shdr_table[i].sh_offset != phdr_table[loadIndex[1]].p_offset){
+		if(shdr_table[i].sh_addr != secondLoad->p_paddr ||
+		   shdr_table[i].sh_offset != secondLoad->p_offset){
 			VLOG("Not valid section address or offset at section index %d", i);
 			isShdrValid = false;
 		}
@@ -439,7 +477,7 @@ bool ELFReader::checkSectionHeader(){
 			while(curAddr & (align-1)) { curAddr++; }
 			while(curOffset & (align-1)) {curOffset++;}
 			// Beside Load segment, break
-			if(curOffset >= phdr_table[loadIndex[1]].p_filesz + phdr_table[loadIndex[1]].p_offset) { break; }
+			if(curOffset >= secondLoad->p_filesz + secondLoad->p_offset) { break; }
 
 			if(curAddr != shdr_table[i].sh_addr || curOffset != shdr_table[i].sh_offset){
 				VLOG("Not valid section address or offset at section index %d", i);
@@ -461,9 +499,252 @@ bool ELFReader::checkSectionHeader(){
 	return isShdrValid;
 }
 
-bool ELFReader::loadFileData(void *addr, size_t len, int offset){
-	fseek(inputFile, offset, SEEK_SET);
+void VerifyResult::add(const char* check, int section, const char* fmt, ...){
+	char buf[256];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	VerifyIssue issue;
+	issue.check = check;
+	issue.section = section;
+	issue.message = buf;
+	issues.push_back(issue);
+}
+
+/**
+ * Check a rebuilt file the way a loader and readelf would look at it, 
+ * without writing it out. Every problem goes to result, none of them 
+ * exits. The damage level of checkSectionHeader() is only recorded, 
+ * its guess of the section order does not fit every layout.
+ *   segment  ==>  allocated sections lie in a PT_LOAD at the matching
+ *                 offset, the others inside the file
+ *   link     ==>  sh_link points to a section of the right type
+ *   dynamic  ==>  the addresses in .dynamic are the sections'
+ *   overlap  ==>  no two sections share an address or a file byte
+ * Return true if nothing is found.
+ */
+template <typename ELF>
+bool ELFReader<ELF>::verify(VerifyResult& result){
+	if(!(readElfHeader() && verifyElfHeader() && readProgramHeader())){
+		result.add("header", -1, "elf header or program headers unreadable");
+		return false;
+	}
+	if(!readSectionHeader() || shdr_entrySize != sizeof(Elf_Shdr) || shdr_num < 2){
+		result.add("header", -1, "section headers unreadable");
+		return false;
+	}
+	checkSectionHeader();
+	result.damageLevel = damageLevel;
+	didRead = true;
+
+	size_t shstrndx = elf_header.e_shstrndx;
+	if(shstrndx == SHN_UNDEF || shstrndx >= shdr_num || shdr_table[shstrndx].sh_type != SHT_STRTAB){
+		result.add("header", -1, "e_shstrndx %zu is not a string table", shstrndx);
+	} else{
+		shstrtab.resize(shdr_table[shstrndx].sh_size + 1, '\0');
+		if(!loadFileData(&shstrtab[0], shstrtab.size() - 1, shdr_table[shstrndx].sh_offset)){
+			result.add("header", shstrndx, ".shstrtab lies outside the file");
+			shstrtab.clear();
+		}
+	}
+
+	fseek(inputFile, 0, SEEK_END);
+	size_t file_size = ftell(inputFile);
+	verifySegments(result, file_size);
+	verifyLinks(result);
+	verifyDynamic(result);
+	verifyOverlap(result);
+	return result.ok();
+}
+
+template <typename ELF>
+const char* ELFReader<ELF>::sectionName(size_t index){
+	Elf_Word name = shdr_table[index].sh_name;
+	return name + 1 < shstrtab.size() ? &shstrtab[name] : "?";
+}
+
+template <typename ELF>
+void ELFReader<ELF>::verifySegments(VerifyResult& result, size_t file_size){
+	for(size_t i = 1; i < shdr_num; i++){
+		const Elf_Shdr& shdr = shdr_table[i];
+		bool nobits = shdr.sh_type == SHT_NOBITS;
+		if(!nobits && shdr.sh_offset + shdr.sh_size > file_size){
+			result.add("segment", i, "%s [%llx, %llx) lies past the end of the file", sectionName(i),
+					   (unsigned long long)shdr.sh_offset, (unsigned long long)(shdr.sh_offset + shdr.sh_size));
+		}
+		if(!(shdr.sh_flags & SHF_ALLOC) || shdr.sh_size == 0) continue;
+
+		const Elf_Phdr* load = NULL;
+		for(size_t j = 0; j < phdr_num; j++){
+			const Elf_Phdr& phdr = phdr_table[j];
+			if(phdr.p_type == PT_LOAD && shdr.sh_addr >= phdr.p_vaddr && 
+			   shdr.sh_addr + shdr.sh_size <= phdr.p_vaddr + phdr.p_memsz){
+				load = &phdr;
+				break;
+			}
+		}
+		if(load == NULL){
+			// .tbss takes no space, it may lie past the end of the segment
+			if(!(nobits && (shdr.sh_flags & SHF_TLS))){
+				result.add("segment", i, "%s at %llx is in no PT_LOAD", sectionName(i), (unsigned long long)shdr.sh_addr);
+			}
+			continue;
+		}
+		if(nobits) continue;
+		if(shdr.sh_addr - load->p_vaddr != shdr.sh_offset - load->p_offset){
+			result.add("segment", i, "%s offset %llx does not match its address %llx", sectionName(i),
+					   (unsigned long long)shdr.sh_offset, (unsigned long long)shdr.sh_addr);
+		} else if(shdr.sh_addr + shdr.sh_size > load->p_vaddr + load->p_filesz){
+			result.add("segment", i, "%s runs past the file data of its PT_LOAD", sectionName(i));
+		}
+	}
+}
+
+template <typename ELF>
+void ELFReader<ELF>::verifyLinks(VerifyResult& result){
+	for(size_t i = 1; i < shdr_num; i++){
+		const Elf_Shdr& shdr = shdr_table[i];
+		Elf_Word link = shdr.sh_link;
+		if(link >= shdr_num){
+			result.add("link", i, "%s sh_link %d is out of range", sectionName(i), link);
+			continue;
+		}
+		Elf_Word type = shdr_table[link].sh_type;
+		bool symbols = type == SHT_DYNSYM || type == SHT_SYMTAB;
+		switch(shdr.sh_type){
+			case SHT_SYMTAB: case SHT_DYNSYM: case SHT_DYNAMIC:
+			case SHT_GNU_verdef: case SHT_GNU_verneed:
+				if(type != SHT_STRTAB) result.add("link", i, "%s links to %s, not a string table", sectionName(i), sectionName(link));
+				break;
+			case SHT_HASH: case SHT_GNU_HASH: case SHT_GNU_versym:
+				if(!symbols) result.add("link", i, "%s links to %s, not a symbol table", sectionName(i), sectionName(link));
+				break;
+			case SHT_REL: case SHT_RELA:
+				// relocations without symbols may have no link
+				if(link != 0 && !symbols) result.add("link", i, "%s links to %s, not a symbol table", sectionName(i), sectionName(link));
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+/**
+ * The section at addr must have the type the .dynamic tag says. Empty
+ * sections may share the address, so any of them will do.
+ */
+template <typename ELF>
+void ELFReader<ELF>::verifyDynamic(VerifyResult& result){
+	const Elf_Phdr* dynamic = NULL;
+	for(size_t i = 0; i < phdr_num; i++){
+		if(phdr_table[i].p_type == PT_DYNAMIC){
+			dynamic = &phdr_table[i];
+			break;
+		}
+	}
+	size_t sdynamic = 0;
+	for(size_t i = 1; i < shdr_num; i++){
+		if(shdr_table[i].sh_type == SHT_DYNAMIC){
+			sdynamic = i;
+			break;
+		}
+	}
+	if(dynamic == NULL || sdynamic == 0){
+		if(dynamic != NULL || sdynamic != 0) result.add("dynamic", sdynamic, "PT_DYNAMIC and .dynamic do not come together");
+		return;
+	}
+	if(shdr_table[sdynamic].sh_addr != dynamic->p_vaddr || shdr_table[sdynamic].sh_offset != dynamic->p_offset){
+		result.add("dynamic", sdynamic, "%s is not where PT_DYNAMIC is", sectionName(sdynamic));
+		return;
+	}
+
+	size_t count = dynamic->p_filesz / sizeof(Elf_Dyn);
+	std::vector<Elf_Dyn> dyns(count);
+	if(count == 0 || !loadFileData(&dyns[0], count * sizeof(Elf_Dyn), dynamic->p_offset)){
+		result.add("dynamic", sdynamic, "PT_DYNAMIC cannot be read");
+		return;
+	}
+	auto expect = [&](Elf_Addr addr, Elf_Word type, Elf_Word other, const char* tag){
+		bool found = false;
+		for(size_t i = 1; i < shdr_num && !found; i++){
+			found = shdr_table[i].sh_addr == addr && (shdr_table[i].sh_type == type || shdr_table[i].sh_type == other);
+		}
+		if(!found) result.add("dynamic", -1, "%s %llx is no section of the right type", tag, (unsigned long long)addr);
+	};
+	Elf_Addr strtab = 0;
+	size_t strsz = 0;
+	for(const Elf_Dyn& dyn : dyns){
+		if(dyn.d_tag == DT_NULL) break;
+		Elf_Addr ptr = dyn.d_un.d_ptr;
+		switch(dyn.d_tag){
+			case DT_STRTAB: strtab = ptr; expect(ptr, SHT_STRTAB, SHT_STRTAB, "DT_STRTAB"); break;
+			case DT_STRSZ: strsz = dyn.d_un.d_val; break;
+			case DT_SYMTAB: expect(ptr, SHT_DYNSYM, SHT_DYNSYM, "DT_SYMTAB"); break;
+			case DT_HASH: expect(ptr, SHT_HASH, SHT_HASH, "DT_HASH"); break;
+			case DT_GNU_HASH: expect(ptr, SHT_GNU_HASH, SHT_GNU_HASH, "DT_GNU_HASH"); break;
+			case DT_REL: expect(ptr, SHT_REL, SHT_REL, "DT_REL"); break;
+			case DT_RELA: expect(ptr, SHT_RELA, SHT_RELA, "DT_RELA"); break;
+			case DT_JMPREL: expect(ptr, SHT_REL, SHT_RELA, "DT_JMPREL"); break;
+			case DT_INIT_ARRAY: expect(ptr, SHT_INIT_ARRAY, SHT_INIT_ARRAY, "DT_INIT_ARRAY"); break;
+			case DT_FINI_ARRAY: expect(ptr, SHT_FINI_ARRAY, SHT_FINI_ARRAY, "DT_FINI_ARRAY"); break;
+			case DT_VERSYM: expect(ptr, SHT_GNU_versym, SHT_GNU_versym, "DT_VERSYM"); break;
+			case DT_VERDEF: expect(ptr, SHT_GNU_verdef, SHT_GNU_verdef, "DT_VERDEF"); break;
+			case DT_VERNEED: expect(ptr, SHT_GNU_verneed, SHT_GNU_verneed, "DT_VERNEED"); break;
+			default: break;
+		}
+	}
+	if(strtab != 0 && shdr_table[sdynamic].sh_link < shdr_num){
+		const Elf_Shdr& dynstr = shdr_table[shdr_table[sdynamic].sh_link];
+		if(dynstr.sh_addr != strtab || dynstr.sh_size != strsz){
+			result.add("dynamic", sdynamic, "DT_STRTAB and DT_STRSZ do not match %s", sectionName(shdr_table[sdynamic].sh_link));
+		}
+	}
+}
+
+template <typename ELF>
+void ELFReader<ELF>::verifyOverlap(VerifyResult& result){
+	struct Range{ uint64_t start, end; size_t index; };
+	std::vector<Range> addrs, offsets;
+	for(size_t i = 1; i < shdr_num; i++){
+		const Elf_Shdr& shdr = shdr_table[i];
+		if(shdr.sh_size == 0) continue;
+		bool nobits = shdr.sh_type == SHT_NOBITS;
+		// .tbss only takes space in the TLS block, not in the image
+		if((shdr.sh_flags & SHF_ALLOC) && !(nobits && (shdr.sh_flags & SHF_TLS))){
+			addrs.push_back({shdr.sh_addr, shdr.sh_addr + shdr.sh_size, i});
+		}
+		if(!nobits){
+			offsets.push_back({shdr.sh_offset, shdr.sh_offset + shdr.sh_size, i});
+		}
+	}
+	offsets.push_back({elf_header.e_shoff, elf_header.e_shoff + shdr_size, 0});
+
+	auto check = [&](std::vector<Range>& ranges, const char* what){
+		std::sort(ranges.begin(), ranges.end(), [](const Range& a, const Range& b){ return a.start < b.start; });
+		// compared with the one reaching furthest so far, it may hold several
+		const Range* last = ranges.empty() ? NULL : &ranges[0];
+		for(size_t i = 1; i < ranges.size(); i++){
+			if(ranges[i].start < last->end){
+				result.add("overlap", ranges[i].index, "%s overlaps %s in %s", 
+						   ranges[i].index == 0 ? "section headers" : sectionName(ranges[i].index), 
+						   last->index == 0 ? "section headers" : sectionName(last->index), what);
+			}
+			if(ranges[i].end > last->end) last = &ranges[i];
+		}
+	};
+	check(addrs, "memory");
+	check(offsets, "the file");
+}
+
+template <typename ELF>
+bool ELFReader<ELF>::loadFileData(void *addr, size_t len, Elf_Off offset){
+	if(fseeko(inputFile, (off_t)offset, SEEK_SET) != 0){
+		ELOG("\"%s\" cannot seek to %llx.", filename, (unsigned long long)offset);
+		return false;
+	}
 	size_t sz = fread(addr, sizeof(uint8_t), len, inputFile);
+	STAT_COUNT(kBytesRead, sz);
 
 	if(sz < 0){
 		ELOG("\"%s\" file read error", filename);
@@ -471,7 +752,7 @@ bool ELFReader::loadFileData(void *addr, size_t len, int offset){
 	}
 
 	if(sz != len){
-		ELOG("\"%s\" has no enough data at %x:%x, not valid file.", filename, offset, len);
+		ELOG("\"%s\" has no enough data at %llx:%zx, not valid file.", filename, (unsigned long long)offset, len);
 		return false;
 	}
 	return true;
@@ -489,13 +770,16 @@ bool ELFReader::loadFileData(void *addr, size_t len, int offset){
  * set to the minimum and maximum addresses of pages to be reserved,
  * or 0 if there is nothing to load.
  */
-size_t phdr_table_get_load_size(const Elf_Phdr* phdr_table,
+template <typename ELF>
+size_t phdr_table_get_load_size(const typename ELF::Phdr* phdr_table,
                                 size_t phdr_count,
-                                Elf_Addr* out_min_vaddr,
-                                Elf_Addr* out_max_vaddr,
-								Elf_Addr* out_max_endAddr)
+                                typename ELF::Addr* out_min_vaddr,
+                                typename ELF::Addr* out_max_vaddr,
+								typename ELF::Addr* out_max_endAddr)
 {
-    Elf_Addr min_vaddr = 0xFFFFFFFFU;
+    typedef typename ELF::Addr Elf_Addr;
+    typedef typename ELF::Phdr Elf_Phdr;
+    Elf_Addr min_vaddr = ~(Elf_Addr)0;
     Elf_Addr max_vaddr = 0x00000000U;
 
     bool found_pt_load = false;
@@ -538,106 +822,30 @@ size_t phdr_table_get_load_size(const Elf_Phdr* phdr_table,
     return max_vaddr - min_vaddr;
 }
 
-/* Return the address and size of the ELF file's .dynamic section in memory,
- * or NULL if missing.
- *
- * Input:
- *   phdr_table  -> program header table
- *   phdr_count  -> number of entries in tables
- *   load_bias   -> load bias
- * Output:
- *   dynamic       -> address of table in memory (NULL on failure).
- *   dynamic_count -> number of items in table (0 on failure).
- *   dynamic_flags -> protection flags for section (unset on failure)
- * Return:
- *   void
- */
-void
-phdr_table_get_dynamic_section(const Elf_Phdr* phdr_table,
-                               int               phdr_count,
-                               Elf_Addr        load_bias,
-                               Elf_Dyn**       dynamic,
-                               size_t*           dynamic_count,
-                               Elf_Word*       dynamic_flags)
-{
-    const Elf_Phdr* phdr = phdr_table;
-    const Elf_Phdr* phdr_limit = phdr + phdr_count;
-
-    for (phdr = phdr_table; phdr < phdr_limit; phdr++) {
-        if (phdr->p_type != PT_DYNAMIC) {
-            continue;
-        }
-
-        *dynamic = reinterpret_cast<Elf_Dyn*>(load_bias + phdr->p_vaddr);
-        if (dynamic_count) {
-            *dynamic_count = (unsigned)(phdr->p_memsz / sizeof(Elf_Dyn));
-        }
-        if (dynamic_flags) {
-            *dynamic_flags = phdr->p_flags;
-        }
-        return;
-    }
-    *dynamic = NULL;
-    if (dynamic_count) {
-        *dynamic_count = 0;
-    }
-}
-
-
-/* Return the address and size of the .ARM.exidx section in memory,
- * if present.
- *
- * Input:
- *   phdr_table  -> program header table
- *   phdr_count  -> number of entries in tables
- *   load_bias   -> load bias
- * Output:
- *   arm_exidx       -> address of table in memory (NULL on failure).
- *   arm_exidx_count -> number of items in table (0 on failure).
- * Return:
- *   0 on error, -1 on failure (_no_ error code in errno)
- */
-int
-phdr_table_get_arm_exidx(const Elf_Phdr* phdr_table,
-                         int               phdr_count,
-                         Elf_Addr        load_bias,
-                         Elf_Addr**      arm_exidx,
-                         unsigned*         arm_exidx_count)
-{
-    const Elf_Phdr* phdr = phdr_table;
-    const Elf_Phdr* phdr_limit = phdr + phdr_count;
-
-    for (phdr = phdr_table; phdr < phdr_limit; phdr++) {
-        if (phdr->p_type != PT_ARM_EXIDX)
-            continue;
-
-        *arm_exidx = (Elf_Addr*)(load_bias + phdr->p_vaddr);
-        *arm_exidx_count = (unsigned)(phdr->p_memsz / sizeof(Elf_Addr));
-        return 0;
-    }
-    *arm_exidx = NULL;
-    *arm_exidx_count = 0;
-    return -1;
+unsigned char peekElfClass(const char* filename, unsigned char* data){
+	unsigned char ident[EI_NIDENT];
+	FILE* fp = fopen(filename, "rb");
+	if(fp == NULL){
+		ELOG("File \"%s\" open error.", filename);
+		return ELFCLASSNONE;
+	}
+	size_t sz = fread(ident, sizeof(unsigned char), EI_NIDENT, fp);
+	fclose(fp);
+	if(sz != EI_NIDENT || memcmp(ident, ElfMagic, strlen(ElfMagic)) != 0){
+		return ELFCLASSNONE;
+	}
+	if(data != NULL) *data = ident[EI_DATA];
+	return ident[EI_CLASS];
 }
 
 
-// get the interp section address
-void phdr_table_get_interpt_section(const Elf_Phdr* phdr_table, 
-									int 			  phdr_count,
-									Elf_Addr		  load_bias, 
-									Elf_Addr**	  interp,
-									size_t*			  interp_size)
-{
-	const Elf_Phdr* phdr = phdr_table;
-	const Elf_Phdr* phdr_limit = phdr + phdr_count;
+// The reader only exists in these four flavours. Instantiate them here
+// to keep the implementation out of the header.
+#define INSTANTIATE_ELFREADER(ELF) \
+	template class ELFReader<ELF>; \
+	template size_t phdr_table_get_load_size<ELF>(const ELF::Phdr*, size_t, ELF::Addr*, ELF::Addr*, ELF::Addr*);
 
-	for(phdr = phdr_table; phdr < phdr_limit; phdr++){
-		if(phdr->p_type != PT_INTERP)
-			continue;
-
-		*interp = (Elf_Addr*)(load_bias + phdr->p_vaddr);
-		*interp_size = phdr->p_filesz;
-		return;
-	}
-	*interp = NULL;
-}
\ No newline at end of file
+INSTANTIATE_ELFREADER(ELF32)
+INSTANTIATE_ELFREADER(ELF64)
+INSTANTIATE_ELFREADER(ELF32BE)
+INSTANTIATE_ELFREADER(ELF64BE)
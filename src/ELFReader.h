@@ -2,17 +2,48 @@
 #define _SO_REBUILDER_ELFREADER_H_
 
 #include <cstdio>
+#include <string>
+#include <vector>
 #include "elf.h"
 #include "exutil.h"
 
+/**
+ * Read the e_ident[EI_CLASS] byte of a file, so the caller can pick 
+ * which ELFReader specialization to use. Return ELFCLASSNONE if the 
+ * file cannot be read or is not an elf file.
+ * e_ident[EI_DATA] is stored to data if it is given.
+ */
+unsigned char peekElfClass(const char* filename, unsigned char* data = NULL);
+
+/* One problem ELFReader::verify() found, check tells which kind. */
+struct VerifyIssue{
+	const char* check;		// "header", "segment", "link", "dynamic" or "overlap"
+	int section;			// section index, -1 if it is not about one section
+	std::string message;
+};
+
+/* What ELFReader::verify() says about a rebuilt file. */
+struct VerifyResult{
+	int damageLevel = -1;	// what checkSectionHeader() makes of it
+	std::vector<VerifyIssue> issues;
+
+	bool ok() const { return issues.empty(); }
+	void add(const char* check, int section, const char* fmt, ...) __attribute__((format(printf, 4, 5)));
+};
+
+template <typename ELF>
 class ELFReader{
 
 public:
+	ELF_TYPEDEFS(ELF);
+
 	ELFReader(const char * filename);
+	ELFReader(const char * name, const uint8_t* data, size_t size);	// read a file held in memory
 	~ELFReader();
 
 	bool load();
 	bool read();
+	bool verify(VerifyResult& result);
 	void damagePrint();
 
 private:
@@ -25,10 +56,17 @@ private:
 	bool reserveAddressSpace();
 	bool loadSegments();
 	bool findPhdr();
-	bool checkPhdr(Elf_Addr loaded);
+	bool checkPhdr(uintptr_t loaded);
 
 	bool checkSectionHeader();
-	bool loadFileData(void *addr, size_t len, int offset);
+	bool loadFileData(void *addr, size_t len, Elf_Off offset);
+
+	void verifySegments(VerifyResult& result, size_t file_size);
+	void verifyLinks(VerifyResult& result);
+	void verifyDynamic(VerifyResult& result);
+	void verifyOverlap(VerifyResult& result);
+	const char* sectionName(size_t index);
+	std::vector<char> shstrtab;		// section names, read by verify()
 
 	const char* filename;
 	FILE* inputFile;
@@ -80,7 +118,7 @@ private:
 	/* Load information */
 	void* load_start;			// First page of reserved address space.
 	Elf_Addr load_size;		// Size in bytes of reserved address space.
-	Elf_Addr load_bias;		// Load bias.
+	uintptr_t load_bias;		// Load bias. It is a host address, so it don't use Elf_Addr.
 
 	const Elf_Phdr* loaded_phdr;	// Loaded phdr.
 
@@ -104,7 +142,7 @@ public:
 	int getPhdrNum() { return phdr_num; }
 
 	const Elf_Phdr* getLoadedPhdr() { return loaded_phdr; }
-	Elf_Addr getLoadBias() { return load_bias; }
+	uintptr_t getLoadBias() { return load_bias; }
 
 	void setDumpSoFile(bool dump) { dump_so_file = dump; }
 	void setDumpSoBase(Elf_Addr base){ dump_so_base = base; }
@@ -118,30 +156,11 @@ private:
 
 
 //The functions below are refer to android source
-size_t phdr_table_get_load_size(const Elf_Phdr* phdr_table,
+template <typename ELF>
+size_t phdr_table_get_load_size(const typename ELF::Phdr* phdr_table,
 								size_t phdr_count,
-								Elf_Addr* out_min_vaddr = NULL,
-								Elf_Addr* out_max_vaddr = NULL,
-								Elf_Addr* out_max_endAddress = NULL);
-
-void phdr_table_get_dynamic_section(const Elf_Phdr* phdr_table,
-							   		int               phdr_count,
-							  		Elf_Addr        load_bias,
-							   		Elf_Dyn**       dynamic,
-							   		size_t*           dynamic_count,
-							   		Elf_Word*       dynamic_flags);
-
-int phdr_table_get_arm_exidx(const Elf_Phdr* phdr_table,
-							 int               phdr_count,
-						 	 Elf_Addr        load_bias,
-						 	 Elf_Addr**      arm_exidx,
-						 	 unsigned*         arm_exidix_count);
-
-void phdr_table_get_interpt_section(const Elf_Phdr* phdr_table, 
-									int 			  phdr_count,
-									Elf_Addr		  load_bias, 
-									Elf_Addr**	  interp,
-									size_t*			  interp_size);
-
+								typename ELF::Addr* out_min_vaddr = NULL,
+								typename ELF::Addr* out_max_vaddr = NULL,
+								typename ELF::Addr* out_max_endAddress = NULL);
 
 #endif
\ No newline at end of file
@@ -1,9 +1,15 @@
 #include "exutil.h"
 #include "ELFRebuilder.h"
 #include "Log.h"
+#include "Stats.h"
 #include <cstdlib>
+#include <cinttypes>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 
-ELFRebuilder::ELFRebuilder(ELFReader &_reader, bool _force)
+template <typename ELF>
+ELFRebuilder<ELF>::ELFRebuilder(ELFReader<ELF> &_reader, bool _force)
 	: reader(_reader), force(_force){
 		
 	elf_header = reader.getElfHeader();
@@ -11,16 +17,23 @@ ELFRebuilder::ELFRebuilder(ELFReader &_reader, bool _force)
 
 }
 
-ELFRebuilder::~ELFRebuilder(){
+template <typename ELF>
+ELFRebuilder<ELF>::~ELFRebuilder(){
 	if(rebuild_data != NULL){
 		delete [](uint8_t*)rebuild_data;
 	}
 }
 
 
-bool ELFRebuilder::rebuild(){
+template <typename ELF>
+bool ELFRebuilder<ELF>::rebuild(){
+	PhaseTimer timer(kPhaseRebuild);
+	// A memory dump doesn't have the file layout of the build any more.
+	if(references != nullptr && !reader.isDumpSoFile() && !add_gnu_hash && transplantRebuild()){
+		return true;
+	}
 	if(force || reader.getDamageLevel() == 2){
-		if(!reader.isLoad()) reader.load();
+		if(!reader.isLoad() && !reader.load()) return false;
 		return totalRebuild();
 	} else if(reader.getDamageLevel() == 1){
 		return simpleRebuild() && rebuildData();
@@ -36,7 +49,8 @@ bool ELFRebuilder::rebuild(){
  * program header, elf header, and valid size of each section. 
  * The all thing that this file need is section offset and address.
  */
-bool ELFRebuilder::simpleRebuild(){
+template <typename ELF>
+bool ELFRebuilder<ELF>::simpleRebuild(){
 	VLOG("Starting repair the section.");
 	rebuild_size = sizeof(Elf_Ehdr) + reader.getPhdrSize() + reader.getMidPartSize() + reader.getShdrSize();
 	Elf_Shdr *shdr_table = reader.getShdrTable();
@@ -44,12 +58,13 @@ bool ELFRebuilder::simpleRebuild(){
 	int shdr_num = reader.getShdrNum();
 	int phdr_num = reader.getPhdrNum();
 
-	int loadIndex[2] = {-1, -1};
-	for(int i=0, j=0;i<phdr_num;i++){
-		if(phdr_table[i].p_type == PT_LOAD){
-			loadIndex[j++] = i;
-		}
+	segments.build(phdr_table, phdr_num, elf_header.e_machine);
+	if(segments.loads.size() < 2){
+		VLOG("Less than two LOAD segments, the sections cannot be placed.");
+		return false;
 	}
+	const Elf_Phdr* firstLoad = segments.loads[0];
+	const Elf_Phdr* secondLoad = segments.loads[1];
 
 	int firstAddress = sizeof(Elf_Ehdr) + reader.getPhdrSize();
 	// build the first section.
@@ -66,7 +81,7 @@ bool ELFRebuilder::simpleRebuild(){
 		while(curAddr & (shdr_table[i].sh_addralign-1)) { curAddr++; }
 		while(curOffset & (shdr_table[i].sh_addralign-1)) {curOffset++;}
 		
-		if(curOffset >= phdr_table[loadIndex[0]].p_filesz + phdr_table[loadIndex[0]].p_offset) { break; }
+		if(curOffset >= firstLoad->p_filesz + firstLoad->p_offset) { break; }
 		shdr_table[i].sh_addr = curAddr;
 		shdr_table[i].sh_offset = curOffset;	
 		
@@ -75,8 +90,8 @@ bool ELFRebuilder::simpleRebuild(){
 	// Rebuild the second LOAD segment
 	// First get the second LOAD segment address and offset
 	DLOG("Start repair the section mapping at second LOAD segment.");
-	shdr_table[i].sh_addr = phdr_table[loadIndex[1]].p_vaddr;
-	shdr_table[i].sh_offset = phdr_table[loadIndex[1]].p_offset;
+	shdr_table[i].sh_addr = secondLoad->p_vaddr;
+	shdr_table[i].sh_offset = secondLoad->p_offset;
 
 	for(i=i+1;i<shdr_num;i++){
 		
@@ -99,7 +114,7 @@ bool ELFRebuilder::simpleRebuild(){
 		shdr_table[i].sh_addr = curAddr;
 		shdr_table[i].sh_offset = curOffset;
 		// Beside Load segment, break
-		if(curOffset >= phdr_table[loadIndex[1]].p_filesz + phdr_table[loadIndex[1]].p_offset) { break; }
+		if(curOffset >= secondLoad->p_filesz + secondLoad->p_offset) { break; }
 	}
 
 	// The remain section won't be load. So the address is 0.
@@ -121,39 +136,108 @@ bool ELFRebuilder::simpleRebuild(){
 	return true;
 }
 
-bool ELFRebuilder::rebuildData(){
+template <typename ELF>
+bool ELFRebuilder<ELF>::rebuildData(){
 	rebuild_data = new uint8_t[rebuild_size];
-	DLOG("Copy elf header data. Elf header size = %d", sizeof(elf_header));
+	DLOG("Copy elf header data. Elf header size = %zu", sizeof(elf_header));
 	uint8_t *tmp = rebuild_data;
 	memcpy(tmp, &elf_header, sizeof(elf_header));
 	tmp += sizeof(elf_header);
 
 	size_t phdr_size = reader.getPhdrSize();
-	DLOG("Copy program header data. Program header size = %d", phdr_size);
+	DLOG("Copy program header data. Program header size = %zu", phdr_size);
 	memcpy(tmp, phdr_table, phdr_size);
 	tmp += phdr_size;
 
 	size_t midPart_size = reader.getMidPartSize();
 	uint8_t* midPart = reinterpret_cast<uint8_t*>(reader.getMidPart());
-	DLOG("Copy midPart data. MidPart size = %d", midPart_size);
+	DLOG("Copy midPart data. MidPart size = %zu", midPart_size);
 	memcpy(tmp, midPart, midPart_size);
 	tmp += midPart_size;
 	
 	size_t shdr_size = reader.getShdrSize();
-	DLOG("Copy section header data. Section header size = %d", shdr_size);
+	DLOG("Copy section header data. Section header size = %zu", shdr_size);
 	memcpy(tmp, reader.getShdrTable(), shdr_size);
+	STAT_COUNT(kBytesCopied, rebuild_size);
+	STAT_COUNT(kSections, reader.getShdrNum());
 
 	DLOG("rebuild_data prepared.");
-	return false;
+	return true;
+}
+
+/**
+ * Take the section table of an intact build with the same fingerprint, 
+ * see BuildIndex. Sections of the same build lie at the same place, so 
+ * nothing has to be guessed. The loaded part of the file is kept, 
+ * everything behind it comes from the reference: the non-alloc 
+ * sections, .shstrtab and the section headers.
+ * Return false if no reference matches.
+ */
+template <typename ELF>
+bool ELFRebuilder<ELF>::transplantRebuild(){
+	FILE* fp = fopen(reader.getFileName(), "rb");
+	if(fp == NULL) return false;
+	uint64_t fingerprint = 0;
+	Elf_Off loadEnd = 0;
+	bool ok = BuildIndex<ELF>::fingerprint(fp, &fingerprint, &loadEnd);
+	fclose(fp);
+	const typename BuildIndex<ELF>::Entry* ref = ok ? references->find(fingerprint) : nullptr;
+	if(ref == nullptr){
+		VLOG("No intact build of \"%s\" indexed.", reader.getFileName());
+		return false;
+	}
+
+	std::vector<uint8_t> input, good;
+	if(!BuildIndex<ELF>::readFile(reader.getFileName(), input) || 
+	   !BuildIndex<ELF>::readFile(ref->path.c_str(), good) || 
+	   input.size() < loadEnd || good.size() < loadEnd || good.size() < sizeof(Elf_Ehdr)){
+		VLOG("\"%s\" cannot be read.", ref->path.c_str());
+		return false;
+	}
+	STAT_COUNT(kBytesRead, input.size() + good.size());
+	Elf_Ehdr good_header;
+	memcpy((void*)&good_header, &good[0], sizeof(good_header));
+	Elf_Off shoff = good_header.e_shoff;
+	size_t shnum = good_header.e_shnum;
+	if(shoff < loadEnd || shoff + shnum * sizeof(Elf_Shdr) > good.size()){
+		VLOG("Section headers of \"%s\" are not behind the loaded part.", ref->path.c_str());
+		return false;
+	}
+	const Elf_Shdr* shdr = reinterpret_cast<const Elf_Shdr*>(&good[shoff]);
+	for(size_t i = 1; i < shnum; i++){
+		if(shdr[i].sh_type != SHT_NOBITS && shdr[i].sh_offset + shdr[i].sh_size > good.size()){
+			VLOG("Section %zu of \"%s\" runs out of the file.", i, ref->path.c_str());
+			return false;
+		}
+	}
+
+	rebuild_size = good.size();
+	if(rebuild_data != NULL) delete []rebuild_data;
+	rebuild_data = new uint8_t[rebuild_size];
+	memcpy(rebuild_data, &input[0], loadEnd);
+	memcpy(rebuild_data + loadEnd, &good[loadEnd], good.size() - loadEnd);
+	STAT_COUNT(kBytesCopied, rebuild_size);
+	STAT_COUNT(kSections, shnum);
+
+	elf_header.e_shoff = good_header.e_shoff;
+	elf_header.e_shentsize = good_header.e_shentsize;
+	elf_header.e_shnum = good_header.e_shnum;
+	elf_header.e_shstrndx = good_header.e_shstrndx;
+	memcpy(rebuild_data, &elf_header, sizeof(elf_header));
+
+	LOG("Section table taken from the intact build \"%s\".", ref->path.c_str());
+	return true;
 }
 
-bool ELFRebuilder::totalRebuild(){
+template <typename ELF>
+bool ELFRebuilder<ELF>::totalRebuild(){
 	VLOG("Using plan B to rebuild the section.");
-	if(rebuildPhdr() && readSoInfo() && rebuildShdr() && rebuildRelocs() &&	rebuildFinish()){
+	if(rebuildPhdr() && readSoInfo() && checkHash() && addGnuHash() && buildFunctionIndex() && rebuildShdr() && 
+	   rebuildRelocs() && rebuildEhFrameHdr() && rebuildSymtab() && rebuildFinish()){
 		return true;
 	}
 	ELOG("Using plan B to rebuild failed.");
-	exit(EXIT_FAILURE);
+	return false;
 }
 
 /**
@@ -163,7 +247,8 @@ bool ELFRebuilder::totalRebuild(){
  * page align. Because the data of the file is already align with 
  * page.
  */ 
-bool ELFRebuilder::rebuildPhdr(){
+template <typename ELF>
+bool ELFRebuilder<ELF>::rebuildPhdr(){
 	Elf_Phdr* phdr = (Elf_Phdr *)reader.getLoadedPhdr();
 	for(int i=0;i<reader.getPhdrNum();i++){
 		phdr[i].p_filesz = phdr[i].p_memsz;
@@ -175,67 +260,129 @@ bool ELFRebuilder::rebuildPhdr(){
 	return true;
 }
 
-bool ELFRebuilder::readSoInfo(){
+template <typename ELF>
+bool ELFRebuilder<ELF>::readSoInfo(){
+	PhaseTimer timer(kPhaseSoInfo);
 	si.name = reader.getFileName();
 	si.base = si.load_bias = reader.getLoadBias();
 	si.phdr = reader.getPhdrTable();
 	si.phnum = reader.getPhdrNum();
 
-	Elf_Addr base = si.base;
-	phdr_table_get_load_size(si.phdr, si.phnum, &si.min_load, &si.max_load, &si.loadSegEnd);
+	uintptr_t base = si.base;
+	phdr_table_get_load_size<ELF>(si.phdr, si.phnum, &si.min_load, &si.max_load, &si.loadSegEnd);
+	segments.build(si.phdr, si.phnum, elf_header.e_machine);
+	addresses.clear(AddressIndex<ELF>::kSegment);
+	for(size_t i = 0; i < segments.loads.size(); i++){
+		addresses.add(AddressIndex<ELF>::kSegment, segments.loads[i]->p_vaddr, segments.loads[i]->p_memsz, i);
+	}
+	addresses.build(AddressIndex<ELF>::kSegment);
+
+	// rebuildPhdr() only patched the loaded copy of the program header. 
+	// si.phdr still has the original p_filesz, which tells where .data 
+	// ends and .bss begins.
+	si.loadSegFileEnd = si.loadSegEnd;
+	for(const Elf_Phdr* phdr : segments.loads){
+		if(phdr->p_vaddr + phdr->p_memsz == si.loadSegEnd && 
+		   phdr->p_filesz != 0 && phdr->p_filesz <= phdr->p_memsz){
+			si.loadSegFileEnd = phdr->p_vaddr + phdr->p_filesz;
+		}
+	}
+	si.has_tls = false;
+	if(segments.tls != nullptr && segments.tls->p_filesz <= segments.tls->p_memsz){
+		si.has_tls = true;
+		si.tls_addr = segments.tls->p_vaddr;
+		si.tls_filesz = segments.tls->p_filesz;
+		si.tls_memsz = segments.tls->p_memsz;
+		si.tls_align = segments.tls->p_align;
+	}
 
 	// get .dynamic table
-	phdr_table_get_dynamic_section(si.phdr, si.phnum, si.load_bias, &si.dynamic, &si.dynamic_count, &si.dynamic_flags);
+	if(segments.dynamic != nullptr){
+		si.dynamic = reinterpret_cast<Elf_Dyn*>(si.load_bias + segments.dynamic->p_vaddr);
+		si.dynamic_count = segments.dynamic->p_memsz / sizeof(Elf_Dyn);
+		si.dynamic_flags = segments.dynamic->p_flags;
+	}
 
-	phdr_table_get_interpt_section(si.phdr, si.phnum, si.load_bias, &si.interp, &si.interp_size);
+	if(segments.interp != nullptr){
+		si.interp = reinterpret_cast<Elf_Addr*>(si.load_bias + segments.interp->p_vaddr);
+		si.interp_size = segments.interp->p_filesz;
+	}
 
 	if(si.dynamic == NULL){
 		ELOG("dynamic section unavailable. Cannot rebuild.");
 		return false;
 	}
 	//get .arm_exidx
-	phdr_table_get_arm_exidx(si.phdr, si.phnum, si.base, &si.ARM_exidx, &si.ARM_exidx_count);
+	if(segments.arm_exidx != nullptr){
+		si.ARM_exidx = reinterpret_cast<Elf_Addr*>(si.base + segments.arm_exidx->p_vaddr);
+		si.ARM_exidx_count = segments.arm_exidx->p_memsz / sizeof(Elf_Addr);
+	}
+	//get .eh_frame_hdr and .eh_frame
+	if(segments.eh_frame_hdr != nullptr){
+		si.eh_frame_hdr = reinterpret_cast<uint8_t*>(si.load_bias + segments.eh_frame_hdr->p_vaddr);
+		si.eh_frame_hdr_size = segments.eh_frame_hdr->p_memsz;
+	}
+	readEhFrame();
 
 	// scan the dynamic section and get useful information.
 	uint32_t needed_count = 0;
+	// DT_PLTREL may come after DT_JMPREL and DT_PLTRELSZ, 
+	// so we can only type the plt relocation table after the scan.
+	uintptr_t plt_rel_addr = 0;
+	size_t plt_rel_size = 0;
+	Elf_Xword plt_rel_type = DT_REL;
 	for(Elf_Dyn* dyn = si.dynamic;dyn->d_tag != DT_NULL;dyn++){
 		switch(dyn->d_tag){
 			case DT_HASH:
 				si.hash = dyn->d_un.d_ptr + base;
-				si.nbucket = ((unsigned *)si.hash)[0];
-				si.nchain = ((unsigned *)si.hash)[1];
-				si.bucket = (unsigned *)si.hash + 8;
-				si.chain = (unsigned *)si.bucket + 4*si.nbucket;
+				si.nbucket = ((Elf_Field<Elf_Word> *)si.hash)[0];
+				si.nchain = ((Elf_Field<Elf_Word> *)si.hash)[1];
+				// nbucket and nchain come first, then the buckets and the chain
+				si.bucket = (Elf_Field<Elf_Word> *)si.hash + 2;
+				si.chain = si.bucket + si.nbucket;
+				break;
+			case DT_GNU_HASH:
+				si.gnu_hash = dyn->d_un.d_ptr + base;
+				si.gnu_nbucket = reinterpret_cast<Elf_Field<uint32_t>*>(si.gnu_hash)[0];
+				si.gnu_symndx = reinterpret_cast<Elf_Field<uint32_t>*>(si.gnu_hash)[1];
+				si.gnu_maskwords = reinterpret_cast<Elf_Field<uint32_t>*>(si.gnu_hash)[2];
+				si.gnu_shift2 = reinterpret_cast<Elf_Field<uint32_t>*>(si.gnu_hash)[3];
+				si.gnu_bloom_filter = reinterpret_cast<Elf_Field<Elf_Addr>*>(si.gnu_hash + 16);
+				si.gnu_bucket = reinterpret_cast<Elf_Field<uint32_t>*>(si.gnu_bloom_filter + si.gnu_maskwords);
+				// the chain starts at symbol gnu_symndx
+				si.gnu_chain = si.gnu_bucket + si.gnu_nbucket - si.gnu_symndx;
+				VLOG("gnu hash table found at %" PRIx64, (uint64_t)dyn->d_un.d_ptr);
 				break;
 			case DT_STRTAB:
 				si.strtab = (const char*)(dyn->d_un.d_ptr + base);
-				VLOG("string table found at %x", dyn->d_un.d_ptr);
+				VLOG("string table found at %" PRIx64, (uint64_t)dyn->d_un.d_ptr);
 				break;
 			case DT_SYMTAB:
 				si.symtab = (Elf_Sym *) (dyn->d_un.d_ptr + base);
-				VLOG("symbol table found at %x", dyn->d_un.d_ptr);
+				VLOG("symbol table found at %" PRIx64, (uint64_t)dyn->d_un.d_ptr);
 				break;
 			case DT_PLTREL:
-				if (dyn->d_un.d_val != DT_REL) {
-					VLOG("unsupported DT_RELA in \"%s\"", si.name);
+				if (dyn->d_un.d_val != DT_REL && dyn->d_un.d_val != DT_RELA) {
+					VLOG("unsupported DT_PLTREL 0x%" PRIx64 " in \"%s\"", (uint64_t)dyn->d_un.d_val, si.name);
 					return false;
 				}
+				plt_rel_type = dyn->d_un.d_val;
 				break;
 			case DT_JMPREL:
-				si.plt_rel = (Elf_Rel*) (dyn->d_un.d_ptr + base);
-				VLOG("%s plt_rel (DT_JMPREL) found at %x", si.name, dyn->d_un.d_ptr);
+				plt_rel_addr = dyn->d_un.d_ptr + base;
+				VLOG("%s plt_rel (DT_JMPREL) found at %" PRIx64, si.name, (uint64_t)dyn->d_un.d_ptr);
 				break;
 			case DT_PLTRELSZ:
-				si.plt_rel_count = dyn->d_un.d_val / sizeof(Elf_Rel);
-				VLOG("%s plt_rel_count (DT_PLTRELSZ) %d", si.name, si.plt_rel_count);
+				plt_rel_size = dyn->d_un.d_val;
+				VLOG("%s plt_rel_size (DT_PLTRELSZ) %zu", si.name, plt_rel_size);
 				break;
 			case DT_REL:
 				si.rel = (Elf_Rel*) (dyn->d_un.d_ptr + base);
-				VLOG("%s rel (DT_REL) found at %x", si.name, dyn->d_un.d_ptr);
+				VLOG("%s rel (DT_REL) found at %" PRIx64, si.name, (uint64_t)dyn->d_un.d_ptr);
 				break;
 			case DT_RELSZ:
 				si.rel_count = dyn->d_un.d_val / sizeof(Elf_Rel);
-				VLOG("%s rel_size (DT_RELSZ) %d", si.name, si.rel_count);
+				VLOG("%s rel_size (DT_RELSZ) %zu", si.name, si.rel_count);
 				break;
 			case DT_PLTGOT:
 				/* Save this in case we decide to do lazy binding. We don't yet. */
@@ -246,39 +393,76 @@ bool ELFRebuilder::readSoInfo(){
 				// if the dynamic table is writable
 				break;
 			case DT_RELA:
-				VLOG("unsupported DT_RELA in \"%s\"", si.name);
-				return false;
+				si.rela = (Elf_Rela*) (dyn->d_un.d_ptr + base);
+				VLOG("%s rela (DT_RELA) found at %" PRIx64, si.name, (uint64_t)dyn->d_un.d_ptr);
+				break;
+			case DT_RELASZ:
+				si.rela_count = dyn->d_un.d_val / sizeof(Elf_Rela);
+				VLOG("%s rela_size (DT_RELASZ) %zu", si.name, si.rela_count);
+				break;
+			case DT_ANDROID_REL:
+			case DT_ANDROID_RELA:
+				si.android_reloc = reinterpret_cast<const uint8_t*>(dyn->d_un.d_ptr + base);
+				si.android_reloc_is_rela = dyn->d_tag == DT_ANDROID_RELA;
+				VLOG("%s packed relocations (DT_ANDROID_REL%s) found at %" PRIx64, si.name, 
+					 si.android_reloc_is_rela ? "A" : "", (uint64_t)dyn->d_un.d_ptr);
+				break;
+			case DT_ANDROID_RELSZ:
+			case DT_ANDROID_RELASZ:
+				si.android_reloc_size = dyn->d_un.d_val;
+				VLOG("%s packed relocations size %zu", si.name, si.android_reloc_size);
+				break;
+			case DT_RELR:
+			case DT_ANDROID_RELR:
+				si.relr = reinterpret_cast<Elf_Field<Elf_Addr>*>(dyn->d_un.d_ptr + base);
+				si.relr_is_android = dyn->d_tag == DT_ANDROID_RELR;
+				VLOG("%s relr (DT_RELR) found at %" PRIx64, si.name, (uint64_t)dyn->d_un.d_ptr);
+				break;
+			case DT_RELRSZ:
+			case DT_ANDROID_RELRSZ:
+				si.relr_count = dyn->d_un.d_val / sizeof(Elf_Addr);
+				VLOG("%s relr_count (DT_RELRSZ) %zu", si.name, si.relr_count);
+				break;
+			case DT_RELRENT:
+			case DT_ANDROID_RELRENT:
+				break;
+			case DT_RELCOUNT:
+				si.rel_relative_count = dyn->d_un.d_val;
+				break;
+			case DT_RELACOUNT:
+				si.rela_relative_count = dyn->d_un.d_val;
+				break;
 			case DT_INIT:
 				si.init_func = reinterpret_cast<void*>(dyn->d_un.d_ptr + base);
-				VLOG("%s constructors (DT_INIT) found at %x", si.name, dyn->d_un.d_ptr);
+				VLOG("%s constructors (DT_INIT) found at %" PRIx64, si.name, (uint64_t)dyn->d_un.d_ptr);
 				break;
 			case DT_FINI:
 				si.fini_func = reinterpret_cast<void*>(dyn->d_un.d_ptr + base);
-				VLOG("%s destructors (DT_FINI) found at %x", si.name, dyn->d_un.d_ptr);
+				VLOG("%s destructors (DT_FINI) found at %" PRIx64, si.name, (uint64_t)dyn->d_un.d_ptr);
 				break;
 			case DT_INIT_ARRAY:
 				si.init_array = reinterpret_cast<void**>(dyn->d_un.d_ptr + base);
-				VLOG("%s constructors (DT_INIT_ARRAY) found at %x", si.name, dyn->d_un.d_ptr);
+				VLOG("%s constructors (DT_INIT_ARRAY) found at %" PRIx64, si.name, (uint64_t)dyn->d_un.d_ptr);
 				break;
 			case DT_INIT_ARRAYSZ:
 				si.init_array_count = ((unsigned)dyn->d_un.d_val) / sizeof(Elf_Addr);
-				VLOG("%s constructors (DT_INIT_ARRAYSZ) %d", si.name, si.init_array_count);
+				VLOG("%s constructors (DT_INIT_ARRAYSZ) %zu", si.name, si.init_array_count);
 				break;
 			case DT_FINI_ARRAY:
 				si.fini_array = reinterpret_cast<void**>(dyn->d_un.d_ptr + base);
-				VLOG("%s destructors (DT_FINI_ARRAY) found at %x", si.name, dyn->d_un.d_ptr);
+				VLOG("%s destructors (DT_FINI_ARRAY) found at %" PRIx64, si.name, (uint64_t)dyn->d_un.d_ptr);
 				break;
 			case DT_FINI_ARRAYSZ:
 				si.fini_array_count = ((unsigned)dyn->d_un.d_val) / sizeof(Elf_Addr);
-				VLOG("%s destructors (DT_FINI_ARRAYSZ) %d", si.name, si.fini_array_count);
+				VLOG("%s destructors (DT_FINI_ARRAYSZ) %zu", si.name, si.fini_array_count);
 				break;
 			case DT_PREINIT_ARRAY:
 				si.preinit_array = reinterpret_cast<void**>(dyn->d_un.d_ptr + base);
-				VLOG("%s constructors (DT_PREINIT_ARRAY) found at %d", si.name, dyn->d_un.d_ptr);
+				VLOG("%s constructors (DT_PREINIT_ARRAY) found at %" PRIx64, si.name, (uint64_t)dyn->d_un.d_ptr);
 				break;
 			case DT_PREINIT_ARRAYSZ:
 				si.preinit_array_count = ((unsigned)dyn->d_un.d_val) / sizeof(Elf_Addr);
-				VLOG("%s constructors (DT_PREINIT_ARRAYSZ) %d", si.name,si.preinit_array_count);
+				VLOG("%s constructors (DT_PREINIT_ARRAYSZ) %zu", si.name,si.preinit_array_count);
 				break;
 			case DT_TEXTREL:
 				si.has_text_relocations = true;
@@ -301,9 +485,10 @@ bool ELFRebuilder::readSoInfo(){
 				si.strtabsize = dyn->d_un.d_val;
 				break;
 			case DT_SYMENT:
-				si.dynsym_size = dyn->d_un.d_val;
+				si.syment = dyn->d_un.d_val;
 				break;
 			case DT_RELENT:
+			case DT_RELAENT:
 				break;
 			case DT_MIPS_RLD_MAP:
 				// Set the DT_MIPS_RLD_MAP entry to the address of _r_debug for GDB.
@@ -325,420 +510,1083 @@ bool ELFRebuilder::readSoInfo(){
 			case DT_MIPS_GOTSYM:
 				si.mips_gotsym = dyn->d_un.d_val;
 				break;
+			case DT_VERSYM:
+				si.versym = reinterpret_cast<Elf_Half*>(dyn->d_un.d_ptr + base);
+				break;
+			case DT_VERDEF:
+				si.verdef = reinterpret_cast<Elf_Verdef*>(dyn->d_un.d_ptr + base);
+				break;
+			case DT_VERDEFNUM:
+				si.verdef_num = dyn->d_un.d_val;
+				break;
+			case DT_VERNEED:
+				si.verneed = reinterpret_cast<Elf_Verneed*>(dyn->d_un.d_ptr + base);
+				break;
+			case DT_VERNEEDNUM:
+				si.verneed_num = dyn->d_un.d_val;
+				break;
 			case DT_SONAME:
 				si.name = (const char *) (dyn->d_un.d_ptr + base);
 				VLOG("soname %s", si.name);
 				break;
 			default:
-				VLOG("Unused DT entry: type 0x%08x arg 0x%08x", dyn->d_tag, dyn->d_un.d_val);
+				VLOG("Unused DT entry: type 0x%08" PRIx64 " arg 0x%08" PRIx64, (uint64_t)dyn->d_tag, (uint64_t)dyn->d_un.d_val);
 				break;
 		}
 	}
+
+	if(plt_rel_addr != 0){
+		if(plt_rel_type == DT_RELA){
+			si.plt_rela = reinterpret_cast<Elf_Rela*>(plt_rel_addr);
+			si.plt_rela_count = plt_rel_size / sizeof(Elf_Rela);
+		} else{
+			si.plt_rel = reinterpret_cast<Elf_Rel*>(plt_rel_addr);
+			si.plt_rel_count = plt_rel_size / sizeof(Elf_Rel);
+		}
+	}
+
+	si.dynsym_count = countDynsym();
+	VLOG("%s dynsym count %zu", si.name, si.dynsym_count);
+	symbols.build(si.symtab, si.dynsym_count, si.strtab, si.strtabsize, si.hash, si.gnu_hash, si.gnu_maskwords);
+
+	si.arch = ArchInfo::of(elf_header.e_machine);
+	if(!si.arch.known){
+		VLOG("Unknown relocation types for machine %d", (int)elf_header.e_machine);
+	}
+	scanRelocTargets();
 	DLOG("Dynamic read finish.");
 	return true;
 }
 
-bool ELFRebuilder::rebuildShdr(){
-	shstrtab.clear();
+template <typename ELF>
+size_t ELFRebuilder<ELF>::countDynsym(){
+	// The SysV hash table has a chain entry for every symbol.
+	if(si.hash != 0){
+		return si.nchain;
+	}
+	if(si.gnu_hash != 0){
+		return gnuHashSymbolCount();
+	}
+	if(si.mips_symtabno != 0){
+		return si.mips_symtabno;
+	}
+	// No hash table at all. .dynstr always follows .dynsym, 
+	// it is the best guess we have.
+	if(si.symtab != nullptr && (uintptr_t)si.strtab > (uintptr_t)si.symtab){
+		return ((uintptr_t)si.strtab - (uintptr_t)si.symtab) / sizeof(Elf_Sym);
+	}
+	return 0;
+}
+
+/**
+ * The GNU hash table doesn't record the number of symbols. But the 
+ * symbols are sorted by bucket, so the last one is in the chain of 
+ * the largest bucket value. Follow that chain to the entry with the 
+ * stop bit set.
+ */
+template <typename ELF>
+size_t ELFRebuilder<ELF>::gnuHashSymbolCount(){
+	// Branch free max, the compiler can vectorize it.
+	uint32_t last = 0;
+	for(size_t i = 0; i < si.gnu_nbucket; i++){
+		uint32_t b = si.gnu_bucket[i];
+		last = b > last ? b : last;
+	}
+	if(last < si.gnu_symndx){
+		return si.gnu_symndx;
+	}
+
+	uintptr_t limit = si.load_bias + si.max_load;
+	while(reinterpret_cast<uintptr_t>(&si.gnu_chain[last] + 1) <= limit){
+		if(si.gnu_chain[last] & 1){
+			return last + 1;
+		}
+		last++;
+	}
+	VLOG("gnu hash chain runs out of the image.");
+	return last;
+}
+
+/**
+ * ELF hash of every .dynsym name. The names are independent, so a 
+ * large table is cut into batches and hashed on every core.
+ */
+template <typename ELF>
+std::vector<uint32_t> ELFRebuilder<ELF>::elfHashes(){
+	size_t count = si.dynsym_count;
+	std::vector<uint32_t> hashes(count);
+	const size_t kBatch = 4096;
+	size_t batches = (count + kBatch - 1) / kBatch;
+	auto hashBatch = [&](size_t batch){
+		size_t end = std::min(count, (batch + 1) * kBatch);
+		for(size_t i = batch * kBatch; i < end; i++){
+			hashes[i] = SymbolIndex<ELF>::elfHash(symbols.getName(i));
+		}
+	};
+	size_t workers = std::min<size_t>(batches, std::max(1u, std::thread::hardware_concurrency()));
+	if(workers <= 1){
+		for(size_t b = 0; b < batches; b++) { hashBatch(b); }
+		return hashes;
+	}
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> threads;
+	for(size_t w = 0; w < workers; w++){
+		threads.push_back(std::thread([&](){
+			for(size_t b = next++; b < batches; b = next++) { hashBatch(b); }
+		}));
+	}
+	for(std::thread& t : threads) { t.join(); }
+	return hashes;
+}
+
+// Link every symbol but 0 into the chain of its bucket, in place.
+template <typename ELF>
+void ELFRebuilder<ELF>::writeHash(const std::vector<uint32_t>& hashes){
+	for(size_t b = 0; b < si.nbucket; b++) { si.bucket[b] = 0; }
+	for(size_t i = hashes.size() - 1; i >= 1; i--){
+		uint32_t b = hashes[i] % si.nbucket;
+		si.chain[i] = si.bucket[b];
+		si.bucket[b] = i;
+	}
+	si.chain[0] = 0;
+}
+
+/**
+ * Protectors sometimes scramble .hash, then the loader cannot find 
+ * the symbols. Hash every name again and walk the buckets: each symbol 
+ * but 0 has to be in the chain of its own bucket, exactly once. If one 
+ * is not, the table is built again in place with its bucket count.
+ * A header which makes the table run into .dynsym or .dynstr cannot 
+ * be trusted to tell the size, that table is left as it is.
+ */
+template <typename ELF>
+bool ELFRebuilder<ELF>::checkHash(){
+	PhaseTimer timer(kPhaseHash);
+	if(si.hash == 0 || si.symtab == nullptr || si.nbucket == 0 || si.nchain < 2) return true;
+	size_t count = si.dynsym_count;
+	uintptr_t start = si.hash, end = (uintptr_t)(si.chain + si.nchain);
+	uintptr_t limit = si.load_bias + si.max_load;
+	auto overlaps = [start, end](uintptr_t from, uintptr_t to) { return from < end && start < to; };
+	if(end > limit || (uintptr_t)(si.symtab + count) > limit ||
+	   overlaps((uintptr_t)si.symtab, (uintptr_t)(si.symtab + count)) ||
+	   overlaps((uintptr_t)si.strtab, (uintptr_t)si.strtab + si.strtabsize)){
+		VLOG(".hash header is broken, the table is not checked.");
+		return true;
+	}
+
+	std::vector<uint32_t> hashes = elfHashes();
+	std::vector<uint8_t> seen(count, 0);
+	size_t bad = 0;
+	for(size_t b = 0; b < si.nbucket; b++){
+		for(uint32_t n = si.bucket[b]; n != 0; n = si.chain[n]){
+			// out of range, in a loop or in the wrong bucket
+			if(n >= count || seen[n] || hashes[n] % si.nbucket != b){
+				bad++;
+				break;
+			}
+			seen[n] = 1;
+		}
+	}
+	for(size_t i = 1; i < count; i++) { bad += !seen[i]; }
+	if(bad == 0){
+		DLOG(".hash checked, %zu symbols in %zu buckets.", count, si.nbucket);
+		return true;
+	}
+
+	writeHash(hashes);
+	symbols.build(si.symtab, count, si.strtab, si.strtabsize, si.hash, si.gnu_hash, si.gnu_maskwords);
+	LOG(".hash has %zu broken entries, built again.", bad);
+	return true;
+}
+
+/**
+ * Opt-in. Build a .gnu.hash for a file which only has the SysV .hash, 
+ * so lookups get a bloom filter and short chains.
+ * .gnu.hash wants the hashed symbols at the end of .dynsym, grouped by 
+ * bucket. .dynsym, .gnu.version and .hash are rewritten in place in that 
+ * order and the relocations renumbered. The table itself goes to a 
+ * PT_LOAD added behind the image, with a copy of the program header 
+ * table that has room for it. If .dynamic has no spare DT_NULL for 
+ * DT_GNU_HASH, it is moved there as well.
+ */
+template <typename ELF>
+bool ELFRebuilder<ELF>::addGnuHash(){
+	PhaseTimer timer(kPhaseHash);
+	if(!add_gnu_hash) return true;
+	if(si.gnu_hash != 0 || si.hash == 0 || si.symtab == nullptr || si.dynsym_count == 0 || si.nbucket == 0){
+		VLOG("No .gnu.hash added, the file has one already or no .hash.");
+		return true;
+	}
+	// Packed relocations would have to be encoded again, 
+	// and MIPS ties the order of .dynsym to the GOT.
+	if(si.android_reloc != nullptr || elf_header.e_machine == EM_MIPS){
+		VLOG("No .gnu.hash added, .dynsym cannot be reordered in this file.");
+		return true;
+	}
+	size_t count = si.dynsym_count;
+	uintptr_t limit = si.load_bias + si.max_load;
+	if((uintptr_t)(si.symtab + count) > limit || 
+	   si.hash + (2 + si.nbucket + count) * sizeof(Elf_Word) > limit || 
+	   (si.versym != nullptr && (uintptr_t)(si.versym + count) > limit)){
+		VLOG("No .gnu.hash added, .dynsym runs out of the image.");
+		return true;
+	}
+
+	// New order: the null symbol, locals and undefined ones, 
+	// then the hashed ones sorted by bucket.
+	std::vector<Elf_Word> order;	// new index -> old index
+	std::vector<uint32_t> hashes(count);
+	order.reserve(count);
+	order.push_back(0);
+	for(size_t i = 1; i < count; i++){
+		if(si.symtab[i].st_shndx == SHN_UNDEF || si.symtab[i].getBinding() == STB_LOCAL){
+			order.push_back(i);
+		}
+	}
+	uint32_t symndx = order.size();
+	size_t nhashed = count - symndx;
+	for(size_t i = 1; i < count; i++){
+		if(si.symtab[i].st_shndx != SHN_UNDEF && si.symtab[i].getBinding() != STB_LOCAL){
+			hashes[i] = SymbolIndex<ELF>::gnuHash(symbols.getName(i));
+			order.push_back(i);
+		}
+	}
+	// The same sizes lld picks.
+	const uint32_t wordBits = sizeof(Elf_Addr) * 8;
+	const uint32_t shift2 = 26;
+	uint32_t nbucket = std::max<size_t>((nhashed + 3) / 4, 1);
+	uint32_t maskwords = 1;
+	while(maskwords <= nhashed * 12 / wordBits) { maskwords <<= 1; }
+	std::stable_sort(order.begin() + symndx, order.end(), [&hashes, nbucket](Elf_Word a, Elf_Word b){
+		return hashes[a] % nbucket < hashes[b] % nbucket;
+	});
+
+	std::vector<Elf_Word> newIndex(count);
+	bool reordered = false;
+	for(size_t n = 0; n < count; n++){
+		newIndex[order[n]] = n;
+		reordered |= order[n] != n;
+	}
+	if(reordered){
+		std::vector<Elf_Sym> syms(si.symtab, si.symtab + count);
+		for(size_t n = 0; n < count; n++){
+			si.symtab[n] = syms[order[n]];
+		}
+		if(si.versym != nullptr){
+			std::vector<Elf_Half> versym(si.versym, si.versym + count);
+			for(size_t n = 0; n < count; n++){
+				si.versym[n] = versym[order[n]];
+			}
+		}
+		renumberSymbols(si.rel, si.rel_count, newIndex);
+		renumberSymbols(si.plt_rel, si.plt_rel_count, newIndex);
+		renumberSymbols(si.rela, si.rela_count, newIndex);
+		renumberSymbols(si.plt_rela, si.plt_rela_count, newIndex);
+
+		// .hash keeps its size, only the chains are built again.
+		writeHash(elfHashes());
+		DLOG(".dynsym reordered for .gnu.hash, %zu symbols hashed.", nhashed);
+	}
+
+	// Lay out the added segment: program headers, .dynamic, .gnu.hash.
+	Elf_Addr align = PAGE_SIZE;
+	for(const Elf_Phdr* phdr : segments.loads){
+		if(phdr->p_align > align) align = phdr->p_align;
+	}
+	size_t dyn_used = 0;
+	while(dyn_used < si.dynamic_count && si.dynamic[dyn_used].d_tag != DT_NULL) { dyn_used++; }
+	bool moveDynamic = dyn_used + 1 >= si.dynamic_count;
+
+	auto alignUp = [](Elf_Addr v) { return (v + sizeof(Elf_Addr) - 1) & ~(Elf_Addr)(sizeof(Elf_Addr) - 1); };
+	size_t phnum = si.phnum + 1;
+	Elf_Addr dyn_off = alignUp(phnum * sizeof(Elf_Phdr));
+	Elf_Addr gnu_off = dyn_off;
+	if(moveDynamic){
+		new_dynamic_size = (dyn_used + 2) * sizeof(Elf_Dyn);
+		gnu_off = alignUp(dyn_off + new_dynamic_size);
+	}
+	new_gnu_hash_size = 4 * sizeof(uint32_t) + maskwords * sizeof(Elf_Addr) 
+					  + (nbucket + nhashed) * sizeof(uint32_t);
+	extra_addr = (si.max_load + align - 1) & ~(align - 1);
+	extra.assign(gnu_off + new_gnu_hash_size, 0);
+	new_gnu_hash = extra_addr + gnu_off;
+
+	//.gnu.hash
+	Elf_Field<uint32_t>* header = reinterpret_cast<Elf_Field<uint32_t>*>(&extra[gnu_off]);
+	header[0] = nbucket;
+	header[1] = symndx;
+	header[2] = maskwords;
+	header[3] = shift2;
+	Elf_Field<Elf_Addr>* bloom = reinterpret_cast<Elf_Field<Elf_Addr>*>(header + 4);
+	Elf_Field<uint32_t>* gnu_bucket = reinterpret_cast<Elf_Field<uint32_t>*>(bloom + maskwords);
+	Elf_Field<uint32_t>* gnu_chain = gnu_bucket + nbucket;
+	for(size_t n = symndx; n < count; n++){
+		uint32_t h = hashes[order[n]];
+		uint32_t b = h % nbucket;
+		Elf_Addr word = bloom[(h / wordBits) & (maskwords - 1)];
+		word |= (Elf_Addr)1 << (h % wordBits);
+		word |= (Elf_Addr)1 << ((h >> shift2) % wordBits);
+		bloom[(h / wordBits) & (maskwords - 1)] = word;
+		if(gnu_bucket[b] == 0) gnu_bucket[b] = n;
+		// the last symbol of a bucket ends its chain
+		bool last = n + 1 == count || hashes[order[n+1]] % nbucket != b;
+		gnu_chain[n - symndx] = (h & ~1u) | (last ? 1 : 0);
+	}
+
+	//.dynamic, DT_GNU_HASH goes in front of the DT_NULL
+	Elf_Dyn* dyn = si.dynamic;
+	if(moveDynamic){
+		dyn = reinterpret_cast<Elf_Dyn*>(&extra[dyn_off]);
+		memcpy((void*)dyn, (void*)si.dynamic, dyn_used * sizeof(Elf_Dyn));
+		new_dynamic = extra_addr + dyn_off;
+	}
+	dyn[dyn_used].d_tag = DT_GNU_HASH;
+	dyn[dyn_used].d_un.d_ptr = new_gnu_hash;
+	dyn[dyn_used+1].d_tag = DT_NULL;
+	dyn[dyn_used+1].d_un.d_val = 0;
+
+	// The program header table with the new PT_LOAD behind the last one.
+	const Elf_Phdr* old_phdr = reader.getLoadedPhdr();
+	Elf_Phdr* phdr = reinterpret_cast<Elf_Phdr*>(&extra[0]);
+	size_t at = 0;
+	for(size_t i = 0; i < si.phnum; i++){
+		if(old_phdr[i].p_type == PT_LOAD) at = i + 1;
+	}
+	for(size_t i = 0, j = 0; i < phnum; i++){
+		if(i == at) continue;
+		phdr[i] = old_phdr[j++];
+		if(phdr[i].p_type == PT_PHDR){
+			phdr[i].p_offset = phdr[i].p_vaddr = phdr[i].p_paddr = extra_addr;
+			phdr[i].p_filesz = phdr[i].p_memsz = phnum * sizeof(Elf_Phdr);
+		} else if(phdr[i].p_type == PT_DYNAMIC && moveDynamic){
+			phdr[i].p_offset = phdr[i].p_vaddr = phdr[i].p_paddr = new_dynamic;
+			phdr[i].p_filesz = phdr[i].p_memsz = new_dynamic_size;
+		}
+	}
+	phdr[at].p_type = PT_LOAD;
+	phdr[at].p_flags = moveDynamic ? PF_R | PF_W : PF_R;
+	phdr[at].p_offset = phdr[at].p_vaddr = phdr[at].p_paddr = extra_addr;
+	phdr[at].p_filesz = phdr[at].p_memsz = extra.size();
+	phdr[at].p_align = align;
+	elf_header.e_phoff = extra_addr;
+	elf_header.e_phnum = phnum;
+
+	symbols.build(si.symtab, count, si.strtab, si.strtabsize, si.hash, (uintptr_t)header, maskwords);
+	VLOG(".gnu.hash added at 0x%" PRIx64 ", %d buckets, %d bloom words%s.", (uint64_t)new_gnu_hash, 
+		 nbucket, maskwords, moveDynamic ? ", .dynamic moved" : "");
+	return true;
+}
+
+template <typename ELF>
+template <typename Elf_Reloc>
+void ELFRebuilder<ELF>::renumberSymbols(Elf_Reloc* rel, size_t count, const std::vector<Elf_Word>& newIndex){
+	if(rel == nullptr) return;
+	for(size_t i = 0; i < count; i++){
+		Elf_Word sym = rel[i].getSymbol();
+		if(sym != 0 && sym < newIndex.size()) rel[i].setSymbol(newIndex[sym]);
+	}
+}
+
+/**
+ * .ARM.exidx is a table of 8 bytes entries sorted by function. The first 
+ * word is a prel31 offset to the function start. The second one is 
+ * EXIDX_CANTUNWIND, an inline unwind entry (bit 31 set), or a prel31 
+ * offset into .ARM.extab. So the table gives us both the function 
+ * boundaries and the extent of .ARM.extab.
+ */
+template <typename ELF>
+bool ELFRebuilder<ELF>::buildFunctionIndex(){
+	PhaseTimer timer(kPhaseSymtab);
+	func_starts.clear();
+	extab_start = extab_end = 0;
+	if(si.ARM_exidx == nullptr || si.ARM_exidx_count < 2) return true;
+
+	auto prel31 = [](uint32_t word) -> Elf_Addr {
+		return static_cast<Elf_Addr>(static_cast<int32_t>(word << 1) >> 1);
+	};
+	const Elf_Field<uint32_t>* entry = reinterpret_cast<const Elf_Field<uint32_t>*>(si.ARM_exidx);
+	Elf_Addr exidx = (uintptr_t)si.ARM_exidx - si.load_bias;
+	size_t count = si.ARM_exidx_count / 2;
+	Elf_Addr extab_min = ~(Elf_Addr)0;
+
+	func_starts.reserve(count);
+	for(size_t i = 0; i < count; i++){
+		Elf_Addr where = exidx + i * 8;
+		Elf_Addr func = (where + prel31(entry[2*i])) & ~(Elf_Addr)1;
+		if(func >= si.min_load && func < exidx){
+			func_starts.push_back(func);
+		}
+
+		uint32_t data = entry[2*i + 1];
+		if(data != 1 /* EXIDX_CANTUNWIND */ && (data & 0x80000000) == 0){
+			Elf_Addr tab = where + 4 + prel31(data);
+			if(tab < exidx && tab < extab_min) extab_min = tab;
+		}
+	}
+	// The linker sorts the table. But protectors may not keep it.
+	if(!std::is_sorted(func_starts.begin(), func_starts.end())){
+		std::sort(func_starts.begin(), func_starts.end());
+	}
+	func_starts.erase(std::unique(func_starts.begin(), func_starts.end()), func_starts.end());
+
+	if(extab_min != ~(Elf_Addr)0){
+		extab_start = extab_min;
+		extab_end = exidx;
+		// Code never lives in .ARM.extab. Drop the end-of-text sentinel.
+		while(!func_starts.empty() && func_starts.back() >= extab_start){
+			func_starts.pop_back();
+		}
+	}
+	VLOG("%zu functions found by .ARM.exidx", func_starts.size());
+	return true;
+}
+
+/**
+ * Locate .eh_frame by the pointer in .eh_frame_hdr, and walk the 
+ * CIE/FDE chain to get its size. If the header is broken, .eh_frame
+ * is assumed to follow it, as every linker does.
+ */
+template <typename ELF>
+bool ELFRebuilder<ELF>::readEhFrame(){
+	si.eh_frame = nullptr;
+	si.eh_frame_size = 0;
+	if(si.eh_frame_hdr == nullptr) return true;
+
+	eh_frame = EhFrame<ELF>(si.load_bias, si.min_load, si.max_load);
+	Elf_Addr hdr = (uintptr_t)si.eh_frame_hdr - si.load_bias;
+	Elf_Addr frame = 0;
+	size_t size = 0;
+	if(eh_frame.readHdr(hdr, si.eh_frame_hdr_size)){
+		frame = eh_frame.getFramePtr();
+		size = eh_frame.walk(frame);
+	} else{
+		DLOG(".eh_frame_hdr is broken, looking for .eh_frame behind it.");
+	}
+	if(size == 0){
+		frame = hdr + si.eh_frame_hdr_size;
+		while(frame & (sizeof(Elf_Addr) - 1)) { frame++; }
+		size = eh_frame.walk(frame);
+		if(size == 0 && (frame & 4) == 0){
+			// 4 bytes aligned is enough for .eh_frame
+			frame = hdr + si.eh_frame_hdr_size;
+			while(frame & 3) { frame++; }
+			size = eh_frame.walk(frame);
+		}
+	}
+	if(size == 0){
+		DLOG("No .eh_frame found.");
+		return true;
+	}
+	si.eh_frame = (uint8_t*)(si.load_bias + frame);
+	si.eh_frame_size = size;
+	VLOG(".eh_frame at 0x%" PRIx64 ", size 0x%zx, %zu FDEs", (uint64_t)frame, size, eh_frame.getFdeCount());
+	return true;
+}
+
+/**
+ * Regenerate the binary search table of .eh_frame_hdr if it is missing
+ * or doesn't agree with .eh_frame. It is called after rebuildRelocs(),
+ * absolute pointers in the FDEs of a memory dump are restored by then.
+ */
+template <typename ELF>
+bool ELFRebuilder<ELF>::rebuildEhFrameHdr(){
+	PhaseTimer timer(kPhaseSymtab);
+	if(si.eh_frame == nullptr) return true;
+
+	Elf_Addr frame = (uintptr_t)si.eh_frame - si.load_bias;
+	eh_frame.walk(frame);
+	if(eh_frame.hasSearchTable()){
+		VLOG(".eh_frame_hdr search table is fine.");
+		return true;
+	}
+	if(eh_frame.writeHdr(frame, si.eh_frame_hdr_size)){
+		VLOG(".eh_frame_hdr search table regenerated with %zu FDEs.", eh_frame.getFdeCount());
+	} else{
+		DLOG("No room to regenerate .eh_frame_hdr search table.");
+	}
+	return true;
+}
+
+/**
+ * Size of .gnu.version_d. Every Verdef is followed by its Verdaux 
+ * entries, and the chain is linked by offsets. Walk it once and take 
+ * the end of the farthest entry.
+ */
+template <typename ELF>
+size_t ELFRebuilder<ELF>::verdefSize(){
+	uintptr_t start = (uintptr_t)si.verdef;
+	uintptr_t limit = si.load_bias + si.max_load;
+	uintptr_t end = start;
+	uintptr_t cur = start;
+	for(size_t i = 0; si.verdef_num == 0 || i < si.verdef_num; i++){
+		if(cur + sizeof(Elf_Verdef) > limit) break;
+		const Elf_Verdef* vd = reinterpret_cast<const Elf_Verdef*>(cur);
+		if(vd->vd_version != VER_DEF_CURRENT) break;
+		end = std::max(end, cur + sizeof(Elf_Verdef));
+
+		uintptr_t aux = cur + vd->vd_aux;
+		for(size_t j = 0; j < vd->vd_cnt; j++){
+			if(aux + sizeof(Elf_Verdaux) > limit) break;
+			end = std::max(end, aux + sizeof(Elf_Verdaux));
+			const Elf_Verdaux* vda = reinterpret_cast<const Elf_Verdaux*>(aux);
+			if(vda->vda_next == 0) break;
+			aux += vda->vda_next;
+		}
+		if(vd->vd_next == 0) break;
+		cur += vd->vd_next;
+	}
+	return end - start;
+}
+
+/**
+ * Size of .gnu.version_r, the same walk over Verneed and Vernaux.
+ */
+template <typename ELF>
+size_t ELFRebuilder<ELF>::verneedSize(){
+	uintptr_t start = (uintptr_t)si.verneed;
+	uintptr_t limit = si.load_bias + si.max_load;
+	uintptr_t end = start;
+	uintptr_t cur = start;
+	for(size_t i = 0; si.verneed_num == 0 || i < si.verneed_num; i++){
+		if(cur + sizeof(Elf_Verneed) > limit) break;
+		const Elf_Verneed* vn = reinterpret_cast<const Elf_Verneed*>(cur);
+		if(vn->vn_version != VER_NEED_CURRENT) break;
+		end = std::max(end, cur + sizeof(Elf_Verneed));
+
+		uintptr_t aux = cur + vn->vn_aux;
+		for(size_t j = 0; j < vn->vn_cnt; j++){
+			if(aux + sizeof(Elf_Vernaux) > limit) break;
+			end = std::max(end, aux + sizeof(Elf_Vernaux));
+			const Elf_Vernaux* vna = reinterpret_cast<const Elf_Vernaux*>(aux);
+			if(vna->vna_next == 0) break;
+			aux += vna->vna_next;
+		}
+		if(vn->vn_next == 0) break;
+		cur += vn->vn_next;
+	}
+	return end - start;
+}
+
+/**
+ * Collect the ranges of relocation targets inside the writable 
+ * segments in one pass over every relocation table. They tell where 
+ * .got, .got.plt and .data.rel.ro are, on any architecture.
+ */
+template <typename ELF>
+void ELFRebuilder<ELF>::scanRelocTargets(){
+	got_targets = slot_targets = data_targets = TargetRange();
+	rw_start = ~(Elf_Addr)0;
+	rw_end = 0;
+	for(const Elf_Phdr* phdr : segments.loads){
+		if((phdr->p_flags & PF_W) == 0) continue;
+		rw_start = std::min(rw_start, (Elf_Addr)phdr->p_vaddr);
+		rw_end = std::max(rw_end, (Elf_Addr)(phdr->p_vaddr + phdr->p_memsz));
+	}
+	if(rw_start >= rw_end) return;
+
+	scanRelocTargets(si.rel, si.rel_count, false);
+	scanRelocTargets(si.plt_rel, si.plt_rel_count, true);
+	scanRelocTargets(si.rela, si.rela_count, false);
+	scanRelocTargets(si.plt_rela, si.plt_rela_count, true);
+
+	if(si.android_reloc != nullptr){
+		PackedRelocIterator<ELF> it(si.android_reloc, si.android_reloc_size);
+		while(it.hasNext()){
+			const Elf_Rela* rela = it.next();
+			if(rela == nullptr) break;
+			addRelocTarget(rela->r_offset, rela->getType(), false);
+		}
+	}
+	// RELR is sorted and only RELATIVE, the first address is enough.
+	if(si.relr != nullptr && si.relr_count != 0 && (si.relr[0] & 1) == 0){
+		addRelocTarget(si.relr[0], si.arch.relative_type, false);
+	}
+	VLOG("GOT targets [0x%" PRIx64 ", 0x%" PRIx64 "], JUMP_SLOT targets [0x%" PRIx64 ", 0x%" PRIx64 "]", 
+		 (uint64_t)got_targets.min, (uint64_t)got_targets.max, (uint64_t)slot_targets.min, (uint64_t)slot_targets.max);
+}
+
+template <typename ELF>
+template <typename Elf_Reloc>
+void ELFRebuilder<ELF>::scanRelocTargets(const Elf_Reloc* rel, size_t count, bool jmprel){
+	if(rel == nullptr) return;
+	for(size_t i = 0; i < count; i++){
+		addRelocTarget(rel[i].r_offset, rel[i].getType(), jmprel);
+	}
+}
+
+template <typename ELF>
+void ELFRebuilder<ELF>::addRelocTarget(Elf_Addr offset, Elf_Word type, bool jmprel){
+	if(offset < rw_start || offset >= rw_end) return;
+	// Everything in DT_JMPREL is a .got.plt slot, IRELATIVE included.
+	if(jmprel){
+		slot_targets.add(offset);
+	} else if(type == si.arch.glob_dat_type){
+		got_targets.add(offset);
+	} else if(si.arch.isTlsType(type)){
+		// TLSDESC takes two words
+		got_targets.add(offset);
+		if(type == si.arch.tls_types[3]) got_targets.add(offset + sizeof(Elf_Addr));
+	} else if(type == si.arch.jump_slot_type){
+		slot_targets.add(offset);
+	} else{
+		data_targets.add(offset);
+	}
+}
+
+/**
+ * Find PLT0 in [from, end) by its code. Every form loads the resolver 
+ * from .got.plt, which starts at DT_PLTGOT:
+ *   x86_64   push GOT+8(%rip); [bnd] jmp *GOT+16(%rip)
+ *   i386     pushl 4(%ebx); jmp *8(%ebx), or the same on absolute GOT+4/+8
+ *   ARM      str lr,[sp,#-4]!; ldr lr,[pc,#4]; add lr,pc,lr; ldr pc,[lr,#8]!; .word GOT-.
+ *   AArch64  stp x16,x30,[sp,#-16]!; adrp x16,GOT+16; ldr x17,[x16,#lo12(GOT+16)]
+ *   MIPS     lui gp,%hi(GOT); lw t9,%lo(GOT)(gp)
+ * Returns 0 if nothing matches.
+ */
+template <typename ELF>
+typename ELFRebuilder<ELF>::Elf_Addr ELFRebuilder<ELF>::findPlt0(Elf_Addr from, Elf_Addr end){
+	if(si.plt_got == nullptr || end > si.loadSegFileEnd) return 0;
+	Elf_Addr got = (uintptr_t)si.plt_got - si.load_bias;
+	const uint8_t* image = reinterpret_cast<const uint8_t*>(si.load_bias);
+	// x86 and AArch64 code is little endian, ARM data and MIPS code are in the byte order of the file.
+	auto le32 = [image](Elf_Addr a) -> uint32_t { 
+		const uint8_t* p = image + a;
+		return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+	};
+	auto word = [image](Elf_Addr a) -> uint32_t { return *reinterpret_cast<const Elf_Field<Elf_Word>*>(image + a); };
+	auto rel32 = [&le32](Elf_Addr a, Elf_Addr next) -> Elf_Addr { return next + (int32_t)le32(a); };
+
+	for(Elf_Addr a = (from + 3) & ~(Elf_Addr)3; a + 20 <= end; a += 4){
+		const uint8_t* p = image + a;
+		switch(si.arch.machine){
+			case EM_X86_64:
+				if(p[0] != 0xff || p[1] != 0x35 || rel32(a + 2, a + 6) != got + 8) break;
+				if(p[6] == 0xff && p[7] == 0x25 && rel32(a + 8, a + 12) == got + 16) return a;
+				if(p[6] == 0xf2 && p[7] == 0xff && p[8] == 0x25 && rel32(a + 9, a + 13) == got + 16) return a;
+				break;
+			case EM_386:
+				if(memcmp(p, "\xff\xb3\x04\0\0\0\xff\xa3\x08\0\0\0", 12) == 0) return a;
+				if(p[0] == 0xff && p[1] == 0x35 && le32(a + 2) == got + 4 && 
+				   p[6] == 0xff && p[7] == 0x25 && le32(a + 8) == got + 8) return a;
+				break;
+			case EM_ARM:
+				if(le32(a) == 0xe52de004 && le32(a + 4) == 0xe59fe004 && le32(a + 8) == 0xe08fe00e && 
+				   le32(a + 12) == 0xe5bef008 && a + 16 + word(a + 16) == got) return a;
+				break;
+			case EM_AARCH64:{
+				uint32_t adrp = le32(a + 4), ldr = le32(a + 8);
+				if(le32(a) != 0xa9bf7bf0 || (adrp & 0x9f00001f) != 0x90000010 || (ldr & 0xffc003ff) != 0xf9400211) break;
+				int64_t page = (int64_t)((uint64_t)((adrp >> 5 & 0x7ffff) << 2 | (adrp >> 29 & 3)) << 43) >> 31;
+				if(((a + 4) & ~(Elf_Addr)0xfff) + page + (ldr >> 10 & 0xfff) * 8 == got + 16) return a;
+				break;
+			}
+			case EM_MIPS:{
+				uint32_t lui = word(a), lw = word(a + 4);
+				if((lui & 0xffff0000) != 0x3c1c0000 || (lw & 0xffff0000) != 0x8f990000) break;
+				if((Elf_Addr)((lui << 16) + (int16_t)(lw & 0xffff)) == got) return a;
+				break;
+			}
+			default:
+				return 0;
+		}
+	}
+	return 0;
+}
+
+// Notes are named by owner and type, the way the linkers name their sections.
+static SectionKind noteKind(const char* owner, size_t namesz, uint32_t type){
+	if(namesz == sizeof("GNU") && memcmp(owner, "GNU", namesz) == 0){
+		switch(type){
+			case NT_GNU_ABI_TAG: return kSecNOTEABITAG;
+			case NT_GNU_BUILD_ID: return kSecNOTEBUILDID;
+			case NT_GNU_PROPERTY_TYPE_0: return kSecNOTEPROPERTY;
+			default: return kSecNOTE;
+		}
+	}
+	if(namesz == sizeof("Android") && memcmp(owner, "Android", namesz) == 0 && 
+	   type == NT_ANDROID_TYPE_IDENT){
+		return kSecNOTEANDROID;
+	}
+	return kSecNOTE;
+}
+
+template <typename ELF>
+bool ELFRebuilder<ELF>::rebuildShdr(){
+	PhaseTimer timer(kPhaseShdr);
 	shdrs.clear();
-	Elf_Addr base = si.load_bias;
+	shdrs.reserve(kSecCount + 1);
+	dtSized.clear();
+	plt0 = 0;
+	uintptr_t base = si.load_bias;
 
 	Elf_Shdr shdr;
 	memset((void*)&shdr, 0, sizeof(shdr));
-	shstrtab.push_back('\0');
 	shdrs.push_back(shdr);
 
+	// The blocks below go in link order, a section linked to is generated
+	// before the ones linking to it. See SectionTable.h.
+
 	// generate .interp
 	if(si.interp != nullptr){
-		memset((void*)&shdr, 0, sizeof(shdr));
-		sINTERP = shdrs.size();
-		shdr.sh_name = shstrtab.length();
-		shstrtab.append(".interp");
-		shstrtab.push_back('\0');
-		
-		shdr.sh_type = SHT_PROGBITS;
-		shdr.sh_flags = SHF_ALLOC;
-		shdr.sh_addr = (Elf_Addr)si.interp - base;
-		shdr.sh_offset = shdr.sh_addr;
-		shdr.sh_size = si.interp_size;
-		shdr.sh_link = 0;
-		shdr.sh_info = 0;
-		shdr.sh_addralign = 1;
-		shdr.sh_entsize = 0;
-		
-		shdrs.push_back(shdr);
+		sINTERP = addSection(kSecINTERP, (uintptr_t)si.interp - base, si.interp_size);
 	}
 
-	//generate .dynsym
-	if(si.symtab != nullptr){
-		memset((void*)&shdr, 0, sizeof(shdr));
-		sDYNSYM = shdrs.size();
-		shdr.sh_name = shstrtab.length();
-		shstrtab.append(".dynsym");
-		shstrtab.push_back('\0');
-
-		shdr.sh_type = SHT_DYNSYM;
-		shdr.sh_flags = SHF_ALLOC;
-		shdr.sh_addr = (Elf_Addr)si.symtab - base;
-		shdr.sh_offset = shdr.sh_addr;
-		shdr.sh_size = si.dynsym_size;
-		shdr.sh_link = 0; 		// link to dynstr later
-		shdr.sh_info = 1;
-		shdr.sh_addralign = 4;
-		shdr.sh_entsize = 0x10;
-
-		shdrs.push_back(shdr);
+	//generate .note.*
+	// One section for each run of notes of the same kind in PT_NOTE.
+	for(const Elf_Phdr* phdr : segments.notes){
+		Elf_Addr addr = phdr->p_vaddr;
+		Elf_Addr end = phdr->p_vaddr + phdr->p_filesz;
+		if(addr < si.min_load || end > si.loadSegFileEnd || end < addr) continue;
+		Elf_Word align = phdr->p_align == 8 ? 8 : 4;
+		auto alignUp = [align](Elf_Addr v) { return (v + align - 1) & ~(Elf_Addr)(align - 1); };
+		Elf_Word sLAST = 0;
+		SectionKind lastKind = kSecNOTE;
+		while(end - addr >= 3 * sizeof(Elf_Word)){
+			const Elf_Field<Elf_Word>* nhdr = reinterpret_cast<const Elf_Field<Elf_Word>*>(base + addr);
+			Elf_Word namesz = nhdr[0], descsz = nhdr[1], type = nhdr[2];
+			// desc starts aligned after the header and name, the next note 
+			// aligned after desc. Sizes are checked first so the sums can't wrap.
+			Elf_Addr size = end - addr;
+			if(namesz > size || descsz > size) break;
+			Elf_Addr desc_off = alignUp(3 * sizeof(Elf_Word) + namesz);
+			if(desc_off + descsz > size) break;
+			Elf_Addr next = addr + std::min(alignUp(desc_off + descsz), size);
+
+			const char* owner = reinterpret_cast<const char*>(base + addr + 3 * sizeof(Elf_Word));
+			SectionKind kind = noteKind(owner, namesz, type);
+			if(sLAST != 0 && kind == lastKind){
+				shdrs[sLAST].sh_size = next - shdrs[sLAST].sh_addr;
+			} else{
+				sLAST = addSection(kind, addr, next - addr);
+				shdrs[sLAST].sh_addralign = align;
+				lastKind = kind;
+			}
+			addr = next;
+		}
 	}
 
 	//generate .dynstr
 	if(si.strtab != nullptr){
-		memset((void*)&shdr, 0, sizeof(shdr));
-		sDYNSTR = shdrs.size();
-		shdr.sh_name = shstrtab.length();
-		shstrtab.append(".dynstr");
-		shstrtab.push_back('\0');
-
-		shdr.sh_type = SHT_STRTAB;
-		shdr.sh_flags = SHF_ALLOC;
-		shdr.sh_addr = (Elf_Addr)si.strtab - base;
-		shdr.sh_offset = shdr.sh_addr;
-		shdr.sh_size = si.strtabsize;
-		shdr.sh_link = 0;
-		shdr.sh_info = 0;
-		shdr.sh_addralign = 1;
-		shdr.sh_entsize = 0;
+		sDYNSTR = addSection(kSecDYNSTR, (uintptr_t)si.strtab - base, si.strtabsize);
+		dtSized.push_back(sDYNSTR);
+	}
 
-		shdrs.push_back(shdr);
+	//generate .dynsym
+	if(si.symtab != nullptr){
+		sDYNSYM = addSection(kSecDYNSYM, (uintptr_t)si.symtab - base, si.dynsym_count * sizeof(Elf_Sym));
+		shdrs[sDYNSYM].sh_info = 1;
 	}
 
 	//generate .hash
 	if(si.hash != 0){
-		memset((void*)&shdr, 0, sizeof(shdr));
-		sHASH = shdrs.size();
-		shdr.sh_name = shstrtab.length();
-		shstrtab.append(".hash");
-		shstrtab.push_back('\0');
+		sHASH = addSection(kSecHASH, si.hash - base, (si.nbucket + si.nchain + 2) * sizeof(Elf_Word));
+	}
 
-		shdr.sh_type = SHT_HASH;
-		shdr.sh_flags = SHF_ALLOC;
-		shdr.sh_addr = si.hash - base;
-		shdr.sh_offset = shdr.sh_addr;
-		shdr.sh_size = (si.nbucket + si.nchain + 2) * sizeof(Elf_Addr);
-		shdr.sh_link = sDYNSYM;
-		shdr.sh_info = 0;
-		shdr.sh_addralign = 4;
-		shdr.sh_entsize = 4;
+	//generate .gnu.hash
+	if(si.gnu_hash != 0){
+		// header, bloom filter, buckets and the chain from symndx
+		Elf_Xword size = 4 * sizeof(uint32_t) + si.gnu_maskwords * sizeof(Elf_Addr) 
+					   + si.gnu_nbucket * sizeof(uint32_t);
+		if(si.dynsym_count > si.gnu_symndx){
+			size += (si.dynsym_count - si.gnu_symndx) * sizeof(uint32_t);
+		}
+		sGNUHASH = addSection(kSecGNUHASH, si.gnu_hash - base, size);
+	} else if(new_gnu_hash != 0){
+		sGNUHASH = addSection(kSecGNUHASH, new_gnu_hash, new_gnu_hash_size);
+	}
 
-		shdrs.push_back(shdr);
+	//generate .gnu.version
+	if(si.versym != nullptr && si.dynsym_count != 0){
+		sVERSYM = addSection(kSecVERSYM, (uintptr_t)si.versym - base, si.dynsym_count * sizeof(Elf_Half));
 	}
 
-	//generate .rel.dyn
-	if(si.rel != nullptr){
-		memset((void*)&shdr, 0, sizeof(shdr));
-		sRELDYN = shdrs.size();
-		shdr.sh_name = shstrtab.length();
-		shstrtab.append(".rel.dyn");
-		shstrtab.push_back('\0');
+	//generate .gnu.version_d
+	if(si.verdef != nullptr){
+		sVERDEF = addSection(kSecVERDEF, (uintptr_t)si.verdef - base, verdefSize());
+		shdrs[sVERDEF].sh_info = si.verdef_num;
+	}
 
-		shdr.sh_type = SHT_REL;
-		shdr.sh_flags = SHF_ALLOC;
-		shdr.sh_addr = (Elf_Addr)si.rel - base;
-		shdr.sh_offset = shdr.sh_addr;
-		shdr.sh_size = si.rel_count * sizeof(Elf_Rel);
-		shdr.sh_link = sDYNSYM;
-		shdr.sh_info = 0;
-		shdr.sh_addralign = 4;
-		shdr.sh_entsize = 8;
+	//generate .gnu.version_r
+	if(si.verneed != nullptr){
+		sVERNEED = addSection(kSecVERNEED, (uintptr_t)si.verneed - base, verneedSize());
+		shdrs[sVERNEED].sh_info = si.verneed_num;
+	}
 
-		shdrs.push_back(shdr);
+	//generate .rel.dyn
+	if(si.rel != nullptr){
+		sRELDYN = addSection(kSecRELDYN, (uintptr_t)si.rel - base, si.rel_count * sizeof(Elf_Rel));
+		dtSized.push_back(sRELDYN);
 	}
 
 	//generate .rel.plt
 	if(si.plt_rel != nullptr){
-		memset((void*)&shdr, 0, sizeof(shdr));
-		sRELPLT = shdrs.size();
-		shdr.sh_name = shstrtab.length();
-		shstrtab.append(".rel.plt");
-		shstrtab.push_back('\0');
-
-		shdr.sh_type = SHT_REL;
-		shdr.sh_flags = SHF_ALLOC;
-		shdr.sh_addr = (Elf_Addr)si.plt_rel - base;
-		shdr.sh_offset = shdr.sh_addr;
-		shdr.sh_size = si.plt_rel_count * sizeof(Elf_Rel);
-		shdr.sh_link = sDYNSYM;
-		shdr.sh_info = 0;
-		shdr.sh_addralign = 4;
-		shdr.sh_entsize = 8;
-
-		shdrs.push_back(shdr);
-	}
-
-	//generate .plt with .rel.plt
-	if(si.plt_rel != nullptr){
-		memset((void*)&shdr, 0, sizeof(shdr));
-		sPLT = shdrs.size();
-		shdr.sh_name = shstrtab.length();
-		shstrtab.append(".plt");
-		shstrtab.push_back('\0');
+		sRELPLT = addSection(kSecRELPLT, (uintptr_t)si.plt_rel - base, si.plt_rel_count * sizeof(Elf_Rel));
+		dtSized.push_back(sRELPLT);
+	}
 
-		shdr.sh_type = SHT_PROGBITS;
-		shdr.sh_flags = SHF_ALLOC | SHF_EXECINSTR;
-		shdr.sh_addr = shdrs[sRELPLT].sh_addr + shdrs[sRELPLT].sh_size;
-		shdr.sh_offset = shdr.sh_addr;
-		shdr.sh_size = 20 + 12 * shdrs[sRELPLT].sh_size/sizeof(Elf_Rel);
-		shdr.sh_link = 0;
-		shdr.sh_info = 0;
-		shdr.sh_addralign = 4;
-		shdr.sh_entsize = 0;
+	//generate .rela.dyn
+	if(si.rela != nullptr){
+		sRELDYN = addSection(kSecRELADYN, (uintptr_t)si.rela - base, si.rela_count * sizeof(Elf_Rela));
+		dtSized.push_back(sRELDYN);
+	}
+
+	//generate .rela.plt
+	if(si.plt_rela != nullptr){
+		sRELPLT = addSection(kSecRELAPLT, (uintptr_t)si.plt_rela - base, si.plt_rela_count * sizeof(Elf_Rela));
+		dtSized.push_back(sRELPLT);
+	}
+
+	//generate packed .rel.dyn or .rela.dyn
+	if(si.android_reloc != nullptr){
+		sRELDYN = addSection(si.android_reloc_is_rela ? kSecANDROIDRELA : kSecANDROIDREL, 
+							 (uintptr_t)si.android_reloc - base, si.android_reloc_size);
+		dtSized.push_back(sRELDYN);
+	}
+
+	//generate .relr.dyn
+	if(si.relr != nullptr){
+		sRELRDYN = addSection(si.relr_is_android ? kSecANDROIDRELR : kSecRELR, 
+							  (uintptr_t)si.relr - base, si.relr_count * sizeof(Elf_Addr));
+		dtSized.push_back(sRELRDYN);
+	}
 
-		shdrs.push_back(shdr);
+	//generate .plt with .rel.plt or .rela.plt
+	// It is in the PF_X PT_LOAD, after the last of the relocation tables.
+	// bfd puts .relr.dyn and sometimes .rela.dyn behind .rela.plt.
+	// .init may come first, PLT0 is looked up by its code from there.
+	if(si.plt_rel != nullptr || si.plt_rela != nullptr){
+		Elf_Addr plt = 0;
+		auto after = [&plt, base](const void* table, size_t size){
+			if(table != nullptr) plt = std::max(plt, (Elf_Addr)((uintptr_t)table - base + size));
+		};
+		after(si.rel, si.rel_count * sizeof(Elf_Rel));
+		after(si.plt_rel, si.plt_rel_count * sizeof(Elf_Rel));
+		after(si.rela, si.rela_count * sizeof(Elf_Rela));
+		after(si.plt_rela, si.plt_rela_count * sizeof(Elf_Rela));
+		after(si.android_reloc, si.android_reloc_size);
+		after(si.relr, si.relr_count * sizeof(Elf_Addr));
+		for(const Elf_Phdr* phdr : segments.loads){
+			if((phdr->p_flags & PF_X) == 0 || phdr->p_vaddr + phdr->p_filesz <= plt) continue;
+			plt = std::max(plt, (Elf_Addr)phdr->p_vaddr);
+			plt0 = findPlt0(plt, phdr->p_vaddr + phdr->p_filesz);
+			if(plt0 != 0){
+				VLOG("PLT0 found at 0x%" PRIx64, (uint64_t)plt0);
+				plt = plt0;
+			}
+			break;
+		}
+		sPLT = addSection(kSecPLT, plt, 
+						  si.arch.plt_header_size + si.arch.plt_entry_size * (si.plt_rel_count + si.plt_rela_count));
 	}
 
 	//generate .text&.ARM.extab
-	if(si.plt_rel != nullptr){
-		memset((void*)&shdr, 0, sizeof(shdr));
-		sTEXTTAB = shdrs.size();
-		Elf_Word sLAST = sTEXTTAB - 1;
-		shdr.sh_name = shstrtab.length();
-		shstrtab.append(".text&.ARM.extab");
-		shstrtab.push_back('\0');
-
-		shdr.sh_type = SHT_PROGBITS;
-		shdr.sh_flags = SHF_ALLOC | SHF_EXECINSTR;
-		shdr.sh_addr = shdrs[sLAST].sh_addr + shdrs[sLAST].sh_size;
-		shdr.sh_offset = shdr.sh_addr;
-		shdr.sh_size = 0;		//TODO: calculate later
-		shdr.sh_link = 0;
-		shdr.sh_info = 0;
-		shdr.sh_addralign = 8;
-		shdr.sh_entsize = 0;
-
-		shdrs.push_back(shdr);
+	//or .text alone if .ARM.exidx tells where .ARM.extab is
+	if(si.plt_rel != nullptr || si.plt_rela != nullptr){
+		Elf_Word sLAST = shdrs.size() - 1;
+		// size is calculated after sorting
+		sTEXTTAB = addSection(extab_start != 0 || !si.arch.has_exidx ? kSecTEXT : kSecTEXTEXTAB, 
+							  shdrs[sLAST].sh_addr + shdrs[sLAST].sh_size, 0);
+	}
+
+	//generate .ARM.extab
+	if(extab_start != 0){
+		sARMEXTAB = addSection(kSecARMEXTAB, extab_start, extab_end - extab_start);
 	}
 
 	//generate .ARM.exidx
 	if(si.ARM_exidx != nullptr){
-		memset((void*)&shdr, 0, sizeof(shdr));
-		sARMEXIDX = shdrs.size();
-		shdr.sh_name = shstrtab.length();
-		shstrtab.append(".ARM.exidx");
-		shstrtab.push_back('\0');
+		sARMEXIDX = addSection(kSecARMEXIDX, (uintptr_t)si.ARM_exidx - base, si.ARM_exidx_count * sizeof(Elf_Addr));
+	}
 
-		shdr.sh_type = SHT_ARM_EXIDX;
-		shdr.sh_flags = SHF_ALLOC | SHF_LINK_ORDER;
-		shdr.sh_addr = (Elf_Addr)si.ARM_exidx - base;
-		shdr.sh_offset = shdr.sh_addr;
-		shdr.sh_size = si.ARM_exidx_count * sizeof(Elf_Addr);
-		shdr.sh_link = sTEXTTAB;
-		shdr.sh_info = 0;
-		shdr.sh_addralign = 4;
-		shdr.sh_entsize = 8;
+	//generate .eh_frame_hdr
+	if(si.eh_frame_hdr != nullptr){
+		sEHFRAMEHDR = addSection(kSecEHFRAMEHDR, (uintptr_t)si.eh_frame_hdr - base, si.eh_frame_hdr_size);
+	}
 
-		shdrs.push_back(shdr);
+	//generate .eh_frame
+	if(si.eh_frame != nullptr){
+		sEHFRAME = addSection(kSecEHFRAME, (uintptr_t)si.eh_frame - base, si.eh_frame_size);
 	}
 
 	//generate .fini_array
 	if(si.fini_array != nullptr){
-		memset((void*)&shdr, 0, sizeof(shdr));
-		sFINIARRAY = shdrs.size();
-		shdr.sh_name = shstrtab.length();
-		shstrtab.append(".fini_array");
-		shstrtab.push_back('\0');
-
-		shdr.sh_type = SHT_FINI_ARRAY;
-		shdr.sh_flags = SHF_WRITE | SHF_ALLOC;
-		shdr.sh_addr = (Elf_Addr)si.fini_array - base;
-		shdr.sh_offset = shdr.sh_addr;
-		shdr.sh_size = si.fini_array_count * sizeof(Elf_Addr);
-		shdr.sh_link = 0;
-		shdr.sh_info = 0;
-		shdr.sh_addralign = 4;
-		shdr.sh_entsize = 0;
-
-		shdrs.push_back(shdr);
+		sFINIARRAY = addSection(kSecFINIARRAY, (uintptr_t)si.fini_array - base, si.fini_array_count * sizeof(Elf_Addr));
+		dtSized.push_back(sFINIARRAY);
 	}
 
 	//generate .init_array
 	if(si.init_array != nullptr){
-		memset((void*)&shdr, 0, sizeof(shdr));
-		sINITARRAY = shdrs.size();
-		shdr.sh_name = shstrtab.length();
-		shstrtab.append(".init_array");
-		shstrtab.push_back('\0');
+		sINITARRAY = addSection(kSecINITARRAY, (uintptr_t)si.init_array - base, si.init_array_count * sizeof(Elf_Addr));
+		dtSized.push_back(sINITARRAY);
+	}
 
-		shdr.sh_type = SHT_INIT_ARRAY;
-		shdr.sh_flags = SHF_WRITE | SHF_ALLOC;
-		shdr.sh_addr = (Elf_Addr)si.init_array - base;
-		shdr.sh_offset = shdr.sh_addr;
-		shdr.sh_size = si.init_array_count * sizeof(Elf_Addr);
-		shdr.sh_link = 0;
-		shdr.sh_info = 0;
-		shdr.sh_addralign = 1;
-		shdr.sh_entsize = 0;
+	//generate .dynamic
+	if(new_dynamic != 0){
+		sDYNAMIC = addSection(kSecDYNAMIC, new_dynamic, new_dynamic_size);
+	} else if(si.dynamic != nullptr){
+		sDYNAMIC = addSection(kSecDYNAMIC, (uintptr_t)si.dynamic - base, si.dynamic_count * sizeof(Elf_Dyn));
+	}
 
-		shdrs.push_back(shdr);
+	//generate .data.rel.ro
+	// Relocated data in front of the arrays and .dynamic. The size is 
+	// cut down to the next section after sorting. If no pointer fits in 
+	// there, the data is left to .data.
+	// With PT_GNU_RELRO it is found after all the others, see below.
+	if(segments.relro == nullptr && !data_targets.empty()){
+		Elf_Addr first = got_targets.empty() ? rw_end : got_targets.min;
+		auto lower = [&first, base](const void* p){ 
+			if(p != nullptr && (uintptr_t)p - base < first) first = (uintptr_t)p - base;
+		};
+		lower(si.preinit_array);
+		lower(si.init_array);
+		lower(si.fini_array);
+		lower(si.dynamic);
+		if(data_targets.min + sizeof(Elf_Addr) <= first){
+			sDATARELRO = addSection(kSecDATARELRO, data_targets.min, first - data_targets.min);
+		}
 	}
 
-	//generate .dynamic
-	if(si.dynamic != nullptr){
-		memset((void*)&shdr, 0, sizeof(shdr));
-		sDYNAMIC = shdrs.size();
-		shdr.sh_name = shstrtab.length();
-		shstrtab.append(".dynamic");
-		shstrtab.push_back('\0');
-
-		shdr.sh_type = SHT_DYNAMIC;
-		shdr.sh_flags = SHF_WRITE | SHF_ALLOC;
-		shdr.sh_addr = (Elf_Addr)si.dynamic - base;
-		shdr.sh_offset = shdr.sh_addr;
-		shdr.sh_size = si.dynamic_count * sizeof(Elf_Dyn);
-		shdr.sh_link = sDYNSTR;
-		shdr.sh_info = 0;
-		shdr.sh_addralign = 4;
-		shdr.sh_entsize = 8;
-
-		shdrs.push_back(shdr);
-	}
-
-	//generate .got
-	if(si.plt_got != nullptr){
-		memset((void*)&shdr, 0, sizeof(shdr));
-		sGOT = shdrs.size();
-		Elf_Word sLAST = sGOT - 1;
-		shdr.sh_name = shstrtab.length();
-		shstrtab.append(".got");
-		shstrtab.push_back('\0');
-
-		shdr.sh_type = SHT_PROGBITS;
-		shdr.sh_flags = SHF_WRITE | SHF_ALLOC;
-		shdr.sh_addr = shdrs[sLAST].sh_addr + shdrs[sLAST].sh_size;
-		// In fact the .got is align 8.
-		while(shdr.sh_addr & 0x7){ shdr.sh_addr++; }
-		shdr.sh_offset = shdr.sh_addr;
-		shdr.sh_size = (Elf_Addr)si.plt_got - base + 4*shdrs[sRELPLT].sh_size/sizeof(Elf_Rel) + 12 - shdr.sh_addr;
-		shdr.sh_link = 0;
-		shdr.sh_info = 0;
-		shdr.sh_addralign = 4;
-		shdr.sh_entsize = 0;
-
-		shdrs.push_back(shdr);
+	//generate .got and .got.plt
+	// They are bounded by the GLOB_DAT and JUMP_SLOT targets. DT_PLTGOT
+	// points to the reserved words in front of the JUMP_SLOT entries.
+	// ARM linkers keep all of them in one .got, the others split .got.plt
+	// at DT_PLTGOT.
+	if(si.plt_got != nullptr || !got_targets.empty() || !slot_targets.empty()){
+		Elf_Addr gotplt = 0, gotplt_end = 0;
+		if(si.plt_got != nullptr){
+			gotplt = (uintptr_t)si.plt_got - base;
+			gotplt_end = gotplt + si.arch.gotplt_reserved*sizeof(Elf_Addr);
+		} else if(!slot_targets.empty()){
+			gotplt = slot_targets.min;
+			gotplt_end = gotplt;
+		}
+		if(!slot_targets.empty() && slot_targets.max + sizeof(Elf_Addr) > gotplt_end){
+			gotplt_end = slot_targets.max + sizeof(Elf_Addr);
+		}
+
+		Elf_Addr got = gotplt, got_end = gotplt;
+		if(!got_targets.empty()){
+			got = got_targets.min;
+			got_end = got_targets.max + sizeof(Elf_Addr);
+		}
+		bool split = si.arch.split_gotplt && gotplt_end != 0 && 
+					 got_end <= gotplt && got < gotplt;
+		if(!split){
+			got = std::min(got, gotplt_end != 0 ? gotplt : got);
+			got_end = std::max(got_end, gotplt_end);
+		} else{
+			got_end = gotplt;
+		}
+
+		if(got_end > got){
+			sGOT = addSection(kSecGOT, got, got_end - got);
+		}
+		if(split){
+			sGOTPLT = addSection(kSecGOTPLT, gotplt, gotplt_end - gotplt);
+		}
+	}
+
+	// .rel.plt applies to the slots in .got.plt, or .got without one.
+	// ARM linkers point it to .plt.
+	if(sRELPLT != 0){
+		shdrs[sRELPLT].sh_info = si.arch.split_gotplt ? (sGOTPLT != 0 ? sGOTPLT : sGOT) : sPLT;
 	}
 
 	//generate .data
+	// After the end of every section so far, .data.rel.ro may be the 
+	// last one added but lie in front of .dynamic.
 	if(true){
-		memset((void*)&shdr, 0, sizeof(shdr));
-		sDATA = shdrs.size();
-		Elf_Word sLAST = sDATA - 1;
-		shdr.sh_name = shstrtab.length();
-		shstrtab.append(".data");
-		shstrtab.push_back('\0');
-
-		shdr.sh_type = SHT_PROGBITS;
-		shdr.sh_flags = SHF_WRITE | SHF_ALLOC;
-		shdr.sh_addr = shdrs[sLAST].sh_addr + shdrs[sLAST].sh_size;
-		shdr.sh_offset = shdr.sh_addr;
-		shdr.sh_size = si.loadSegEnd - shdr.sh_addr;
-		shdr.sh_link = 0;
-		shdr.sh_info = 0;
-		shdr.sh_addralign = 4;
-		shdr.sh_entsize = 0;
-
-		shdrs.push_back(shdr);
+		Elf_Addr addr = 0;
+		for(const Elf_Shdr& s : shdrs) addr = std::max(addr, (Elf_Addr)(s.sh_addr + s.sh_size));
+		sDATA = addSection(kSecDATA, addr, si.loadSegFileEnd > addr ? si.loadSegFileEnd - addr : 0);
 	}
 
 	//generate .bss
 	if(true){
-		memset((void*)&shdr, 0, sizeof(shdr));
-		sBSS = shdrs.size();
-		Elf_Word sLAST = sBSS - 1;
-		shdr.sh_name = shstrtab.length();
-		shstrtab.append(".bss");
-		shstrtab.push_back('\0');
-
-		shdr.sh_type = SHT_NOBITS;
-		shdr.sh_flags = SHF_WRITE | SHF_ALLOC;
-		shdr.sh_addr = shdrs[sLAST].sh_addr + shdrs[sLAST].sh_size;
-		shdr.sh_offset = shdr.sh_addr;
-		shdr.sh_size = 0;
-		shdr.sh_link = 0;
-		shdr.sh_info = 0;
-		shdr.sh_addralign = 1;
-		shdr.sh_entsize = 0;
-
-		shdrs.push_back(shdr);
+		Elf_Word sLAST = shdrs.size() - 1;
+		Elf_Addr addr = shdrs[sLAST].sh_addr + shdrs[sLAST].sh_size;
+		sBSS = addSection(kSecBSS, addr, si.loadSegEnd > addr ? si.loadSegEnd - addr : 0);
 	}
 
-	//generate .shstrtab
-	memset((void*)&shdr, 0, sizeof(shdr));
-	sSHSTRTAB = shdrs.size();
-	shdr.sh_name = shstrtab.length();
-	shstrtab.append(".shstrtab");
-	shstrtab.push_back('\0');
-
-	shdr.sh_type = SHT_STRTAB;
-	shdr.sh_flags = 0;
-	shdr.sh_addr = 0;
-	shdr.sh_offset = (Elf_Addr)si.max_load;
-	shdr.sh_size = shstrtab.length();
-	shdr.sh_link = 0;
-	shdr.sh_info = 0;
-	shdr.sh_addralign = 1;
-	shdr.sh_entsize = 0;
+	//generate .tdata
+	if(si.has_tls && si.tls_filesz != 0){
+		sTDATA = addSection(kSecTDATA, si.tls_addr, si.tls_filesz);
+		shdrs[sTDATA].sh_addralign = si.tls_align;
+	}
 
-	shdrs.push_back(shdr);
+	//generate .tbss
+	// It takes no space in the image, the next section starts at the same address.
+	if(si.has_tls && si.tls_memsz > si.tls_filesz){
+		Elf_Addr addr = si.tls_addr + si.tls_filesz;
+		if(si.tls_align > 1){
+			while(addr % si.tls_align) { addr++; }
+		}
+		Elf_Addr end = si.tls_addr + si.tls_memsz;
+		sTBSS = addSection(kSecTBSS, addr, end > addr ? end - addr : 0);
+		shdrs[sTBSS].sh_addralign = si.tls_align;
+	}
 
-	// patch the link section data
-	if(sDYNSYM != 0){
-		shdrs[sDYNSYM].sh_link = sDYNSTR;
-	}
-
-	// sort shdr by address and recalc size
-	for(int i = 1; i < shdrs.size(); i++) {
-		for(int j = i + 1; j < shdrs.size(); j++) {
-			if(shdrs[i].sh_offset > shdrs[j].sh_offset) {
-				// exchange i, j
-				Elf_Shdr tmp = shdrs[i];
-				shdrs[i] = shdrs[j];
-				shdrs[j] = tmp;
-
-				// exchange index
-				auto chgIdx = [i, j](Elf_Word &t) {
-					if(t == i) {
-						t = j;
-					} else if(t == j) {
-						t = i;
-					}
-				};
-				chgIdx(sDYNSYM);
-				chgIdx(sDYNSTR);
-				chgIdx(sHASH);
-				chgIdx(sRELDYN);
-				chgIdx(sRELPLT);
-				chgIdx(sPLT);
-				chgIdx(sTEXTTAB);
-				chgIdx(sARMEXIDX);
-				chgIdx(sFINIARRAY);
-				chgIdx(sINITARRAY);
-				chgIdx(sDYNAMIC);
-				chgIdx(sGOT);
-				chgIdx(sDATA);
-				chgIdx(sBSS);
-				chgIdx(sSHSTRTAB);
+	//generate .data.rel.ro by PT_GNU_RELRO
+	// The RELRO segment holds the arrays, .dynamic, .got and .data.rel.ro.
+	// Every hole between the sections found so far is .data.rel.ro, 
+	// unless it is small enough to be alignment padding. Whatever 
+	// follows the last of them is only page padding.
+	if(segments.relro != nullptr){
+		Elf_Addr relro = segments.relro->p_vaddr;
+		Elf_Addr relro_end = relro + segments.relro->p_memsz;
+		std::vector<std::pair<Elf_Addr, Elf_Addr> > used;
+		for(size_t i = 1; i < shdrs.size(); i++){
+			const Elf_Shdr& shdr = shdrs[i];
+			if(!(shdr.sh_flags & SHF_ALLOC) || shdr.sh_size == 0 || i == sTBSS) continue;
+			if(shdr.sh_addr + shdr.sh_size <= relro || shdr.sh_addr >= relro_end) continue;
+			used.push_back(std::make_pair((Elf_Addr)shdr.sh_addr, (Elf_Addr)(shdr.sh_addr + shdr.sh_size)));
+		}
+		std::sort(used.begin(), used.end());
+
+		Elf_Addr cur = relro;
+		for(size_t i = 0; i < used.size(); i++){
+			Elf_Addr start = cur;
+			while(start & (sizeof(Elf_Addr)-1)) { start++; }
+			if(used[i].first > start && used[i].first - start >= 2*sizeof(Elf_Addr)){
+				Elf_Word idx = addSection(kSecDATARELRO, start, used[i].first - start);
+				if(sDATARELRO == 0) sDATARELRO = idx;
 			}
+			cur = std::max(cur, used[i].second);
 		}
 	}
 
+	//generate .shstrtab
+	// Not loaded, it is placed right after the load segments.
+	sSHSTRTAB = addSection(kSecSHSTRTAB, extra.empty() ? si.max_load : extra_addr + extra.size(), kShstrtabSize);
+
+	// sort by address and recalc size
+	sortSections();
+	indexSections();
+
+	// .text runs up to the next section, but not out of its PT_LOAD.
 	if(sTEXTTAB != 0){
-		shdrs[sTEXTTAB].sh_size = shdrs[sTEXTTAB + 1].sh_addr - shdrs[sTEXTTAB].sh_addr;
+		Elf_Addr text = shdrs[sTEXTTAB].sh_addr, end = 0;
+		bool hasNext = addresses.next(AddressIndex<ELF>::kSection, text, &end) != AddressIndex<ELF>::kNone;
+		Elf_Word seg = addresses.find(AddressIndex<ELF>::kSegment, text);
+		if(seg != AddressIndex<ELF>::kNone){
+			Elf_Addr seg_end = segments.loads[seg]->p_vaddr + segments.loads[seg]->p_filesz;
+			end = hasNext ? std::min(end, seg_end) : seg_end;
+			hasNext = true;
+		}
+		if(hasNext && end > text){
+			shdrs[sTEXTTAB].sh_size = end - text;
+			indexSections();
+		}
 	}
 
 	// recalculate the size of each section 
-	for(int i=2;i<shdrs.size();i++){
-		if(shdrs[i].sh_offset - shdrs[i-1].sh_offset < shdrs[i-1].sh_size){
-			shdrs[i-1].sh_size = shdrs[i].sh_offset - shdrs[i-1].sh_offset;
-		}
-	}
+	// cut a section short where the next one starts, unless the size 
+	// is known from .dynamic
+	addresses.overlaps(AddressIndex<ELF>::kSection, [this](Elf_Word prev, Elf_Word cur){
+		if(std::find(dtSized.begin(), dtSized.end(), prev) != dtSized.end()) return;
+		shdrs[prev].sh_size = shdrs[cur].sh_addr - shdrs[prev].sh_addr;
+	});
+	indexSections();
 
 	VLOG("All sections rebuilded finish.");
 	return true;
@@ -751,60 +1599,520 @@ bool ELFRebuilder::rebuildShdr(){
  * We can specify the dump so file using -m option, 
  * and setting the dump base memory with it.
  */
-bool ELFRebuilder::rebuildRelocs(){
+template <typename ELF>
+bool ELFRebuilder<ELF>::rebuildRelocs(){
+	PhaseTimer timer(kPhaseRelocs);
 	if(reader.isDumpSoFile()){
-		auto relocate = [](Elf_Addr base, Elf_Rel* rel, size_t count, Elf_Addr dump_base){
-			if(rel == nullptr || count == 0) return false;
-			for(int i=0;i<count;i++, rel++){
-				Elf_Word type = rel->getType();
-				Elf_Word sym = rel->getSymbol();
-
-				Elf_Addr* prel = reinterpret_cast<Elf_Addr*>(base + rel->r_offset);
-				if(type == 0) continue; //R_*_NONE
-				switch(type){
-					// Only I know is RELATIVE.
-					// It would add a load address when the got table 
-					// need to be relocated. 
-					// If the so file is dump from memory. The relocate 
-					// must have worked. We should subtract the load address.
-					case R_386_RELATIVE:
-					case R_ARM_RELATIVE:
-						*prel = *prel - dump_base;
-						break;
-					default:
-						break;
-				}
+		Elf_Addr dump_base = reader.getDumpSoBase();
+		if(symbolic){
+			slot_symbols.clear();
+			if(plt0 == 0 && (si.plt_rel_count != 0 || si.plt_rela_count != 0)){
+				LOG("PLT0 of \"%s\" not found, JUMP_SLOT entries are left bound.", reader.getFileName());
 			}
-		};
-		relocate(si.load_bias, si.plt_rel, si.plt_rel_count, reader.getDumpSoBase());
-		relocate(si.load_bias, si.rel, si.plt_rel_count, reader.getDumpSoBase());
+		}
+		// Pick the policy once, the loops below are specialized for it.
+		switch(elf_header.e_machine){
+			case EM_ARM: unrelocateAll<ArchPolicy<EM_ARM> >(dump_base); break;
+			case EM_386: unrelocateAll<ArchPolicy<EM_386> >(dump_base); break;
+			case EM_AARCH64: unrelocateAll<ArchPolicy<EM_AARCH64> >(dump_base); break;
+			case EM_X86_64: unrelocateAll<ArchPolicy<EM_X86_64> >(dump_base); break;
+			case EM_MIPS: unrelocateAll<ArchPolicy<EM_MIPS> >(dump_base); break;
+			default:
+				VLOG("Unknown machine %d, only RELR and the init/fini arrays can be unrelocated.", (int)elf_header.e_machine);
+				unrelocateRelr(dump_base);
+				unrelocateArrays(dump_base);
+				break;
+		}
 	}
 	return true;
 }
 
-bool ELFRebuilder::rebuildFinish(){
+template <typename ELF>
+template <typename Arch>
+void ELFRebuilder<ELF>::unrelocateAll(Elf_Addr dump_base){
+	unrelocate<Arch>(si.rel, si.rel_count, si.rel_relative_count, dump_base);
+	unrelocate<Arch>(si.plt_rel, si.plt_rel_count, 0, dump_base);
+	unrelocate<Arch>(si.rela, si.rela_count, si.rela_relative_count, dump_base);
+	unrelocate<Arch>(si.plt_rela, si.plt_rela_count, 0, dump_base);
+	unrelocatePacked<Arch>(dump_base);
+	unrelocateRelr(dump_base);
+	unrelocateArrays(dump_base);
+}
+
+/**
+ * Undo the relocations in a REL or RELA table.
+ * The leading relative_count entries are known to be RELATIVE 
+ * (DT_RELCOUNT/DT_RELACOUNT), so they are processed in one batch 
+ * without looking at the type. The rest go through the type check.
+ */
+template <typename ELF>
+template <typename Arch, typename Elf_Reloc>
+void ELFRebuilder<ELF>::unrelocate(const Elf_Reloc* rel, size_t count, size_t relative_count, Elf_Addr dump_base){
+	if(rel == nullptr || count == 0) return;
+
+	// Don't trust the count blindly, the last entry of the batch must be RELATIVE.
+	if(relative_count > count || 
+	   (relative_count != 0 && !isRelative<Arch>(rel[relative_count-1].getType(), rel[relative_count-1].getSymbol()))){
+		VLOG("Ignore invalid RELATIVE count %zu", relative_count);
+		relative_count = 0;
+	}
+
+	uintptr_t base = si.load_bias;
+	Elf_Addr min_offset = si.min_load;
+	Elf_Addr max_offset = si.max_load - sizeof(Elf_Addr);
+	size_t i = 0;
+	for(; i < relative_count; i++){
+		Elf_Addr offset = rel[i].r_offset;
+		if(offset < min_offset || offset > max_offset) continue;
+		Elf_Field<Elf_Addr>* prel = reinterpret_cast<Elf_Field<Elf_Addr>*>(base + offset);
+		*prel = unrelocatedValue(&rel[i], prel, dump_base);
+	}
+	for(; i < count; i++){
+		unrelocateEntry<Arch>(&rel[i], dump_base);
+	}
+	STAT_COUNT(kRelocations, count);
+	DLOG("Unrelocate %zu entries, %zu in RELATIVE batch.", count, relative_count);
+}
+
+template <typename ELF>
+template <typename Arch, typename Elf_Reloc>
+void ELFRebuilder<ELF>::unrelocateEntry(const Elf_Reloc* rel, Elf_Addr dump_base){
+	Elf_Word type = rel->getType();
+	Elf_Addr offset = rel->r_offset;
+	if(type == 0) return; //R_*_NONE
+	if(offset < si.min_load || offset > si.max_load - sizeof(Elf_Addr)) return;
+
+	Elf_Field<Elf_Addr>* prel = reinterpret_cast<Elf_Field<Elf_Addr>*>(si.load_bias + offset);
+	// Only I know is RELATIVE.
+	// It would add a load address when the got table 
+	// need to be relocated. 
+	// If the so file is dump from memory. The relocate 
+	// must have worked. We should restore the unrelocated value.
+	if(isRelative<Arch>(type, rel->getSymbol())){
+		*prel = unrelocatedValue(rel, prel, dump_base);
+		return;
+	}
+	if(!symbolic) return;
+
+	// Symbolic relocations were bound to some library of the dumped process. 
+	// Put back the value the linker would see before binding, and remember 
+	// which symbol the slot belongs to.
+	if(type != Arch::kJumpSlot && type != Arch::kGlobDat && type != Arch::kAbs && type != Arch::kRelative) return;
+	Elf_Word symIdx = rel->getSymbol();
+	const char* name = symbols.getName(symIdx);
+	const Elf_Sym* def = symbols.get(symIdx);
+	if(def != nullptr && def->st_shndx == SHN_UNDEF && name[0] != '\0'){
+		def = symbols.find(name);
+	}
+
+	SlotSymbol slot;
+	slot.offset = offset;
+	slot.type = type;
+	slot.name = name;
+	slot.resolved = nullptr;
+	Elf_Addr value = *prel - dump_base;
+	if(value >= si.min_load && value < si.max_load){
+		const Elf_Sym* local = symbols.findByAddress(value);
+		if(local != nullptr) slot.resolved = symbols.getName(local - symbols.get(0));
+	}
+
+	if(type == Arch::kJumpSlot){
+		Elf_Addr lazy = pltLazyTarget<Arch>(offset);
+		if(lazy != 0) *prel = lazy;
+	} else{
+		*prel = symbolicAddend(rel, prel, dump_base, def);
+	}
+	slot_symbols.push_back(slot);
+	VLOG("slot 0x%" PRIx64 " type 0x%x -> %s%s%s", (uint64_t)offset, type, name, 
+		 slot.resolved ? " bound here to " : "", slot.resolved ? slot.resolved : "");
+}
+
+template <typename ELF>
+typename ELFRebuilder<ELF>::Elf_Addr 
+ELFRebuilder<ELF>::symbolicAddend(const Elf_Rel* rel, const Elf_Field<Elf_Addr>* prel, Elf_Addr dump_base, const Elf_Sym* def){
+	if(def == nullptr || def->st_shndx == SHN_UNDEF) return 0;
+	Elf_Addr addend = *prel - dump_base - def->st_value;
+	// Bound to another library, the addend is unknown. It is almost always 0.
+	if(addend > si.max_load && -addend > si.max_load) return 0;
+	return addend;
+}
+
+/**
+ * The value a JUMP_SLOT holds before lazy binding.
+ * ARM, AArch64 and MIPS point every slot to PLT0. 
+ * x86 and x86_64 point it back into its own PLT entry, right after 
+ * the indirect jump. The slot index counts from the first word after 
+ * the reserved ones of .got.plt.
+ * 0 if PLT0 was not found by findPlt0(), the slot is left as dumped.
+ */
+template <typename ELF>
+template <typename Arch>
+typename ELFRebuilder<ELF>::Elf_Addr ELFRebuilder<ELF>::pltLazyTarget(Elf_Addr slot){
+	if(plt0 == 0) return 0;
+	Elf_Addr plt = plt0;
+	if(Arch::kLazyEntryOffset < 0) return plt;
+
+	if(si.plt_got == nullptr) return 0;
+	Elf_Addr got = (uintptr_t)si.plt_got - si.load_bias;
+	Elf_Addr index = (slot - got) / sizeof(Elf_Addr) - Arch::kGotPltReserved;
+	return plt + Arch::kPltHeaderSize + Arch::kPltEntrySize * index + Arch::kLazyEntryOffset;
+}
+
+/**
+ * Undo the android packed relocations. Each relocation is decoded 
+ * from the stream and handed to unrelocateEntry() straight away, 
+ * no array of the expanded table is built.
+ */
+template <typename ELF>
+template <typename Arch>
+void ELFRebuilder<ELF>::unrelocatePacked(Elf_Addr dump_base){
+	if(si.android_reloc == nullptr) return;
+
+	PackedRelocIterator<ELF> it(si.android_reloc, si.android_reloc_size);
+	if(!it.isValid()){
+		VLOG("Packed relocations of \"%s\" have no APS2 magic. Ignore it.", si.name);
+		return;
+	}
+	Elf_Rel rel;
+	size_t count = 0;
+	while(it.hasNext()){
+		const Elf_Rela* rela = it.next();
+		if(rela == nullptr){
+			VLOG("Packed relocations broken at entry %zu.", count);
+			break;
+		}
+		if(si.android_reloc_is_rela){
+			unrelocateEntry<Arch>(rela, dump_base);
+		} else{
+			// DT_ANDROID_REL keeps the addend in place like REL.
+			rel.r_offset = rela->r_offset;
+			rel.r_info = rela->r_info;
+			unrelocateEntry<Arch>(&rel, dump_base);
+		}
+		count++;
+	}
+	STAT_COUNT(kRelocations, count);
+	DLOG("Unrelocate %zu packed entries.", count);
+}
+
+/**
+ * Undo the RELR relative relocations. An even entry is the address of 
+ * one slot. An odd entry is a bitmap, bit n (n >= 1) stands for the 
+ * n-1 th word after the last handled address. The bitmap is walked by 
+ * jumping from one set bit to the next, not testing every bit.
+ */
+template <typename ELF>
+void ELFRebuilder<ELF>::unrelocateRelr(Elf_Addr dump_base){
+	if(si.relr == nullptr || si.relr_count == 0) return;
+
+	const size_t wordBits = sizeof(Elf_Addr) * 8;
+	Elf_Addr min_offset = si.min_load;
+	Elf_Addr max_offset = si.max_load - sizeof(Elf_Addr);
+	Elf_Addr where = 0;
+	size_t count = 0;
+	for(size_t i = 0; i < si.relr_count; i++){
+		Elf_Addr entry = si.relr[i];
+		if((entry & 1) == 0){
+			where = entry;
+			if(where >= min_offset && where <= max_offset){
+				*reinterpret_cast<Elf_Field<Elf_Addr>*>(si.load_bias + where) -= dump_base;
+				count++;
+			}
+			where += sizeof(Elf_Addr);
+			continue;
+		}
+
+		uint64_t bitmap = static_cast<uint64_t>(entry) >> 1;
+		while(bitmap != 0){
+			unsigned bit = __builtin_ctzll(bitmap);
+			bitmap &= bitmap - 1;
+			Elf_Addr slot = where + bit * sizeof(Elf_Addr);
+			if(slot >= min_offset && slot <= max_offset){
+				*reinterpret_cast<Elf_Field<Elf_Addr>*>(si.load_bias + slot) -= dump_base;
+				count++;
+			}
+		}
+		where += (wordBits - 1) * sizeof(Elf_Addr);
+	}
+	STAT_COUNT(kRelocations, count);
+	DLOG("Unrelocate %zu RELR slots.", count);
+}
+
+/**
+ * The constructor and destructor tables after the relocation passes. 
+ * Their RELATIVE relocations are undone by then, unless a packer 
+ * applied them itself and wiped the tables. Whatever still points 
+ * into the dumped image is moved back by the load address.
+ */
+template <typename ELF>
+void ELFRebuilder<ELF>::unrelocateArrays(Elf_Addr dump_base){
+	// A load address below the end of the image can't tell the two apart.
+	if(dump_base < si.max_load){
+		VLOG("Load address 0x%" PRIx64 " overlaps the image, init/fini arrays are left alone.", (uint64_t)dump_base);
+		return;
+	}
+	size_t count = unrelocateArray(si.preinit_array, si.preinit_array_count, dump_base) 
+				 + unrelocateArray(si.init_array, si.init_array_count, dump_base) 
+				 + unrelocateArray(si.fini_array, si.fini_array_count, dump_base);
+	STAT_COUNT(kRelocations, count);
+	DLOG("Unrelocate %zu init/fini array entries left absolute.", count);
+}
+
+// Sized by DT_*_ARRAYSZ. The loop is branch free, the compiler can vectorize it.
+template <typename ELF>
+size_t ELFRebuilder<ELF>::unrelocateArray(const void* array, size_t count, Elf_Addr dump_base){
+	if(array == nullptr || count == 0) return 0;
+	uintptr_t start = (uintptr_t)array;
+	if(start < si.load_bias + si.min_load || start + count * sizeof(Elf_Addr) > si.load_bias + si.max_load){
+		VLOG("Array at 0x%" PRIx64 " runs out of the image.", (uint64_t)(start - si.load_bias));
+		return 0;
+	}
+	Elf_Field<Elf_Addr>* entry = reinterpret_cast<Elf_Field<Elf_Addr>*>(start);
+	Elf_Addr low = dump_base + si.min_load;
+	Elf_Addr span = si.max_load - si.min_load;
+	size_t fixed = 0;
+	for(size_t i = 0; i < count; i++){
+		Elf_Addr value = entry[i];
+		Elf_Addr inside = (Elf_Addr)(value - low < span);
+		entry[i] = value - (dump_base & (Elf_Addr)-inside);
+		fixed += inside;
+	}
+	return fixed;
+}
+
+/**
+ * Synthesize .symtab and .strtab after the section headers are sorted.
+ * Local FUNC symbols named sub_<addr> for every function found by 
+ * buildFunctionIndex(), followed by the defined symbols of .dynsym.
+ */
+template <typename ELF>
+bool ELFRebuilder<ELF>::rebuildSymtab(){
+	PhaseTimer timer(kPhaseSymtab);
+	symtab.clear();
+	strtab.clear();
+	sSYMTAB = sSTRTAB = 0;
+
+	Elf_Sym sym;
+	memset((void*)&sym, 0, sizeof(sym));
+	symtab.push_back(sym);
+	strtab.push_back('\0');
+
+	Elf_Addr text_end = sTEXTTAB != 0 ? shdrs[sTEXTTAB].sh_addr + shdrs[sTEXTTAB].sh_size : 0;
+	char name[32];
+	for(size_t i = 0; i < func_starts.size(); i++){
+		Elf_Addr func = func_starts[i];
+		Elf_Addr next = i + 1 < func_starts.size() ? func_starts[i+1] : text_end;
+		if(next <= func) continue;
+
+		// Exported functions come with the .dynsym part below.
+		// Thumb functions have bit 0 set in st_value.
+		const Elf_Sym* exported = symbols.findByAddress(func | 1);
+		if(exported != nullptr && (exported->st_value & ~(Elf_Addr)1) == func && 
+		   exported->getType() == STT_FUNC){
+			continue;
+		}
+
+		memset((void*)&sym, 0, sizeof(sym));
+		snprintf(name, sizeof(name), "sub_%llx", (unsigned long long)func);
+		sym.st_name = strtab.length();
+		strtab.append(name);
+		strtab.push_back('\0');
+		sym.st_value = func;
+		sym.st_size = next - func;
+		sym.setBindingAndType(STB_LOCAL, STT_FUNC);
+		sym.st_shndx = sectionIndexOf(func);
+		symtab.push_back(sym);
+	}
+	Elf_Word firstGlobal = symtab.size();
+
+	for(size_t i = 1; i < symbols.size(); i++){
+		const Elf_Sym* dynsym = symbols.get(i);
+		if(dynsym->st_shndx == SHN_UNDEF) continue;
+		sym = *dynsym;
+		sym.st_name = strtab.length();
+		strtab.append(symbols.getName(i));
+		strtab.push_back('\0');
+		if(dynsym->st_shndx < SHN_LORESERVE){
+			Elf_Half shndx = sectionIndexOf(dynsym->st_value & ~(Elf_Addr)1);
+			sym.st_shndx = shndx != 0 ? shndx : (Elf_Half)SHN_ABS;
+		}
+		symtab.push_back(sym);
+	}
+
+	if(symtab.size() == 1) return true;
+
+	// They are placed after .shstrtab, .strtab first as .symtab links to it.
+	Elf_Off offset = shdrs[sSHSTRTAB].sh_offset + kShstrtabSize;
+	while(offset & (sizeof(Elf_Addr)-1)) { offset++; }
+	Elf_Off symtabSize = symtab.size() * sizeof(Elf_Sym);
+
+	//generate .strtab
+	sSTRTAB = addSection(kSecSTRTAB, offset + symtabSize, strtab.length());
+
+	//generate .symtab
+	sSYMTAB = addSection(kSecSYMTAB, offset, symtabSize);
+	shdrs[sSYMTAB].sh_info = firstGlobal;
+	sortSections();
+
+	// Thumb functions have bit 0 set in st_value.
+	addresses.clear(AddressIndex<ELF>::kSymbol);
+	for(size_t i = 1; i < symtab.size(); i++){
+		addresses.add(AddressIndex<ELF>::kSymbol, symtab[i].st_value & ~(Elf_Addr)1, symtab[i].st_size, i);
+	}
+	addresses.build(AddressIndex<ELF>::kSymbol);
+
+	VLOG("Synthesized .symtab with %zu symbols.", symtab.size());
+	return true;
+}
+
+/**
+ * Append a section of the given kind. Name, type, flags, alignment, 
+ * entry size and link come from SectionTable, the section it links to 
+ * must be there already. addr is the file offset for sections which 
+ * are not loaded. Return the handle of the new section.
+ */
+template <typename ELF>
+typename ELFRebuilder<ELF>::Elf_Word ELFRebuilder<ELF>::addSection(SectionKind kind, Elf_Addr addr, Elf_Xword size){
+	const SectionDesc& desc = SectionTable<ELF>::desc[kind];
+	Elf_Shdr shdr;
+	memset((void*)&shdr, 0, sizeof(shdr));
+	shdr.sh_name = desc.name;
+	shdr.sh_type = desc.type;
+	shdr.sh_flags = desc.flags;
+	shdr.sh_addr = (desc.flags & SHF_ALLOC) ? addr : 0;
+	shdr.sh_offset = addr;
+	shdr.sh_size = size;
+	shdr.sh_link = linkHandle(desc.link);
+	shdr.sh_info = 0;
+	shdr.sh_addralign = desc.addralign;
+	shdr.sh_entsize = desc.entsize;
+	shdrs.push_back(shdr);
+	return shdrs.size() - 1;
+}
+
+template <typename ELF>
+typename ELFRebuilder<ELF>::Elf_Word ELFRebuilder<ELF>::linkHandle(SectionLink link){
+	switch(link){
+		case kLinkDynsym: return sDYNSYM;
+		case kLinkDynstr: return sDYNSTR;
+		case kLinkText: return sTEXTTAB;
+		case kLinkStrtab: return sSTRTAB;
+		default: return 0;
+	}
+}
+
+/**
+ * Index the allocated sections by address, in output order so the ones 
+ * at the same address stay in it. .tbss is left out, its address is 
+ * the one of the section behind it.
+ */
+template <typename ELF>
+void ELFRebuilder<ELF>::indexSections(){
+	addresses.clear(AddressIndex<ELF>::kSection);
+	for(size_t i = 1; i < shdrOrder.size(); i++){
+		Elf_Word handle = shdrOrder[i];
+		const Elf_Shdr& shdr = shdrs[handle];
+		if(!(shdr.sh_flags & SHF_ALLOC) || handle == sTBSS) continue;
+		addresses.add(AddressIndex<ELF>::kSection, shdr.sh_addr, shdr.sh_size, handle);
+	}
+	addresses.build(AddressIndex<ELF>::kSection);
+}
+
+template <typename ELF>
+typename ELFRebuilder<ELF>::Elf_Half ELFRebuilder<ELF>::sectionIndexOf(Elf_Addr addr){
+	Elf_Word handle = addresses.find(AddressIndex<ELF>::kSection, addr);
+	return handle == AddressIndex<ELF>::kNone ? 0 : shdrIndex[handle];
+}
+
+template <typename ELF>
+const char* ELFRebuilder<ELF>::symbolAt(Elf_Addr addr, Elf_Addr* offset){
+	Elf_Word idx = addresses.nearest(AddressIndex<ELF>::kSymbol, addr);
+	if(idx == AddressIndex<ELF>::kNone) return nullptr;
+	*offset = addr - (symtab[idx].st_value & ~(Elf_Addr)1);
+	return strtab.c_str() + symtab[idx].st_name;
+}
+
+/**
+ * Put the section handles in address order, the order they are written 
+ * out. .tbss goes in front of the section sharing its address, others 
+ * at the same address keep the order they were generated in.
+ */
+template <typename ELF>
+void ELFRebuilder<ELF>::sortSections(){
+	auto isTbss = [](const Elf_Shdr& shdr){
+		return shdr.sh_type == SHT_NOBITS && (shdr.sh_flags & SHF_TLS) != 0;
+	};
+	auto before = [this, &isTbss](Elf_Word a, Elf_Word b){
+		if(shdrs[a].sh_offset != shdrs[b].sh_offset) return shdrs[a].sh_offset < shdrs[b].sh_offset;
+		return isTbss(shdrs[a]) && !isTbss(shdrs[b]);
+	};
+	shdrOrder.resize(shdrs.size());
+	for(size_t i = 0; i < shdrOrder.size(); i++){
+		shdrOrder[i] = i;
+	}
+	// The null section stays in front.
+	if(shdrOrder.size() > 1){
+		std::stable_sort(shdrOrder.begin() + 1, shdrOrder.end(), before);
+	}
+	shdrIndex.resize(shdrs.size());
+	for(size_t i = 0; i < shdrOrder.size(); i++){
+		shdrIndex[shdrOrder[i]] = i;
+	}
+}
+
+template <typename ELF>
+bool ELFRebuilder<ELF>::rebuildFinish(){
+	PhaseTimer timer(kPhaseFinish);
 	size_t load_size = si.max_load - si.min_load;
-	rebuild_size = load_size + shstrtab.length() + shdrs.size()*sizeof(Elf_Shdr);
+	Elf_Off shdrOffset = shdrs[sSHSTRTAB].sh_offset + kShstrtabSize;
+	if(sSTRTAB != 0){
+		shdrOffset = shdrs[sSTRTAB].sh_offset + shdrs[sSTRTAB].sh_size;
+	}
+	rebuild_size = shdrOffset + shdrs.size()*sizeof(Elf_Shdr);
 	
 	if(rebuild_data != NULL) delete []rebuild_data;
 	rebuild_data = new uint8_t[rebuild_size];
+	memset(rebuild_data, 0, rebuild_size);
 
 	// load segment include elf header
 	memcpy(rebuild_data, (void *)si.load_bias, load_size);
+	// the added segment
+	if(!extra.empty()){
+		memcpy(rebuild_data + extra_addr, &extra[0], extra.size());
+	}
 	// append shstrtab
-	memcpy(rebuild_data + load_size, shstrtab.c_str(), shstrtab.length());
-	// append section table
-	Elf_Off shdrOffset = load_size + shstrtab.length();
-	memcpy(rebuild_data + shdrOffset, (void*)&shdrs[0], shdrs.size()*sizeof(Elf_Shdr));
+	memcpy(rebuild_data + shdrs[sSHSTRTAB].sh_offset, kShstrtab, kShstrtabSize);
+	// append .symtab and .strtab
+	if(sSYMTAB != 0){
+		memcpy(rebuild_data + shdrs[sSYMTAB].sh_offset, (void*)&symtab[0], shdrs[sSYMTAB].sh_size);
+		memcpy(rebuild_data + shdrs[sSTRTAB].sh_offset, strtab.c_str(), shdrs[sSTRTAB].sh_size);
+	}
+	// append section table in address order, handles become indexes here
+	Elf_Shdr* out = reinterpret_cast<Elf_Shdr*>(rebuild_data + shdrOffset);
+	for(size_t i = 0; i < shdrOrder.size(); i++){
+		Elf_Shdr shdr = shdrs[shdrOrder[i]];
+		shdr.sh_link = shdrIndex[shdr.sh_link];
+		if(shdr.sh_flags & SHF_INFO_LINK){
+			shdr.sh_info = shdrIndex[shdr.sh_info];
+		}
+		memcpy((void*)&out[i], (void*)&shdr, sizeof(shdr));
+	}
 
 	// repair the elf header
 	elf_header.e_shoff = shdrOffset;
 	elf_header.e_shentsize = sizeof(Elf_Shdr);
 	elf_header.e_shnum = shdrs.size();
-	elf_header.e_shstrndx = sSHSTRTAB;
+	elf_header.e_shstrndx = shdrIndex[sSHSTRTAB];
 	memcpy(rebuild_data, &elf_header, sizeof(elf_header));
+	STAT_COUNT(kBytesCopied, rebuild_size);
+	STAT_COUNT(kSections, shdrOrder.size());
 
 	VLOG("Rebuild data prepared.");
 	return true;
 }
 
+
+template class ELFRebuilder<ELF32>;
+template class ELFRebuilder<ELF64>;
+template class ELFRebuilder<ELF32BE>;
+template class ELFRebuilder<ELF64BE>;
@@ -5,17 +5,28 @@
 #include <string>
 #include "exutil.h"
 #include "ELFReader.h"
+#include "PackedRelocs.h"
+#include "SymbolIndex.h"
+#include "EhFrame.h"
+#include "ArchPolicy.h"
+#include "SectionTable.h"
+#include "SegmentIndex.h"
+#include "BuildIndex.h"
+#include "AddressIndex.h"
 
 /**
  * This structure are modified from android source.
  */ 
+template <typename ELF>
 struct soinfo {
 public:
+	ELF_TYPEDEFS(ELF);
+
 	const char* name = "name";
 	const Elf_Phdr* phdr = nullptr;
 	size_t phnum = 0;
 	Elf_Addr entry = 0;
-	Elf_Addr base = 0;
+	uintptr_t base = 0;
 	unsigned size = 0;
 
 	Elf_Addr min_load;
@@ -35,12 +46,28 @@ public:
 	const char* strtab = nullptr;
 	Elf_Sym* symtab = nullptr;
 
-	Elf_Addr hash = 0;
+	uintptr_t hash = 0;
 	size_t strtabsize = 0;
 	size_t nbucket = 0;
 	size_t nchain = 0;
-	unsigned* bucket = nullptr;
-	unsigned* chain = nullptr;
+	Elf_Field<Elf_Word>* bucket = nullptr;
+	Elf_Field<Elf_Word>* chain = nullptr;
+
+	// Symbol versioning
+	Elf_Half* versym = nullptr;			// DT_VERSYM, one entry per .dynsym symbol
+	Elf_Verdef* verdef = nullptr;
+	size_t verdef_num = 0;
+	Elf_Verneed* verneed = nullptr;
+	size_t verneed_num = 0;
+
+	uintptr_t gnu_hash = 0;
+	size_t gnu_nbucket = 0;
+	uint32_t gnu_symndx = 0;
+	uint32_t gnu_maskwords = 0;
+	uint32_t gnu_shift2 = 0;
+	Elf_Field<Elf_Addr>* gnu_bloom_filter = nullptr;
+	Elf_Field<uint32_t>* gnu_bucket = nullptr;
+	Elf_Field<uint32_t>* gnu_chain = nullptr;
 
 	Elf_Addr * plt_got = nullptr;
 
@@ -50,6 +77,22 @@ public:
 	Elf_Rel* rel = nullptr;
 	size_t rel_count = 0;
 
+	Elf_Rela* plt_rela = nullptr;
+	size_t plt_rela_count = 0;
+
+	Elf_Rela* rela = nullptr;
+	size_t rela_count = 0;
+
+	// Android packed relocations (APS2) in DT_ANDROID_REL or DT_ANDROID_RELA.
+	const uint8_t* android_reloc = nullptr;
+	size_t android_reloc_size = 0;
+	bool android_reloc_is_rela = false;
+
+	// Relative relocations in bitmap form (DT_RELR or DT_ANDROID_RELR).
+	Elf_Field<Elf_Addr>* relr = nullptr;
+	size_t relr_count = 0;
+	bool relr_is_android = false;
+
 	void* preinit_array = nullptr;
 	size_t preinit_array_count = 0;
 
@@ -70,31 +113,78 @@ public:
 
 	// When you read a virtual address from the ELF file, add this
 	// value to get the corresponding address in the process' address space.
-	Elf_Addr load_bias = 0;
+	uintptr_t load_bias = 0;
 
 	bool has_text_relocations = false;
 	bool has_DT_SYMBOLIC = false;
 
 	//Add by myself
-	size_t dynsym_size = 0;
+	size_t syment = 0;			// DT_SYMENT, size of one symbol entry
+	size_t dynsym_count = 0;	// number of symbols in .dynsym
 	Elf_Addr* interp = nullptr;
 	size_t interp_size = 0;
+	uint8_t* eh_frame_hdr = nullptr;	// found by PT_GNU_EH_FRAME
+	size_t eh_frame_hdr_size = 0;
+	uint8_t* eh_frame = nullptr;
+	size_t eh_frame_size = 0;		// CIE/FDE chain with the terminator
 	Elf_Addr loadSegEnd = 0;
+	Elf_Addr loadSegFileEnd = 0;	// end of the file backed part, .bss follows
+
+	// PT_TLS, the template of .tdata followed by .tbss
+	Elf_Addr tls_addr = 0;
+	Elf_Addr tls_filesz = 0;
+	Elf_Addr tls_memsz = 0;
+	Elf_Addr tls_align = 0;
+	bool has_tls = false;
+
+	// The leading DT_RELCOUNT/DT_RELACOUNT entries of .rel(a).dyn 
+	// are all RELATIVE. They can be handled without a type check.
+	size_t rel_relative_count = 0;
+	size_t rela_relative_count = 0;
+	ArchInfo arch;				// relocation types and PLT/GOT layout of e_machine
 };
 
+template <typename ELF>
 class ELFRebuilder{
 
 public:
+	ELF_TYPEDEFS(ELF);
 
-	ELFRebuilder(ELFReader &_reader, bool _force);
+	ELFRebuilder(ELFReader<ELF> &_reader, bool _force);
 	~ELFRebuilder();
 	bool rebuild();
 	uint8_t* getRebuildData() { return rebuild_data; }
 	size_t getRebuildDataSize() { return rebuild_size; }
+
+	// Also undo JUMP_SLOT, GLOB_DAT and ABS relocations of a memory dump.
+	void setSymbolic(bool _symbolic) { symbolic = _symbolic; }
+	// Add a .gnu.hash to a file which only has the SysV .hash.
+	void setGnuHash(bool _gnu_hash) { add_gnu_hash = _gnu_hash; }
+	// Intact builds to take the section table from, if one matches the file.
+	void setReferences(BuildIndex<ELF>* _references) { references = _references; }
+
+	/* A GOT/PLT slot restored by the symbolic unapply, and what it was bound to. */
+	struct SlotSymbol{
+		Elf_Addr offset;		// r_offset of the slot
+		Elf_Word type;			// relocation type
+		const char* name;		// the symbol the relocation refers to
+		const char* resolved;	// defined symbol of this file the dumped value points to, or nullptr
+	};
+	const std::vector<SlotSymbol>& getSlotSymbols() { return slot_symbols; }
+
+	// After a plan B rebuild: output index of the allocated section 
+	// containing addr, 0 if none.
+	Elf_Half sectionIndexOf(Elf_Addr addr);
+	// After a plan B rebuild: the .symtab symbol at or before addr and 
+	// how far addr is into it, nullptr if there is none.
+	const char* symbolAt(Elf_Addr addr, Elf_Addr* offset);
 private:
 
 	bool force;			// using to mark if force to rebuild the section.
-	ELFReader &reader;
+	bool symbolic = false;	// using to mark if undo the symbolic relocations.
+	bool add_gnu_hash = false;	// using to mark if add a .gnu.hash to the file.
+	BuildIndex<ELF>* references = nullptr;
+	ELFReader<ELF> &reader;
 
 	Elf_Ehdr elf_header;
 	Elf_Phdr *phdr_table;
@@ -106,35 +196,139 @@ private:
 	bool simpleRebuild();	// just repair the section address and offset.
 	bool rebuildData();		// restore data to rebuild_data.
 
+	// Plan C
+	bool transplantRebuild();	// take the section table of an intact build.
+
 private:
 	// Plan B
 	bool totalRebuild();	// all rebuild.
 	bool rebuildPhdr();
 	bool readSoInfo();
+	bool checkHash();
+	std::vector<uint32_t> elfHashes();
+	void writeHash(const std::vector<uint32_t>& hashes);
+	bool addGnuHash();
+	template <typename Elf_Reloc>
+	void renumberSymbols(Elf_Reloc* rel, size_t count, const std::vector<Elf_Word>& newIndex);
 	bool rebuildShdr();
 	bool rebuildRelocs();
 	bool rebuildFinish();
+	size_t countDynsym();
+	size_t gnuHashSymbolCount();
+	bool buildFunctionIndex();
+	bool readEhFrame();
+	size_t verdefSize();
+	void scanRelocTargets();
+	template <typename Elf_Reloc>
+	void scanRelocTargets(const Elf_Reloc* rel, size_t count, bool jmprel);
+	void addRelocTarget(Elf_Addr offset, Elf_Word type, bool jmprel);
+	size_t verneedSize();
+	Elf_Addr findPlt0(Elf_Addr from, Elf_Addr end);
+	bool rebuildEhFrameHdr();
+	bool rebuildSymtab();
+	void indexSections();
+	Elf_Word addSection(SectionKind kind, Elf_Addr addr, Elf_Xword size);
+	Elf_Word linkHandle(SectionLink link);
+	void sortSections();
+
+	template <typename Arch>
+	void unrelocateAll(Elf_Addr dump_base);
+	template <typename Arch, typename Elf_Reloc>
+	void unrelocate(const Elf_Reloc* rel, size_t count, size_t relative_count, Elf_Addr dump_base);
+	template <typename Arch, typename Elf_Reloc>
+	void unrelocateEntry(const Elf_Reloc* rel, Elf_Addr dump_base);
+	template <typename Arch>
+	void unrelocatePacked(Elf_Addr dump_base);
+	void unrelocateRelr(Elf_Addr dump_base);
+	void unrelocateArrays(Elf_Addr dump_base);
+	size_t unrelocateArray(const void* array, size_t count, Elf_Addr dump_base);
+	// REL keeps the addend in place, the dumped value minus the load address is the original one.
+	static Elf_Addr unrelocatedValue(const Elf_Rel* rel, const Elf_Field<Elf_Addr>* prel, Elf_Addr dump_base) { return *prel - dump_base; }
+	// RELA carries the addend, which is exactly the value before relocation.
+	static Elf_Addr unrelocatedValue(const Elf_Rela* rela, const Elf_Field<Elf_Addr>* prel, Elf_Addr dump_base) { return rela->r_addend; }
+	// The addend of a symbolic REL is S+A minus S. We only know S if the symbol is defined here.
+	Elf_Addr symbolicAddend(const Elf_Rel* rel, const Elf_Field<Elf_Addr>* prel, Elf_Addr dump_base, const Elf_Sym* def);
+	Elf_Addr symbolicAddend(const Elf_Rela* rela, const Elf_Field<Elf_Addr>* prel, Elf_Addr dump_base, const Elf_Sym* def) { return rela->r_addend; }
+	template <typename Arch>
+	Elf_Addr pltLazyTarget(Elf_Addr slot);
 	
-	soinfo si;
+	soinfo<ELF> si;
 	Elf_Word sINTERP = 0;
 	Elf_Word sDYNSYM = 0;
 	Elf_Word sDYNSTR = 0;
 	Elf_Word sHASH = 0;
+	Elf_Word sGNUHASH = 0;
+	Elf_Word sVERSYM = 0;
+	Elf_Word sVERDEF = 0;
+	Elf_Word sVERNEED = 0;
 	Elf_Word sRELDYN = 0;
 	Elf_Word sRELPLT = 0;
+	Elf_Word sRELRDYN = 0;
 	Elf_Word sPLT = 0;
 	Elf_Word sTEXTTAB = 0;
+	Elf_Word sARMEXTAB = 0;
 	Elf_Word sARMEXIDX = 0;
+	Elf_Word sEHFRAMEHDR = 0;
+	Elf_Word sEHFRAME = 0;
 	Elf_Word sFINIARRAY = 0;
 	Elf_Word sINITARRAY = 0;
 	Elf_Word sDYNAMIC = 0;
+	Elf_Word sDATARELRO = 0;
 	Elf_Word sGOT = 0;
+	Elf_Word sGOTPLT = 0;
 	Elf_Word sDATA = 0;
 	Elf_Word sBSS = 0;
+	Elf_Word sTDATA = 0;
+	Elf_Word sTBSS = 0;
 	Elf_Word sSHSTRTAB = 0;
+	Elf_Word sSYMTAB = 0;
+	Elf_Word sSTRTAB = 0;
 
+	// Section headers in the order they are generated. The s* members 
+	// above are handles into it and never change, sh_link is a handle 
+	// too. Both are turned into indexes when the table is written out.
 	std::vector<Elf_Shdr> shdrs;
-	std::string shstrtab;
+	std::vector<Elf_Word> shdrOrder;	// output index -> handle, sorted by address
+	std::vector<Elf_Word> shdrIndex;	// handle -> output index
+	std::vector<Elf_Word> dtSized;		// handles sized by a DT_*SZ tag, never cut short
+
+	// [min, max] of relocation targets inside the writable segments.
+	struct TargetRange{
+		Elf_Addr min = ~(Elf_Addr)0;
+		Elf_Addr max = 0;
+		void add(Elf_Addr addr) { min = addr < min ? addr : min; max = addr > max ? addr : max; }
+		bool empty() const { return min > max; }
+	};
+	TargetRange got_targets;	// GLOB_DAT
+	TargetRange slot_targets;	// DT_JMPREL, JUMP_SLOT and IRELATIVE
+	TargetRange data_targets;	// everything else
+	Elf_Addr rw_start = 0;
+	Elf_Addr rw_end = 0;
+	Elf_Addr plt0 = 0;			// PLT0 recognized by its code, 0 if not found
+
+	// A PT_LOAD added behind the image by addGnuHash(). It starts with a 
+	// copy of the program header table, which has no room to grow in place.
+	Elf_Addr extra_addr = 0;
+	std::vector<uint8_t> extra;
+	Elf_Addr new_gnu_hash = 0;		// .gnu.hash in the added segment
+	Elf_Xword new_gnu_hash_size = 0;
+	Elf_Addr new_dynamic = 0;		// .dynamic moved there, if it had no spare entry
+	Elf_Xword new_dynamic_size = 0;
+
+	SegmentIndex<ELF> segments;
+	AddressIndex<ELF> addresses;	// PT_LOADs, allocated sections and .symtab by address
+	SymbolIndex<ELF> symbols;
+	EhFrame<ELF> eh_frame;
+	std::vector<SlotSymbol> slot_symbols;
+
+	// Function start addresses decoded from .ARM.exidx, sorted and unique.
+	std::vector<Elf_Addr> func_starts;
+	Elf_Addr extab_start = 0;	// .ARM.extab found through .ARM.exidx, or 0
+	Elf_Addr extab_end = 0;
+
+	// Synthesized .symtab and .strtab
+	std::vector<Elf_Sym> symtab;
+	std::string strtab;
 };
 
 
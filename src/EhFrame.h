@@ -0,0 +1,365 @@
+#ifndef _SO_REBUILDER_EHFRAME_H_
+#define _SO_REBUILDER_EHFRAME_H_
+
+#include <cstring>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "exutil.h"
+
+/**
+ * Reader of .eh_frame_hdr and .eh_frame, following the LSB
+ * "Exception Frames" chapter.
+ *
+ * .eh_frame_hdr is found by PT_GNU_EH_FRAME:
+ *   version(1) eh_frame_ptr_enc fde_count_enc table_enc
+ *   eh_frame_ptr fde_count { initial_loc, fde_address } * fde_count
+ * .eh_frame is a chain of CIE and FDE records, ended by a zero length.
+ *
+ * All the addresses are virtual addresses of the so-file. The data is
+ * read from the loaded image, so add load_bias before touching them.
+ * The unwinder only does a binary search if table_enc is
+ * DW_EH_PE_datarel|DW_EH_PE_sdata4 and the table is sorted. Otherwise
+ * it falls back to the linear scan, so writeHdr() always generate that.
+ */
+template <typename ELF>
+class EhFrame{
+
+public:
+	ELF_TYPEDEFS(ELF);
+
+	enum {
+		DW_EH_PE_absptr = 0x00,
+		DW_EH_PE_uleb128 = 0x01,
+		DW_EH_PE_udata2 = 0x02,
+		DW_EH_PE_udata4 = 0x03,
+		DW_EH_PE_udata8 = 0x04,
+		DW_EH_PE_sleb128 = 0x09,
+		DW_EH_PE_sdata2 = 0x0a,
+		DW_EH_PE_sdata4 = 0x0b,
+		DW_EH_PE_sdata8 = 0x0c,
+		DW_EH_PE_pcrel = 0x10,
+		DW_EH_PE_datarel = 0x30,
+		DW_EH_PE_omit = 0xff
+	};
+
+	struct Entry {
+		Elf_Addr initial_loc;
+		Elf_Addr fde;
+		bool operator<(const Entry& other) const { return initial_loc < other.initial_loc; }
+	};
+
+	EhFrame() {}
+	EhFrame(uintptr_t load_bias, Elf_Addr min_load, Elf_Addr max_load)
+		: load_bias(load_bias), min_load(min_load), max_load(max_load) {}
+
+	/**
+	 * Parse the fixed part of .eh_frame_hdr. The search table itself
+	 * is only checked by hasSearchTable().
+	 */
+	bool readHdr(Elf_Addr hdr, size_t size){
+		hdr_addr = hdr;
+		hdr_size = size;
+		frame_ptr = 0;
+		fde_count = 0;
+		table_enc = DW_EH_PE_omit;
+		if(size < 4 || !inside(hdr, 4) || read8(hdr) != 1) return false;
+
+		uint8_t frame_ptr_enc = read8(hdr + 1);
+		uint8_t count_enc = read8(hdr + 2);
+		table_enc = read8(hdr + 3);
+		Elf_Addr pos = hdr + 4;
+		if(frame_ptr_enc == DW_EH_PE_omit || !readEncoded(pos, frame_ptr_enc, hdr, &frame_ptr)){
+			table_enc = DW_EH_PE_omit;
+			return false;
+		}
+		Elf_Addr count = 0;
+		if(count_enc == DW_EH_PE_omit || !readEncoded(pos, count_enc, hdr, &count)){
+			table_enc = DW_EH_PE_omit;
+		}
+		fde_count = count;
+		table_addr = pos;
+		return true;
+	}
+
+	/**
+	 * Walk the CIE/FDE chain from frame, and collect the FDEs.
+	 * Return the size of .eh_frame including the terminator, 0 if
+	 * there is not even one good record. The walk stops at the first
+	 * record which doesn't look like a CIE or FDE, so the trailing
+	 * garbage of a stripped terminator will not be counted.
+	 */
+	size_t walk(Elf_Addr frame){
+		fdes.clear();
+		std::map<Elf_Addr, uint8_t> cie_encs;
+		Elf_Addr cur = frame;
+
+		while(inside(cur, 4)){
+			uint32_t length = read32(cur);
+			if(length == 0){
+				cur += 4;
+				break;
+			}
+			Elf_Addr id_pos = cur + 4;
+			uint64_t record_len = length;
+			size_t id_size = 4;
+			if(length == 0xffffffff){
+				if(!inside(cur + 4, 8)) break;
+				record_len = read64(cur + 4);
+				id_pos = cur + 12;
+				id_size = 8;
+			}
+			if(record_len < id_size || record_len > max_load - id_pos) break;
+			Elf_Addr next = id_pos + static_cast<Elf_Addr>(record_len);
+
+			uint64_t id = id_size == 4 ? read32(id_pos) : read64(id_pos);
+			if(id == 0){
+				uint8_t enc;
+				if(!readCie(id_pos + id_size, next, &enc)) break;
+				cie_encs[cur] = enc;
+			} else{
+				Elf_Addr cie = id_pos - static_cast<Elf_Addr>(id);
+				auto it = cie_encs.find(cie);
+				if(it == cie_encs.end()) break;
+				Elf_Addr pos = id_pos + id_size;
+				Elf_Addr loc;
+				if(!readEncoded(pos, it->second, 0, &loc) || pos > next) break;
+				Entry entry = { loc, cur };
+				fdes.push_back(entry);
+			}
+			cur = next;
+		}
+		if(cur == frame || (fdes.empty() && cie_encs.empty())) return 0;
+		return cur - frame;
+	}
+
+	/**
+	 * True if .eh_frame_hdr carries a search table the unwinder can
+	 * bisect, and it agrees with the FDEs found by walk().
+	 */
+	bool hasSearchTable(){
+		if(table_enc != (DW_EH_PE_datarel | DW_EH_PE_sdata4)) return false;
+		if(fde_count != fdes.size()) return false;
+		if(!inside(table_addr, fde_count * 8)) return false;
+
+		std::vector<Entry> sorted(fdes);
+		std::sort(sorted.begin(), sorted.end());
+		for(size_t i = 0; i < fde_count; i++){
+			Elf_Addr loc = hdr_addr + static_cast<int32_t>(read32(table_addr + i*8));
+			Elf_Addr fde = hdr_addr + static_cast<int32_t>(read32(table_addr + i*8 + 4));
+			if(loc != sorted[i].initial_loc || fde != sorted[i].fde) return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Regenerate .eh_frame_hdr in place, sorted by initial location.
+	 * Return false if the table doesn't fit in room bytes.
+	 */
+	bool writeHdr(Elf_Addr frame, size_t room){
+		size_t need = 12 + fdes.size() * 8;
+		if(need > room || !inside(hdr_addr, need)) return false;
+
+		std::sort(fdes.begin(), fdes.end());
+		uint8_t* hdr = reinterpret_cast<uint8_t*>(load_bias + hdr_addr);
+		hdr[0] = 1;
+		hdr[1] = DW_EH_PE_pcrel | DW_EH_PE_sdata4;
+		hdr[2] = DW_EH_PE_udata4;
+		hdr[3] = DW_EH_PE_datarel | DW_EH_PE_sdata4;
+		write32(hdr + 4, static_cast<uint32_t>(frame - (hdr_addr + 4)));
+		write32(hdr + 8, static_cast<uint32_t>(fdes.size()));
+		for(size_t i = 0; i < fdes.size(); i++){
+			write32(hdr + 12 + i*8, static_cast<uint32_t>(fdes[i].initial_loc - hdr_addr));
+			write32(hdr + 16 + i*8, static_cast<uint32_t>(fdes[i].fde - hdr_addr));
+		}
+
+		table_enc = hdr[3];
+		fde_count = fdes.size();
+		frame_ptr = frame;
+		table_addr = hdr_addr + 12;
+		return true;
+	}
+
+	Elf_Addr getFramePtr() { return frame_ptr; }
+	size_t getFdeCount() { return fdes.size(); }
+
+private:
+	// Read the augmentation of a CIE, only the FDE pointer encoding is needed.
+	bool readCie(Elf_Addr pos, Elf_Addr end, uint8_t* fde_enc){
+		*fde_enc = DW_EH_PE_absptr;
+		if(!inside(pos, 1)) return false;
+		uint8_t version = read8(pos++);
+		if(version != 1 && version != 3 && version != 4) return false;
+
+		Elf_Addr aug = pos;
+		while(pos < end && inside(pos, 1) && read8(pos) != 0) pos++;
+		if(pos >= end) return false;
+		pos++;
+		// Old gcc puts "eh" data, one pointer size.
+		if(read8(aug) == 'e' && read8(aug + 1) == 'h') pos += sizeof(Elf_Addr);
+		if(version == 4) pos += 2;		// address_size, segment_size
+		Elf_Addr skip;
+		if(!readULEB(pos, &skip) || !readSLEB(pos, &skip)) return false;	// code & data alignment
+		if(version == 1){
+			pos++;
+		} else if(!readULEB(pos, &skip)){
+			return false;
+		}
+		if(read8(aug) != 'z') return pos <= end;
+
+		if(!readULEB(pos, &skip)) return false;	// augmentation length
+		for(Elf_Addr c = aug + 1; read8(c) != 0; c++){
+			switch(read8(c)){
+			case 'R':
+				*fde_enc = read8(pos++);
+				break;
+			case 'L':
+				pos++;
+				break;
+			case 'P':{
+				uint8_t enc = read8(pos++);
+				if(!readEncoded(pos, enc & 0x7f, 0, &skip)) return false;
+				break;
+			}
+			case 'S':
+			case 'B':
+				break;
+			default:
+				return false;
+			}
+			if(pos > end) return false;
+		}
+		return true;
+	}
+
+	bool readEncoded(Elf_Addr& pos, uint8_t enc, Elf_Addr datarel, Elf_Addr* out){
+		Elf_Addr start = pos;
+		Elf_Addr value;
+		switch(enc & 0x0f){
+		case DW_EH_PE_absptr:
+			if(!inside(pos, sizeof(Elf_Addr))) return false;
+			value = sizeof(Elf_Addr) == 8 ? static_cast<Elf_Addr>(read64(pos)) : read32(pos);
+			pos += sizeof(Elf_Addr);
+			break;
+		case DW_EH_PE_uleb128:
+			if(!readULEB(pos, &value)) return false;
+			break;
+		case DW_EH_PE_sleb128:
+			if(!readSLEB(pos, &value)) return false;
+			break;
+		case DW_EH_PE_udata2:
+		case DW_EH_PE_sdata2:{
+			if(!inside(pos, 2)) return false;
+			Elf_Field<uint16_t> raw;
+			memcpy(&raw, reinterpret_cast<void*>(load_bias + pos), 2);
+			uint16_t v = raw;
+			value = (enc & 0x0f) == DW_EH_PE_sdata2 ? static_cast<Elf_Addr>(static_cast<int16_t>(v)) : v;
+			pos += 2;
+			break;
+		}
+		case DW_EH_PE_udata4:
+		case DW_EH_PE_sdata4:
+			if(!inside(pos, 4)) return false;
+			value = (enc & 0x0f) == DW_EH_PE_sdata4 ?
+					static_cast<Elf_Addr>(static_cast<int32_t>(read32(pos))) : read32(pos);
+			pos += 4;
+			break;
+		case DW_EH_PE_udata8:
+		case DW_EH_PE_sdata8:
+			if(!inside(pos, 8)) return false;
+			value = static_cast<Elf_Addr>(read64(pos));
+			pos += 8;
+			break;
+		default:
+			return false;
+		}
+
+		switch(enc & 0x70){
+		case 0:
+			break;
+		case DW_EH_PE_pcrel:
+			value += start;
+			break;
+		case DW_EH_PE_datarel:
+			value += datarel;
+			break;
+		default:
+			// textrel and funcrel are never used in .eh_frame_hdr or FDE pc_begin
+			return false;
+		}
+		// indirect pointers need a relocated GOT, can't be resolved here.
+		if(enc & 0x80) return false;
+		*out = value;
+		return true;
+	}
+
+	bool readULEB(Elf_Addr& pos, Elf_Addr* out){
+		Elf_Addr value = 0;
+		size_t shift = 0;
+		uint8_t byte;
+		do{
+			if(!inside(pos, 1)) return false;
+			byte = read8(pos++);
+			if(shift < sizeof(Elf_Addr)*8) value |= static_cast<Elf_Addr>(byte & 0x7f) << shift;
+			shift += 7;
+		} while(byte & 0x80);
+		*out = value;
+		return true;
+	}
+
+	bool readSLEB(Elf_Addr& pos, Elf_Addr* out){
+		Elf_Addr value = 0;
+		size_t shift = 0;
+		uint8_t byte;
+		do{
+			if(!inside(pos, 1)) return false;
+			byte = read8(pos++);
+			if(shift < sizeof(Elf_Addr)*8) value |= static_cast<Elf_Addr>(byte & 0x7f) << shift;
+			shift += 7;
+		} while(byte & 0x80);
+		if(shift < sizeof(Elf_Addr)*8 && (byte & 0x40) != 0){
+			value |= ~static_cast<Elf_Addr>(0) << shift;
+		}
+		*out = value;
+		return true;
+	}
+
+	bool inside(Elf_Addr addr, size_t len){
+		return addr >= min_load && addr <= max_load && len <= max_load - addr;
+	}
+
+	uint8_t read8(Elf_Addr addr){
+		return inside(addr, 1) ? *reinterpret_cast<uint8_t*>(load_bias + addr) : 0;
+	}
+	// Words in the file byte order.
+	uint32_t read32(Elf_Addr addr){
+		Elf_Field<uint32_t> v;
+		memcpy(&v, reinterpret_cast<void*>(load_bias + addr), sizeof(v));
+		return v;
+	}
+	uint64_t read64(Elf_Addr addr){
+		Elf_Field<uint64_t> v;
+		memcpy(&v, reinterpret_cast<void*>(load_bias + addr), sizeof(v));
+		return v;
+	}
+	static void write32(uint8_t* p, uint32_t v){
+		Elf_Field<uint32_t> raw;
+		raw = v;
+		memcpy(p, &raw, sizeof(raw));
+	}
+
+	uintptr_t load_bias = 0;
+	Elf_Addr min_load = 0;
+	Elf_Addr max_load = 0;
+
+	Elf_Addr hdr_addr = 0;
+	size_t hdr_size = 0;
+	Elf_Addr frame_ptr = 0;
+	size_t fde_count = 0;
+	uint8_t table_enc = DW_EH_PE_omit;
+	Elf_Addr table_addr = 0;
+
+	std::vector<Entry> fdes;
+};
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef _SO_REBUILDER_PACKEDRELOCS_H_
+#define _SO_REBUILDER_PACKEDRELOCS_H_
+
+#include <cstring>
+#include "exutil.h"
+
+/**
+ * Streaming decoder of the android packed relocation format (APS2),
+ * which is generated by "--pack-dyn-relocs=android" and referred by 
+ * DT_ANDROID_REL/DT_ANDROID_RELA. It is modified from android source
+ * (linker_sleb128.h and linker_reloc_iterators.h).
+ *
+ * The stream is "APS2" followed by SLEB128 numbers:
+ *   relocation count, initial r_offset, 
+ *   then groups of { group size, group flags, [grouped fields], 
+ *                    entries of the ungrouped fields }.
+ * Every call of next() decodes exactly one relocation, so the whole 
+ * table never need to be expanded in memory.
+ */
+template <typename ELF>
+class PackedRelocIterator{
+
+public:
+	ELF_TYPEDEFS(ELF);
+
+	enum {
+		RELOCATION_GROUPED_BY_INFO_FLAG = 1,
+		RELOCATION_GROUPED_BY_OFFSET_DELTA_FLAG = 2,
+		RELOCATION_GROUPED_BY_ADDEND_FLAG = 4,
+		RELOCATION_GROUP_HAS_ADDEND_FLAG = 8
+	};
+
+	PackedRelocIterator(const uint8_t* data, size_t size)
+		: cur(data), end(data + size), error(false), 
+		  relocation_count(0), relocation_index(0), 
+		  group_size(0), group_flags(0), group_index(0), group_r_offset_delta(0) {
+		memset(&reloc, 0, sizeof(reloc));
+		if(data == nullptr || size < 4 || memcmp(data, "APS2", 4) != 0){
+			error = true;
+			return;
+		}
+		cur += 4;
+		relocation_count = decode();
+		reloc.r_offset = decode();
+	}
+
+	bool isValid() { return !error; }
+	size_t getCount() { return relocation_count; }
+
+	bool hasNext() { return !error && relocation_index < relocation_count; }
+
+	// Return nullptr if the stream is broken.
+	const Elf_Rela* next(){
+		if(group_index == group_size){
+			if(!readGroupFields()) return nullptr;
+			group_index = 0;
+		}
+
+		if(isGroupedByOffsetDelta()){
+			reloc.r_offset += group_r_offset_delta;
+		} else{
+			reloc.r_offset += decode();
+		}
+		if(!isGroupedByInfo()){
+			reloc.r_info = decode();
+		}
+		if(groupHasAddend() && !isGroupedByAddend()){
+			reloc.r_addend += decode();
+		}
+
+		relocation_index++;
+		group_index++;
+		return error ? nullptr : &reloc;
+	}
+
+private:
+	bool readGroupFields(){
+		group_size = decode();
+		group_flags = decode();
+		if(isGroupedByOffsetDelta()){
+			group_r_offset_delta = decode();
+		}
+		if(isGroupedByInfo()){
+			reloc.r_info = decode();
+		}
+		if(groupHasAddend() && isGroupedByAddend()){
+			reloc.r_addend += decode();
+		} else if(!groupHasAddend()){
+			reloc.r_addend = 0;
+		}
+		// A zero size group would never make progress.
+		if(group_size == 0) error = true;
+		return !error;
+	}
+
+	// Decode a SLEB128 number, sign extended to the width of Elf_Addr.
+	Elf_Addr decode(){
+		Elf_Addr value = 0;
+		size_t shift = 0;
+		uint8_t byte;
+		do{
+			if(cur >= end){
+				error = true;
+				return 0;
+			}
+			byte = *cur++;
+			if(shift < sizeof(Elf_Addr)*8){
+				value |= static_cast<Elf_Addr>(byte & 0x7f) << shift;
+			}
+			shift += 7;
+		} while(byte & 0x80);
+
+		if(shift < sizeof(Elf_Addr)*8 && (byte & 0x40) != 0){
+			value |= ~static_cast<Elf_Addr>(0) << shift;
+		}
+		return value;
+	}
+
+	bool isGroupedByInfo() { return (group_flags & RELOCATION_GROUPED_BY_INFO_FLAG) != 0; }
+	bool isGroupedByOffsetDelta() { return (group_flags & RELOCATION_GROUPED_BY_OFFSET_DELTA_FLAG) != 0; }
+	bool isGroupedByAddend() { return (group_flags & RELOCATION_GROUPED_BY_ADDEND_FLAG) != 0; }
+	bool groupHasAddend() { return (group_flags & RELOCATION_GROUP_HAS_ADDEND_FLAG) != 0; }
+
+	const uint8_t* cur;
+	const uint8_t* end;
+	bool error;
+
+	Elf_Rela reloc;
+	size_t relocation_count;
+	size_t relocation_index;
+
+	size_t group_size;
+	size_t group_flags;
+	size_t group_index;
+	Elf_Addr group_r_offset_delta;
+};
+
+#endif
@@ -0,0 +1,187 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <algorithm>
+#include "SectionDiff.h"
+#include "Log.h"
+
+template <typename ELF>
+SectionDiff<ELF>::SectionDiff(const char* left, const char* right){
+	files[0].name = left;
+	files[1].name = right;
+}
+
+template <typename ELF>
+bool SectionDiff<ELF>::load(){
+	return readFile(files[0]) && readFile(files[1]);
+}
+
+template <typename ELF>
+bool SectionDiff<ELF>::readFile(File& file){
+	FILE* fp = fopen(file.name, "rb");
+	if(fp == NULL){
+		ELOG("File \"%s\" open error.", file.name);
+		return false;
+	}
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	bool ok = size >= (long)sizeof(Elf_Ehdr);
+	if(ok){
+		file.data.resize(size);
+		ok = fseek(fp, 0, SEEK_SET) == 0 && fread(&file.data[0], 1, size, fp) == (size_t)size;
+	}
+	fclose(fp);
+	if(!ok){
+		ELOG("\"%s\" is too small to be an ELF file.", file.name);
+		return false;
+	}
+
+	Elf_Ehdr ehdr;
+	memcpy(&ehdr, &file.data[0], sizeof(ehdr));
+	size_t shnum = ehdr.e_shnum;
+	Elf_Off shoff = ehdr.e_shoff;
+	if(shnum == 0 || ehdr.e_shentsize != sizeof(Elf_Shdr) ||
+	   shoff > file.data.size() || shnum * sizeof(Elf_Shdr) > file.data.size() - shoff){
+		ELOG("\"%s\" has no readable section headers.", file.name);
+		return false;
+	}
+	file.shdrs.resize(shnum);
+	memcpy(&file.shdrs[0], &file.data[shoff], shnum * sizeof(Elf_Shdr));
+
+	size_t shstrndx = ehdr.e_shstrndx;
+	if(shstrndx != SHN_UNDEF && shstrndx < shnum){
+		const Elf_Shdr& shstrtab = file.shdrs[shstrndx];
+		if(shstrtab.sh_offset <= file.data.size() && shstrtab.sh_size <= file.data.size() - shstrtab.sh_offset){
+			const char* start = reinterpret_cast<const char*>(&file.data[shstrtab.sh_offset]);
+			file.names.assign(start, start + shstrtab.sh_size);
+		}
+	}
+	file.names.push_back('\0');
+	return true;
+}
+
+template <typename ELF>
+const char* SectionDiff<ELF>::sectionName(const File& file, size_t index){
+	Elf_Word name = file.shdrs[index].sh_name;
+	return name < file.names.size() ? &file.names[name] : "?";
+}
+
+/**
+ * The section of the right file for a section of the left one, SIZE_MAX
+ * if there is none. The same name at the same address wins over only
+ * the same name.
+ */
+template <typename ELF>
+size_t SectionDiff<ELF>::match(size_t index, std::vector<bool>& used){
+	const char* name = sectionName(files[0], index);
+	Elf_Addr addr = files[0].shdrs[index].sh_addr;
+	size_t found = SIZE_MAX;
+	for(size_t i = 1; i < files[1].shdrs.size(); i++){
+		if(used[i] || strcmp(name, sectionName(files[1], i)) != 0) continue;
+		if(files[1].shdrs[i].sh_addr == addr) return i;
+		if(found == SIZE_MAX) found = i;
+	}
+	return found;
+}
+
+/**
+ * Blocks which are equal are skipped by memcmp(), which the C library
+ * does with vector instructions. Only a block which differs is walked
+ * byte by byte.
+ */
+template <typename ELF>
+size_t SectionDiff<ELF>::firstDifference(const uint8_t* a, const uint8_t* b, size_t size, size_t* count){
+	const size_t kBlock = 64;
+	size_t first = size;
+	*count = 0;
+	for(size_t i = 0; i < size; i += kBlock){
+		size_t n = std::min(kBlock, size - i);
+		if(memcmp(a + i, b + i, n) == 0) continue;
+		for(size_t j = i; j < i + n; j++){
+			if(a[j] == b[j]) continue;
+			if(first == size) first = j;
+			(*count)++;
+		}
+	}
+	return first;
+}
+
+// Print one line if the sections differ, return true if they don't.
+template <typename ELF>
+bool SectionDiff<ELF>::compareSection(size_t l, size_t r){
+	const Elf_Shdr& a = files[0].shdrs[l];
+	const Elf_Shdr& b = files[1].shdrs[r];
+	std::string out;
+	char buf[128];
+	auto field = [&](const char* name, uint64_t x, uint64_t y){
+		if(x == y) return;
+		snprintf(buf, sizeof(buf), " %s %llx/%llx", name, (unsigned long long)x, (unsigned long long)y);
+		out += buf;
+	};
+	field("type", a.sh_type, b.sh_type);
+	field("flags", a.sh_flags, b.sh_flags);
+	field("addr", a.sh_addr, b.sh_addr);
+	field("offset", a.sh_offset, b.sh_offset);
+	field("size", a.sh_size, b.sh_size);
+	field("info", a.sh_info, b.sh_info);
+	field("align", a.sh_addralign, b.sh_addralign);
+	field("entsize", a.sh_entsize, b.sh_entsize);
+	// sections may be in another order, so the link is compared by name
+	const char* la = a.sh_link < files[0].shdrs.size() ? sectionName(files[0], a.sh_link) : "?";
+	const char* lb = b.sh_link < files[1].shdrs.size() ? sectionName(files[1], b.sh_link) : "?";
+	if(strcmp(la, lb) != 0){
+		snprintf(buf, sizeof(buf), " link %s/%s", la, lb);
+		out += buf;
+	}
+
+	if(a.sh_type != SHT_NOBITS && b.sh_type != SHT_NOBITS){
+		size_t size = std::min<size_t>(a.sh_size, b.sh_size);
+		size_t lsize = files[0].data.size(), rsize = files[1].data.size();
+		if(a.sh_offset > lsize || size > lsize - a.sh_offset || b.sh_offset > rsize || size > rsize - b.sh_offset){
+			out += " content outside the file";
+		} else{
+			size_t count = 0;
+			size_t first = firstDifference(&files[0].data[a.sh_offset], &files[1].data[b.sh_offset], size, &count);
+			if(count != 0){
+				snprintf(buf, sizeof(buf), " content +%zx (%zu bytes)", first, count);
+				out += buf;
+			}
+		}
+	}
+
+	if(out.empty()){
+		VLOG("[%2zu] %s same", l, sectionName(files[0], l));
+		return true;
+	}
+	LOG("[%2zu] %-20s%s", l, sectionName(files[0], l), out.c_str());
+	return false;
+}
+
+template <typename ELF>
+size_t SectionDiff<ELF>::compare(){
+	size_t differ = 0;
+	std::vector<bool> used(files[1].shdrs.size(), false);
+	for(size_t l = 1; l < files[0].shdrs.size(); l++){
+		size_t r = match(l, used);
+		if(r == SIZE_MAX){
+			LOG("[%2zu] %-20s only in \"%s\"", l, sectionName(files[0], l), files[0].name);
+			differ++;
+			continue;
+		}
+		used[r] = true;
+		differ += !compareSection(l, r);
+	}
+	for(size_t r = 1; r < files[1].shdrs.size(); r++){
+		if(used[r]) continue;
+		LOG("[%2zu] %-20s only in \"%s\"", r, sectionName(files[1], r), files[1].name);
+		differ++;
+	}
+	LOG("%zu of %zu sections differ.", differ, std::max(files[0].shdrs.size(), files[1].shdrs.size()) - 1);
+	return differ;
+}
+
+template class SectionDiff<ELF32>;
+template class SectionDiff<ELF64>;
+template class SectionDiff<ELF32BE>;
+template class SectionDiff<ELF64BE>;
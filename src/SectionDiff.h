@@ -0,0 +1,47 @@
+#ifndef _SO_REBUILDER_SECTIONDIFF_H_
+#define _SO_REBUILDER_SECTIONDIFF_H_
+
+#include <stdint.h>
+#include <vector>
+#include "exutil.h"
+
+/**
+ * Compare two so-files section by section, like a repaired file and
+ * the intact original. Sections are lined up by name, by address when
+ * a name is used twice. Every header field and the contents are
+ * compared, one line is printed for each section which differs.
+ */
+template <typename ELF>
+class SectionDiff{
+
+public:
+	ELF_TYPEDEFS(ELF);
+
+	SectionDiff(const char* left, const char* right);
+
+	bool load();
+	size_t compare();		// the number of sections which differ
+
+	/**
+	 * Offset of the first byte where a and b differ, size if none does.
+	 * The number of differing bytes is stored to count.
+	 */
+	static size_t firstDifference(const uint8_t* a, const uint8_t* b, size_t size, size_t* count);
+
+private:
+	struct File{
+		const char* name;
+		std::vector<uint8_t> data;
+		std::vector<Elf_Shdr> shdrs;
+		std::vector<char> names;	// .shstrtab, '\0' terminated
+	};
+
+	bool readFile(File& file);
+	const char* sectionName(const File& file, size_t index);
+	size_t match(size_t index, std::vector<bool>& used);
+	bool compareSection(size_t l, size_t r);
+
+	File files[2];
+};
+
+#endif
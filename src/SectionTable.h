@@ -0,0 +1,173 @@
+#ifndef _SO_REBUILDER_SECTIONTABLE_H_
+#define _SO_REBUILDER_SECTIONTABLE_H_
+
+#include <stddef.h>
+#include "exutil.h"
+
+/**
+ * Everything the rebuilder knows about a section before it looks at a
+ * file: name, type, flags, alignment, entry size and which section
+ * sh_link points to. rebuildShdr only fills in address and size.
+ *
+ * The names are all known here too, so .shstrtab is one constant
+ * string, the same for every file. Names shared by two kinds of
+ * section (.rel.dyn packed or not) are stored once.
+ */
+
+// Every section name, in the order they lie in .shstrtab.
+#define SB_SECTION_NAMES(N) \
+	N(INTERP,		".interp") \
+	N(NOTEABITAG,	".note.ABI-tag") \
+	N(NOTEBUILDID,	".note.gnu.build-id") \
+	N(NOTEPROPERTY,	".note.gnu.property") \
+	N(NOTEANDROID,	".note.android.ident") \
+	N(NOTE,			".note") \
+	N(DYNSYM,		".dynsym") \
+	N(DYNSTR,		".dynstr") \
+	N(HASH,			".hash") \
+	N(GNUHASH,		".gnu.hash") \
+	N(VERSYM,		".gnu.version") \
+	N(VERDEF,		".gnu.version_d") \
+	N(VERNEED,		".gnu.version_r") \
+	N(RELDYN,		".rel.dyn") \
+	N(RELPLT,		".rel.plt") \
+	N(RELADYN,		".rela.dyn") \
+	N(RELAPLT,		".rela.plt") \
+	N(RELRDYN,		".relr.dyn") \
+	N(PLT,			".plt") \
+	N(TEXT,			".text") \
+	N(TEXTEXTAB,	".text&.ARM.extab") \
+	N(ARMEXTAB,		".ARM.extab") \
+	N(ARMEXIDX,		".ARM.exidx") \
+	N(EHFRAMEHDR,	".eh_frame_hdr") \
+	N(EHFRAME,		".eh_frame") \
+	N(FINIARRAY,	".fini_array") \
+	N(INITARRAY,	".init_array") \
+	N(DYNAMIC,		".dynamic") \
+	N(DATARELRO,	".data.rel.ro") \
+	N(GOT,			".got") \
+	N(GOTPLT,		".got.plt") \
+	N(DATA,			".data") \
+	N(BSS,			".bss") \
+	N(TDATA,		".tdata") \
+	N(TBSS,			".tbss") \
+	N(SHSTRTAB,		".shstrtab") \
+	N(SYMTAB,		".symtab") \
+	N(STRTAB,		".strtab")
+
+// Every kind of section: kind, name, type, flags, alignment, entry size, link.
+// kAlignAddr and kEntAddr stand for sizeof(Elf_Addr) of the file.
+#define SB_SECTION_KINDS(S) \
+	S(INTERP,		INTERP,		SHT_PROGBITS,		SHF_ALLOC,						1,			0,				None) \
+	S(NOTEABITAG,	NOTEABITAG,	SHT_NOTE,			SHF_ALLOC,						4,			0,				None) \
+	S(NOTEBUILDID,	NOTEBUILDID,	SHT_NOTE,		SHF_ALLOC,						4,			0,				None) \
+	S(NOTEPROPERTY,	NOTEPROPERTY,	SHT_NOTE,		SHF_ALLOC,						4,			0,				None) \
+	S(NOTEANDROID,	NOTEANDROID,	SHT_NOTE,		SHF_ALLOC,						4,			0,				None) \
+	S(NOTE,			NOTE,		SHT_NOTE,			SHF_ALLOC,						4,			0,				None) \
+	S(DYNSYM,		DYNSYM,		SHT_DYNSYM,			SHF_ALLOC,						kAlignAddr,	sizeof(Elf_Sym),	Dynstr) \
+	S(DYNSTR,		DYNSTR,		SHT_STRTAB,			SHF_ALLOC,						1,			0,				None) \
+	S(HASH,			HASH,		SHT_HASH,			SHF_ALLOC,						kAlignAddr,	sizeof(Elf_Word),	Dynsym) \
+	S(GNUHASH,		GNUHASH,	SHT_GNU_HASH,		SHF_ALLOC,						kAlignAddr,	kGnuHashEnt,	Dynsym) \
+	S(VERSYM,		VERSYM,		SHT_GNU_versym,		SHF_ALLOC,						sizeof(Elf_Half),	sizeof(Elf_Half),	Dynsym) \
+	S(VERDEF,		VERDEF,		SHT_GNU_verdef,		SHF_ALLOC,						kAlignAddr,	0,				Dynstr) \
+	S(VERNEED,		VERNEED,	SHT_GNU_verneed,	SHF_ALLOC,						kAlignAddr,	0,				Dynstr) \
+	S(RELDYN,		RELDYN,		SHT_REL,			SHF_ALLOC,						kAlignAddr,	sizeof(Elf_Rel),	Dynsym) \
+	S(RELPLT,		RELPLT,		SHT_REL,			SHF_ALLOC | SHF_INFO_LINK,		kAlignAddr,	sizeof(Elf_Rel),	Dynsym) \
+	S(RELADYN,		RELADYN,	SHT_RELA,			SHF_ALLOC,						kAlignAddr,	sizeof(Elf_Rela),	Dynsym) \
+	S(RELAPLT,		RELAPLT,	SHT_RELA,			SHF_ALLOC | SHF_INFO_LINK,		kAlignAddr,	sizeof(Elf_Rela),	Dynsym) \
+	S(ANDROIDREL,	RELDYN,		SHT_ANDROID_REL,	SHF_ALLOC,						kAlignAddr,	1,				Dynsym) \
+	S(ANDROIDRELA,	RELADYN,	SHT_ANDROID_RELA,	SHF_ALLOC,						kAlignAddr,	1,				Dynsym) \
+	S(RELR,			RELRDYN,	SHT_RELR,			SHF_ALLOC,						kAlignAddr,	kEntAddr,		None) \
+	S(ANDROIDRELR,	RELRDYN,	SHT_ANDROID_RELR,	SHF_ALLOC,						kAlignAddr,	kEntAddr,		None) \
+	S(PLT,			PLT,		SHT_PROGBITS,		SHF_ALLOC | SHF_EXECINSTR,		4,			0,				None) \
+	S(TEXT,			TEXT,		SHT_PROGBITS,		SHF_ALLOC | SHF_EXECINSTR,		8,			0,				None) \
+	S(TEXTEXTAB,	TEXTEXTAB,	SHT_PROGBITS,		SHF_ALLOC | SHF_EXECINSTR,		8,			0,				None) \
+	S(ARMEXTAB,		ARMEXTAB,	SHT_PROGBITS,		SHF_ALLOC,						4,			0,				None) \
+	S(ARMEXIDX,		ARMEXIDX,	SHT_ARM_EXIDX,		SHF_ALLOC | SHF_LINK_ORDER,		4,			8,				Text) \
+	S(EHFRAMEHDR,	EHFRAMEHDR,	SHT_PROGBITS,		SHF_ALLOC,						4,			0,				None) \
+	S(EHFRAME,		EHFRAME,	SHT_PROGBITS,		SHF_ALLOC,						kAlignAddr,	0,				None) \
+	S(FINIARRAY,	FINIARRAY,	SHT_FINI_ARRAY,		SHF_WRITE | SHF_ALLOC,			kAlignAddr,	0,				None) \
+	S(INITARRAY,	INITARRAY,	SHT_INIT_ARRAY,		SHF_WRITE | SHF_ALLOC,			1,			0,				None) \
+	S(DYNAMIC,		DYNAMIC,	SHT_DYNAMIC,		SHF_WRITE | SHF_ALLOC,			kAlignAddr,	sizeof(Elf_Dyn),	Dynstr) \
+	S(DATARELRO,	DATARELRO,	SHT_PROGBITS,		SHF_WRITE | SHF_ALLOC,			kAlignAddr,	0,				None) \
+	S(GOT,			GOT,		SHT_PROGBITS,		SHF_WRITE | SHF_ALLOC,			kAlignAddr,	kEntAddr,		None) \
+	S(GOTPLT,		GOTPLT,		SHT_PROGBITS,		SHF_WRITE | SHF_ALLOC,			kAlignAddr,	kEntAddr,		None) \
+	S(DATA,			DATA,		SHT_PROGBITS,		SHF_WRITE | SHF_ALLOC,			kAlignAddr,	0,				None) \
+	S(BSS,			BSS,		SHT_NOBITS,			SHF_WRITE | SHF_ALLOC,			1,			0,				None) \
+	S(TDATA,		TDATA,		SHT_PROGBITS,		SHF_WRITE | SHF_ALLOC | SHF_TLS,	1,			0,				None) \
+	S(TBSS,			TBSS,		SHT_NOBITS,			SHF_WRITE | SHF_ALLOC | SHF_TLS,	1,			0,				None) \
+	S(SHSTRTAB,		SHSTRTAB,	SHT_STRTAB,			0,								1,			0,				None) \
+	S(SYMTAB,		SYMTAB,		SHT_SYMTAB,			0,								kAlignAddr,	sizeof(Elf_Sym),	Strtab) \
+	S(STRTAB,		STRTAB,		SHT_STRTAB,			0,								1,			0,				None)
+
+enum SectionName {
+	kNameNone = 0,
+#define SB_NAME_ENUM(id, str) kName##id,
+	SB_SECTION_NAMES(SB_NAME_ENUM)
+#undef SB_NAME_ENUM
+	kNameCount
+};
+
+enum SectionKind {
+#define SB_KIND_ENUM(id, name, type, flags, align, entsize, link) kSec##id,
+	SB_SECTION_KINDS(SB_KIND_ENUM)
+#undef SB_KIND_ENUM
+	kSecCount
+};
+
+// The section sh_link points to. It must be generated before the one linking to it.
+enum SectionLink {
+	kLinkNone = 0,
+	kLinkDynsym,
+	kLinkDynstr,
+	kLinkText,
+	kLinkStrtab
+};
+
+// The whole .shstrtab, a leading '\0' for the unnamed null section.
+#define SB_NAME_STR(id, str) str "\0"
+static const char kShstrtab[] = "\0" SB_SECTION_NAMES(SB_NAME_STR);
+#undef SB_NAME_STR
+
+#define SB_NAME_SIZE(id, str) sizeof(str),
+static constexpr size_t kNameSizes[kNameCount] = { 1, SB_SECTION_NAMES(SB_NAME_SIZE) };
+#undef SB_NAME_SIZE
+
+// Offset of a name in kShstrtab.
+constexpr size_t nameOffset(int name){
+	return name == 0 ? 0 : nameOffset(name - 1) + kNameSizes[name - 1];
+}
+
+// The implicit terminator of the literal is not part of the table.
+static constexpr size_t kShstrtabSize = nameOffset(kNameCount);
+static_assert(sizeof(kShstrtab) == kShstrtabSize + 1, "section names out of sync with .shstrtab");
+
+struct SectionDesc {
+	Elf32_Word name;
+	Elf32_Word type;
+	Elf32_Word flags;
+	Elf32_Word addralign;
+	Elf32_Word entsize;
+	SectionLink link;
+};
+
+template <typename ELF>
+struct SectionTable {
+	ELF_TYPEDEFS(ELF);
+	static constexpr Elf32_Word kAlignAddr = sizeof(Elf_Addr);
+	static constexpr Elf32_Word kEntAddr = sizeof(Elf_Addr);
+	// .gnu.hash mixes 32-bit words and Elf_Addr bloom words
+	static constexpr Elf32_Word kGnuHashEnt = ELF::kBits == 64 ? 0 : sizeof(uint32_t);
+
+	static constexpr SectionDesc desc[kSecCount] = {
+#define SB_KIND_DESC(id, name, type, flags, align, entsize, link) \
+		{ (Elf32_Word)nameOffset(kName##name), type, flags, align, entsize, kLink##link },
+		SB_SECTION_KINDS(SB_KIND_DESC)
+#undef SB_KIND_DESC
+	};
+};
+
+template <typename ELF>
+constexpr SectionDesc SectionTable<ELF>::desc[kSecCount];
+
+#endif
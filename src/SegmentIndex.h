@@ -0,0 +1,54 @@
+#ifndef _SO_REBUILDER_SEGMENTINDEX_H_
+#define _SO_REBUILDER_SEGMENTINDEX_H_
+
+#include <vector>
+#include "exutil.h"
+
+/**
+ * The program header table sorted out by type, in one pass.
+ * Types which only make sense once keep the first one found,
+ * PT_LOAD and PT_NOTE keep all of them in table order.
+ */
+template <typename ELF>
+class SegmentIndex{
+
+public:
+	ELF_TYPEDEFS(ELF);
+
+	SegmentIndex() {}
+
+	void build(const Elf_Phdr* table, size_t count, Elf_Half machine){
+		*this = SegmentIndex();
+		for(size_t i = 0; i < count; i++){
+			const Elf_Phdr* phdr = &table[i];
+			switch(phdr->p_type){
+				case PT_LOAD: loads.push_back(phdr); break;
+				case PT_NOTE: notes.push_back(phdr); break;
+				case PT_DYNAMIC: first(dynamic, phdr); break;
+				case PT_INTERP: first(interp, phdr); break;
+				case PT_TLS: first(tls, phdr); break;
+				case PT_GNU_EH_FRAME: first(eh_frame_hdr, phdr); break;
+				case PT_GNU_RELRO: first(relro, phdr); break;
+				// PT_MIPS_RTPROC has the same value
+				case PT_ARM_EXIDX: if(machine == EM_ARM) first(arm_exidx, phdr); break;
+				default: break;
+			}
+		}
+	}
+
+	const Elf_Phdr* dynamic = nullptr;
+	const Elf_Phdr* interp = nullptr;
+	const Elf_Phdr* tls = nullptr;
+	const Elf_Phdr* eh_frame_hdr = nullptr;
+	const Elf_Phdr* relro = nullptr;
+	const Elf_Phdr* arm_exidx = nullptr;
+	std::vector<const Elf_Phdr*> loads;
+	std::vector<const Elf_Phdr*> notes;
+
+private:
+	static void first(const Elf_Phdr*& slot, const Elf_Phdr* phdr){
+		if(slot == nullptr) slot = phdr;
+	}
+};
+
+#endif
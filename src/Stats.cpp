@@ -0,0 +1,101 @@
+#include <cstdlib>
+#include <new>
+#include "Stats.h"
+
+bool STATS = false;
+Stats fileStats;
+
+/**
+ * Count every allocation while STATS is set. The hash rebuild allocates
+ * from worker threads, so the counters are added to atomically. The
+ * array and nothrow forms of the library end up here as well.
+ */
+void* operator new(size_t size){
+	if(STATS){
+		__atomic_add_fetch(&fileStats.counters[kAllocations], 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&fileStats.counters[kAllocatedBytes], size, __ATOMIC_RELAXED);
+	}
+	void* p = malloc(size == 0 ? 1 : size);
+	if(p == NULL) throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept{
+	free(p);
+}
+
+static const char* kPhaseNames[kPhaseCount] = {
+	"read", "load", "rebuild", "soinfo", "hash", "shdr", "relocs", "symtab", "finish", "verify", "write", "total"
+};
+
+static const char* kCounterNames[kCounterCount] = {
+	"bytes_read", "bytes_copied", "bytes_written", "allocations", "allocated_bytes", "relocations", "sections"
+};
+
+void Stats::add(const Stats& other){
+	for(int i = 0; i < kPhaseCount; i++) nanos[i] += other.nanos[i];
+	for(int i = 0; i < kCounterCount; i++) counters[i] += other.counters[i];
+}
+
+void Stats::printText(FILE* fp) const {
+	fprintf(fp, "%s\n", file.c_str());
+	for(int i = 0; i < kPhaseCount; i++){
+		// the phases of plan B are indented under rebuild
+		bool inner = i > kPhaseRebuild && i <= kPhaseFinish;
+		fprintf(fp, "  %s%-*s %10.3f ms\n", inner ? "  " : "", inner ? 14 : 16, kPhaseNames[i], nanos[i] / 1e6);
+	}
+	for(int i = 0; i < kCounterCount; i++){
+		fprintf(fp, "  %-16s %10llu\n", kCounterNames[i], (unsigned long long)counters[i]);
+	}
+}
+
+static void printJsonString(FILE* fp, const std::string& s){
+	fputc('"', fp);
+	for(char c : s){
+		if(c == '"' || c == '\\') fputc('\\', fp);
+		if((unsigned char)c < 0x20){
+			fprintf(fp, "\\u%04x", c);
+			continue;
+		}
+		fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+void Stats::printJson(FILE* fp) const {
+	fputs("{\"file\":", fp);
+	printJsonString(fp, file);
+	fputs(",\"ms\":{", fp);
+	for(int i = 0; i < kPhaseCount; i++){
+		fprintf(fp, "%s\"%s\":%.3f", i ? "," : "", kPhaseNames[i], nanos[i] / 1e6);
+	}
+	fputs("}", fp);
+	for(int i = 0; i < kCounterCount; i++){
+		fprintf(fp, ",\"%s\":%llu", kCounterNames[i], (unsigned long long)counters[i]);
+	}
+	fputs("}", fp);
+}
+
+void printStats(const std::vector<Stats>& files, bool json, FILE* fp){
+	Stats total;
+	total.file = "total";
+	for(const Stats& s : files) total.add(s);
+
+	if(json){
+		fputs("{\"files\":[", fp);
+		for(size_t i = 0; i < files.size(); i++){
+			if(i) fputs(",\n", fp);
+			files[i].printJson(fp);
+		}
+		fputs("],\n\"total\":", fp);
+		total.printJson(fp);
+		fputs("}\n", fp);
+		return;
+	}
+	for(const Stats& s : files) s.printText(fp);
+	if(files.size() > 1) total.printText(fp);
+}
@@ -0,0 +1,79 @@
+#ifndef _SO_REBUILDER_STATS_H_
+#define _SO_REBUILDER_STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+/**
+ * Time spent in each phase of a repair and what it moved, for -S.
+ * Nothing is measured unless STATS is set, then every timer is two
+ * reads of the monotonic clock and every counter one addition.
+ * Allocations are counted by the operator new of Stats.cpp, so every
+ * buffer and container growth is in them.
+ * The numbers of the file in work go to fileStats, main() collects
+ * them per file and adds them up for the batch.
+ */
+enum StatPhase{
+	kPhaseRead,			// ELFReader::read()
+	kPhaseLoad,			// ELFReader::load(), the segments copied into memory
+	kPhaseRebuild,		// ELFRebuilder::rebuild(), the phases below are part of it
+	kPhaseSoInfo,
+	kPhaseHash,			// checkHash() and addGnuHash()
+	kPhaseShdr,
+	kPhaseRelocs,
+	kPhaseSymtab,		// the function index, .eh_frame_hdr and .symtab
+	kPhaseFinish,
+	kPhaseVerify,
+	kPhaseWrite,		// the fwrite() of the output
+	kPhaseTotal,
+	kPhaseCount
+};
+
+enum StatCounter{
+	kBytesRead,
+	kBytesCopied,
+	kBytesWritten,
+	kAllocations,		// every operator new, from any thread
+	kAllocatedBytes,
+	kRelocations,		// relocations and RELR slots undone
+	kSections,			// section headers written out
+	kCounterCount
+};
+
+struct Stats{
+	std::string file;
+	uint64_t nanos[kPhaseCount] = {};
+	uint64_t counters[kCounterCount] = {};
+
+	void add(const Stats& other);
+	void printText(FILE* fp) const;
+	void printJson(FILE* fp) const;
+};
+
+extern bool STATS;
+extern Stats fileStats;
+
+#define STAT_COUNT(counter, n) do { if(STATS) fileStats.counters[counter] += (n); } while(0)
+
+/* Adds the time until the end of its scope to a phase. */
+class PhaseTimer{
+public:
+	explicit PhaseTimer(StatPhase _phase) : phase(_phase){
+		if(STATS) start = std::chrono::steady_clock::now();
+	}
+	~PhaseTimer(){
+		if(STATS) fileStats.nanos[phase] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+											   std::chrono::steady_clock::now() - start).count();
+	}
+private:
+	StatPhase phase;
+	std::chrono::steady_clock::time_point start;
+};
+
+// The report of a batch. JSON goes out as one object with every file and the total.
+void printStats(const std::vector<Stats>& files, bool json, FILE* fp);
+
+#endif
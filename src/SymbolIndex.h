@@ -0,0 +1,154 @@
+#ifndef _SO_REBUILDER_SYMBOLINDEX_H_
+#define _SO_REBUILDER_SYMBOLINDEX_H_
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include "exutil.h"
+
+/**
+ * In memory index of the dynamic symbol table. It is built once per 
+ * file, then names and addresses resolve without scanning .dynsym.
+ *   find(name)        ==>  through .gnu.hash or .hash of the file itself,
+ *                          or a hash map if the file has neither.
+ *   findByAddress()   ==>  binary search over the defined symbols.
+ */
+template <typename ELF>
+class SymbolIndex{
+
+public:
+	ELF_TYPEDEFS(ELF);
+
+	SymbolIndex() {}
+
+	void build(const Elf_Sym* _symtab, size_t _count, const char* _strtab, size_t _strtabsize, 
+			   uintptr_t hash, uintptr_t gnu_hash, Elf_Word gnu_maskwords){
+		symtab = _symtab;
+		count = _symtab == nullptr ? 0 : _count;
+		strtab = _strtab;
+		strtabsize = _strtabsize;
+		nbucket = 0;
+		gnu_nbucket = 0;
+		byAddress.clear();
+		byName.clear();
+
+		if(gnu_hash != 0){
+			const Elf_Field<uint32_t>* header = reinterpret_cast<const Elf_Field<uint32_t>*>(gnu_hash);
+			gnu_nbucket = header[0];
+			gnu_symndx = header[1];
+			gnu_bucket = reinterpret_cast<const Elf_Field<uint32_t>*>(gnu_hash + 16 + gnu_maskwords * sizeof(Elf_Addr));
+			gnu_chain = gnu_bucket + gnu_nbucket - gnu_symndx;
+		} else if(hash != 0){
+			const Elf_Field<uint32_t>* header = reinterpret_cast<const Elf_Field<uint32_t>*>(hash);
+			nbucket = header[0];
+			bucket = header + 2;
+			chain = bucket + nbucket;
+		} else{
+			for(size_t i = 1; i < count; i++){
+				if(symtab[i].st_shndx != SHN_UNDEF) byName.insert(std::make_pair(std::string(getName(i)), i));
+			}
+		}
+
+		for(size_t i = 1; i < count; i++){
+			if(symtab[i].st_shndx != SHN_UNDEF && symtab[i].st_value != 0){
+				byAddress.push_back(i);
+			}
+		}
+		const Elf_Sym* syms = symtab;
+		std::sort(byAddress.begin(), byAddress.end(), [syms](Elf_Word a, Elf_Word b){
+			return syms[a].st_value < syms[b].st_value;
+		});
+	}
+
+	size_t size() { return count; }
+
+	const Elf_Sym* get(Elf_Word idx) { return idx < count ? &symtab[idx] : nullptr; }
+
+	// Name of symbol idx, "" if it is out of range.
+	const char* getName(Elf_Word idx){
+		if(idx >= count || strtab == nullptr || symtab[idx].st_name >= strtabsize) return "";
+		return strtab + symtab[idx].st_name;
+	}
+
+	// Find the defined symbol with this name.
+	const Elf_Sym* find(const char* name){
+		if(gnu_nbucket != 0){
+			uint32_t h = gnuHash(name);
+			uint32_t n = gnu_bucket[h % gnu_nbucket];
+			if(n < gnu_symndx) return nullptr;
+			for(; n < count; n++){
+				uint32_t chainHash = gnu_chain[n];
+				if(((chainHash ^ h) >> 1) == 0 && isDefined(n, name)) return &symtab[n];
+				if(chainHash & 1) break;
+			}
+			return nullptr;
+		}
+		if(nbucket != 0){
+			// The chain length is bounded by count, a broken chain cannot loop forever.
+			size_t steps = 0;
+			for(uint32_t n = bucket[elfHash(name) % nbucket]; n != 0 && n < count && steps < count; n = chain[n], steps++){
+				if(isDefined(n, name)) return &symtab[n];
+			}
+			return nullptr;
+		}
+		auto it = byName.find(name);
+		return it == byName.end() ? nullptr : &symtab[it->second];
+	}
+
+	// Find the defined symbol containing addr, or the nearest one before it.
+	const Elf_Sym* findByAddress(Elf_Addr addr){
+		const Elf_Sym* syms = symtab;
+		auto it = std::upper_bound(byAddress.begin(), byAddress.end(), addr, [syms](Elf_Addr a, Elf_Word idx){
+			return a < syms[idx].st_value;
+		});
+		if(it == byAddress.begin()) return nullptr;
+		return &symtab[*(it - 1)];
+	}
+
+	static uint32_t elfHash(const char* name){
+		const uint8_t* p = reinterpret_cast<const uint8_t*>(name);
+		uint32_t h = 0, g;
+		while(*p){
+			h = (h << 4) + *p++;
+			g = h & 0xf0000000;
+			h ^= g;
+			h ^= g >> 24;
+		}
+		return h;
+	}
+
+	static uint32_t gnuHash(const char* name){
+		const uint8_t* p = reinterpret_cast<const uint8_t*>(name);
+		uint32_t h = 5381;
+		while(*p){
+			h += (h << 5) + *p++;
+		}
+		return h;
+	}
+
+private:
+	bool isDefined(Elf_Word idx, const char* name){
+		return symtab[idx].st_shndx != SHN_UNDEF && strcmp(getName(idx), name) == 0;
+	}
+
+	const Elf_Sym* symtab = nullptr;
+	size_t count = 0;
+	const char* strtab = nullptr;
+	size_t strtabsize = 0;
+
+	size_t nbucket = 0;
+	const Elf_Field<uint32_t>* bucket = nullptr;
+	const Elf_Field<uint32_t>* chain = nullptr;
+
+	size_t gnu_nbucket = 0;
+	uint32_t gnu_symndx = 0;
+	const Elf_Field<uint32_t>* gnu_bucket = nullptr;
+	const Elf_Field<uint32_t>* gnu_chain = nullptr;
+
+	std::vector<Elf_Word> byAddress;		// defined symbols sorted by st_value
+	std::unordered_map<std::string, Elf_Word> byName;	// only if there is no hash table
+};
+
+#endif
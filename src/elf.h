@@ -653,7 +653,18 @@ enum {
   R_AARCH64_TLSDESC_LD64_LO12_NC        = 0x233,
   R_AARCH64_TLSDESC_ADD_LO12_NC         = 0x234,
 
-  R_AARCH64_TLSDESC_CALL                = 0x239
+  R_AARCH64_TLSDESC_CALL                = 0x239,
+
+  // Dynamic relocations.
+  R_AARCH64_COPY                        = 0x400,
+  R_AARCH64_GLOB_DAT                    = 0x401,
+  R_AARCH64_JUMP_SLOT                   = 0x402,
+  R_AARCH64_RELATIVE                    = 0x403,
+  R_AARCH64_TLS_DTPMOD64                = 0x404,
+  R_AARCH64_TLS_DTPREL64                = 0x405,
+  R_AARCH64_TLS_TPREL64                 = 0x406,
+  R_AARCH64_TLSDESC                     = 0x407,
+  R_AARCH64_IRELATIVE                   = 0x408
 };
 
 // ARM Specific e_flags
@@ -1261,7 +1272,11 @@ enum : unsigned {
   SHT_PREINIT_ARRAY = 16, // Pointers to pre-init functions.
   SHT_GROUP         = 17, // Section group.
   SHT_SYMTAB_SHNDX  = 18, // Indices for SHN_XINDEX entries.
+  SHT_RELR          = 19, // Relative relocations in bitmap form.
   SHT_LOOS          = 0x60000000, // Lowest operating system-specific type.
+  SHT_ANDROID_REL   = 0x60000001, // Android packed relocation entries.
+  SHT_ANDROID_RELA  = 0x60000002, // Android packed relocation entries with addends.
+  SHT_ANDROID_RELR  = 0x6fffff00, // Android relative relocations before SHT_RELR.
   SHT_GNU_ATTRIBUTES= 0x6ffffff5, // Object attributes.
   SHT_GNU_HASH      = 0x6ffffff6, // GNU-style hash table.
   SHT_GNU_verdef    = 0x6ffffffd, // GNU version definitions.
@@ -1574,6 +1589,16 @@ struct Elf64_Phdr {
   Elf64_Xword  p_align;  // Segment alignment constraint
 };
 
+// Note types, for the "GNU" and "Android" owners.
+enum {
+  NT_GNU_ABI_TAG         = 1, // .note.ABI-tag
+  NT_GNU_HWCAP           = 2,
+  NT_GNU_BUILD_ID        = 3, // .note.gnu.build-id
+  NT_GNU_GOLD_VERSION    = 4,
+  NT_GNU_PROPERTY_TYPE_0 = 5, // .note.gnu.property
+  NT_ANDROID_TYPE_IDENT  = 1  // .note.android.ident
+};
+
 // Segment types.
 enum {
   PT_NULL    = 0, // Unused segment.
@@ -1597,6 +1622,7 @@ enum {
 
   PT_GNU_STACK  = 0x6474e551, // Indicates stack executability.
   PT_GNU_RELRO  = 0x6474e552, // Read-only after relocation.
+  PT_GNU_PROPERTY = 0x6474e553, // .note.gnu.property
 
   // ARM program header types.
   PT_ARM_ARCHEXT = 0x70000000, // Platform architecture compatibility info
@@ -1680,12 +1706,22 @@ enum {
 
   DT_PREINIT_ARRAY = 32,      // Pointer to array of preinit functions.
   DT_PREINIT_ARRAYSZ = 33,    // Size of the DT_PREINIT_ARRAY array.
+  DT_RELRSZ       = 35,       // Size of Relr relocation table.
+  DT_RELR         = 36,       // Address of relocation table (Relr entries).
+  DT_RELRENT      = 37,       // Size of a Relr relocation entry.
 
   DT_LOOS         = 0x60000000, // Start of environment specific tags.
+  DT_ANDROID_REL    = 0x6000000F, // Address of android packed relocations.
+  DT_ANDROID_RELSZ  = 0x60000010, // Size of android packed relocations.
+  DT_ANDROID_RELA   = 0x60000011, // Address of android packed relocations with addends.
+  DT_ANDROID_RELASZ = 0x60000012, // Size of android packed relocations with addends.
   DT_HIOS         = 0x6FFFFFFF, // End of environment specific tags.
   DT_LOPROC       = 0x70000000, // Start of processor specific tags.
   DT_HIPROC       = 0x7FFFFFFF, // End of processor specific tags.
 
+  DT_ANDROID_RELR    = 0x6FFFE000, // DT_RELR before it is standardized.
+  DT_ANDROID_RELRSZ  = 0x6FFFE001, // DT_RELRSZ before it is standardized.
+  DT_ANDROID_RELRENT = 0x6FFFE003, // DT_RELRENT before it is standardized.
   DT_GNU_HASH     = 0x6FFFFEF5, // Reference to the GNU hash table.
   DT_RELACOUNT    = 0x6FFFFFF9, // ELF32_Rela count.
   DT_RELCOUNT     = 0x6FFFFFFA, // ELF32_Rel count.
@@ -1854,6 +1890,46 @@ enum {
   VER_NEED_CURRENT = 1
 };
 
+// Version definition (.gnu.version_d), the same layout for ELF32 and ELF64.
+struct Elf32_Verdef {
+  Elf32_Half vd_version; // Version of this structure (VER_DEF_CURRENT).
+  Elf32_Half vd_flags;   // Bitwise flags (VER_FLG_*).
+  Elf32_Half vd_ndx;     // Version index, used in .gnu.version.
+  Elf32_Half vd_cnt;     // Number of associated Verdaux entries.
+  Elf32_Word vd_hash;    // ELF hash of the version name.
+  Elf32_Word vd_aux;     // Offset from this entry to its Verdaux entries.
+  Elf32_Word vd_next;    // Offset to the next Verdef, 0 for the last one.
+};
+
+// Auxiliary version definition: name of the version or of a parent.
+struct Elf32_Verdaux {
+  Elf32_Word vda_name;   // Offset of the name in the string table.
+  Elf32_Word vda_next;   // Offset to the next Verdaux, 0 for the last one.
+};
+
+// Version dependency (.gnu.version_r), one per needed file.
+struct Elf32_Verneed {
+  Elf32_Half vn_version; // Version of this structure (VER_NEED_CURRENT).
+  Elf32_Half vn_cnt;     // Number of associated Vernaux entries.
+  Elf32_Word vn_file;    // Offset of the file name in the string table.
+  Elf32_Word vn_aux;     // Offset from this entry to its Vernaux entries.
+  Elf32_Word vn_next;    // Offset to the next Verneed, 0 for the last one.
+};
+
+// Auxiliary version dependency: one needed version of the file.
+struct Elf32_Vernaux {
+  Elf32_Word vna_hash;   // ELF hash of the version name.
+  Elf32_Half vna_flags;  // Bitwise flags (VER_FLG_*).
+  Elf32_Half vna_other;  // Version index, used in .gnu.version.
+  Elf32_Word vna_name;   // Offset of the name in the string table.
+  Elf32_Word vna_next;   // Offset to the next Vernaux, 0 for the last one.
+};
+
+typedef Elf32_Verdef Elf64_Verdef;
+typedef Elf32_Verdaux Elf64_Verdaux;
+typedef Elf32_Verneed Elf64_Verneed;
+typedef Elf32_Vernaux Elf64_Vernaux;
+
 struct ElfTypes32 {
   typedef Elf32_Addr Addr;
   typedef Elf32_Off Off;
@@ -1867,6 +1943,10 @@ struct ElfTypes32 {
   typedef Elf32_Rela Rela;
   typedef Elf32_Phdr Phdr;
   typedef Elf32_Dyn Dyn;
+  typedef Elf32_Verdef Verdef;
+  typedef Elf32_Verdaux Verdaux;
+  typedef Elf32_Verneed Verneed;
+  typedef Elf32_Vernaux Vernaux;
 };
 
 struct ElfTypes64 {
@@ -1884,6 +1964,10 @@ struct ElfTypes64 {
   typedef Elf64_Rela Rela;
   typedef Elf64_Phdr Phdr;
   typedef Elf64_Dyn Dyn;
+  typedef Elf64_Verdef Verdef;
+  typedef Elf64_Verdaux Verdaux;
+  typedef Elf64_Verneed Verneed;
+  typedef Elf64_Vernaux Vernaux;
 };
 
 // BEGIN android-changed
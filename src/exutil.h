@@ -2,37 +2,71 @@
 #define _SO_REBUILDER_EXUTIL_H_
 
 #include "elf.h"
-//check the environment and define the necessery type
-#ifndef __LP64__
-typedef Elf32_Addr Elf_Addr;
-typedef Elf32_Dyn Elf_Dyn;
-typedef Elf32_Ehdr Elf_Ehdr;
-typedef Elf32_Half Elf_Half;
-typedef Elf32_Off Elf_Off;
-typedef Elf32_Phdr Elf_Phdr;
-typedef Elf32_Rel Elf_Rel;
-typedef Elf32_Rela Elf_Rela;
-typedef Elf32_Shdr Elf_Shdr;
-typedef Elf32_Sword Elf_Sword;
-typedef Elf32_Sym Elf_Sym;
-typedef Elf32_Word Elf_Word;
-#else
-// Because we handle with 32bits ELF file. 
-// In 32bits Elf file, the header size, section size, etc, 
-// should use 32 bit type, or it will read out range of header.
-typedef Elf64_Addr Elf_Addr;
-typedef Elf32_Dyn Elf_Dyn;
-typedef Elf32_Ehdr Elf_Ehdr;
-typedef Elf64_Half Elf_Half;
-typedef Elf64_Off Elf_Off;
-typedef Elf32_Phdr Elf_Phdr;
-typedef Elf32_Rel Elf_Rel;
-typedef Elf32_Rela Elf_Rela;
-typedef Elf32_Shdr Elf_Shdr;
-typedef Elf64_Sword Elf_Sword;
-typedef Elf32_Sym Elf_Sym;
-typedef Elf64_Word Elf_Word;
-#endif
+#include "ByteOrder.h"
+#include <stdint.h>
+
+/**
+ * ELF class traits. ELFReader, soinfo and ELFRebuilder are templated
+ * on one of them, so a single host binary can repair both 32-bit and
+ * 64-bit so-files. The class is picked once from e_ident[EI_CLASS]
+ * and everything below is specialized at compile time.
+ *
+ * The byte order is picked the same way from e_ident[EI_DATA].
+ * Field<T> is how a raw T lies in the file: plain T for little-endian,
+ * a BigEndian<T> view for big-endian.
+ */
+struct ELF32 : public ElfTypes32 {
+	typedef Elf32_Word Xword;
+	typedef Elf32_Sword Sxword;
+	template <typename T> using Field = T;
+	static const unsigned char kElfClass = ELFCLASS32;
+	static const unsigned char kElfData = ELFDATA2LSB;
+	static const int kBits = 32;
+};
+
+struct ELF64 : public ElfTypes64 {
+	template <typename T> using Field = T;
+	static const unsigned char kElfClass = ELFCLASS64;
+	static const unsigned char kElfData = ELFDATA2LSB;
+	static const int kBits = 64;
+};
+
+struct ELF32BE : public ElfTypes32BE {
+	typedef Elf32_Word Xword;
+	typedef Elf32_Sword Sxword;
+	static const unsigned char kElfClass = ELFCLASS32;
+	static const unsigned char kElfData = ELFDATA2MSB;
+	static const int kBits = 32;
+};
+
+struct ELF64BE : public ElfTypes64BE {
+	static const unsigned char kElfClass = ELFCLASS64;
+	static const unsigned char kElfData = ELFDATA2MSB;
+	static const int kBits = 64;
+};
+
+// Pull the Elf_* names used all over the project into a class
+// templated on ELF class traits.
+#define ELF_TYPEDEFS(ELF) \
+	typedef typename ELF::Addr Elf_Addr; \
+	typedef typename ELF::Off Elf_Off; \
+	typedef typename ELF::Half Elf_Half; \
+	typedef typename ELF::Word Elf_Word; \
+	typedef typename ELF::Sword Elf_Sword; \
+	typedef typename ELF::Xword Elf_Xword; \
+	typedef typename ELF::Sxword Elf_Sxword; \
+	typedef typename ELF::Ehdr Elf_Ehdr; \
+	typedef typename ELF::Phdr Elf_Phdr; \
+	typedef typename ELF::Shdr Elf_Shdr; \
+	typedef typename ELF::Dyn Elf_Dyn; \
+	typedef typename ELF::Sym Elf_Sym; \
+	typedef typename ELF::Rel Elf_Rel; \
+	typedef typename ELF::Rela Elf_Rela; \
+	typedef typename ELF::Verdef Elf_Verdef; \
+	typedef typename ELF::Verdaux Elf_Verdaux; \
+	typedef typename ELF::Verneed Elf_Verneed; \
+	typedef typename ELF::Vernaux Elf_Vernaux; \
+	template <typename T> using Elf_Field = typename ELF::template Field<T>
 
 
 #ifndef PAGE_SIZE
@@ -1,21 +1,35 @@
 #include <iostream>
 #include <cstdio>
+#include <cstring>
 #include <getopt.h>
 #include <string>
+#include <vector>
 #include "Log.h"
 #include "ELFReader.h"
 #include "ELFRebuilder.h"
+#include "DependencyGraph.h"
+#include "SectionDiff.h"
+#include "Stats.h"
 
 void usage(){
 	std::cout<<"So Rebuilder  --Powered by giglf\n"
 			 <<"usage: sb <file.so>\n"
 			 <<"       sb <file.so> -o <repaired.so>\n"
+			 <<"       sb -S <text|json> <file.so>...\n"
+			 <<"       sb -G <dot|bin> <libdir> [-o <graphfile>]\n"
+			 <<"       sb diff <left.so> <right.so>\n"
 			 <<"\n"
 			 <<"option: \n"
 			 <<"    -o --output <outputfile>   Specify the output file name. Or append \"_repaired\" default.\n"
 			 <<"    -c --check                 Check the damage level and print it.\n"
 			 <<"    -f --force                 Force to fully rebuild the section.\n"
 			 <<"    -m --memso <baseAddr(hex)> Source file is dump from memory from address x(hex)\n"
+			 <<"    -s --symbolic              With -m, also restore GOT and PLT slots bound to symbols.\n"
+			 <<"    -r --reference <file|dir>  Intact builds to take the section table from. Can be repeated.\n"
+			 <<"    -g --gnu-hash              Add .gnu.hash to a library which only has the SysV .hash.\n"
+			 <<"    -V --verify                Check the rebuilt file in memory, fail if it is broken.\n"
+			 <<"    -G --graph <dot|bin>       Write the DT_NEEDED graph of every so-file under a directory.\n"
+			 <<"    -S --stats <text|json>     Print the time of each phase and what it moved to stderr.\n"
 			 <<"    -v --verbose               Print the verbose repair information\n"
 			 <<"    -h --help                  Print this usage.\n"
 			 <<"    -d --debug                 Print this program debug log."
@@ -29,23 +43,197 @@ struct GlobalArgument{
 	bool check;					// -c option
 	bool force;					// -f option
 	bool isMset;				// -m option
-	unsigned int memso;			
+	uint64_t memso;			
+	bool symbolic;				// -s option
+	bool gnuHash;				// -g option
+	std::vector<std::string> references;	// -r option
+	bool verify;				// -V option
+	std::string graph;			// -G option
+	std::string stats;			// -S option
 	bool verbose;				// -v option
 	bool debug;					// -d option
 	bool isValid;				// is the argv Valid
 }GlobalArgv;
 
-static const char *optString = "o:cfm:vhd";
+static const char *optString = "o:cfm:sr:gVG:S:vhd";
 static const struct option longOpts[] = {
 	{"output", required_argument, NULL, 'o'},
 	{"check", no_argument, NULL, 'c'},
 	{"force", no_argument, NULL, 'f'},
 	{"memso", required_argument, NULL, 'm'},
+	{"symbolic", no_argument, NULL, 's'},
+	{"reference", required_argument, NULL, 'r'},
+	{"gnu-hash", no_argument, NULL, 'g'},
+	{"verify", no_argument, NULL, 'V'},
+	{"graph", required_argument, NULL, 'G'},
+	{"stats", required_argument, NULL, 'S'},
 	{"verbose", no_argument, NULL, 'v'},
 	{"help", no_argument, NULL, 'h'},
-	{"debug", no_argument, NULL, 'd'}
+	{"debug", no_argument, NULL, 'd'},
+	{NULL, 0, NULL, 0}
 };
 
+/**
+ * Parse the rebuilt data again, straight from memory, and print what
+ * is wrong with it. Return true if nothing is.
+ */
+template <typename ELF>
+bool verifyOutput(const uint8_t* data, size_t size){
+	PhaseTimer timer(kPhaseVerify);
+	ELFReader<ELF> reader(GlobalArgv.outFileName.c_str(), data, size);
+	VerifyResult result;
+	bool ok = reader.verify(result);
+	DLOG("Section check of the output gives damage level %d.", result.damageLevel);
+	for(const VerifyIssue& issue : result.issues){
+		ELOG("verify %s: %s", issue.check, issue.message.c_str());
+	}
+	if(ok) VLOG("Output verified.");
+	return ok;
+}
+
+/**
+ * Read, rebuild and write the so-file named in GlobalArgv.
+ * Return false if it cannot be repaired or written, or the output
+ * failed verification.
+ */
+template <typename ELF>
+bool repair(){
+	ELFReader<ELF> reader(GlobalArgv.inFileName.c_str());
+	if(GlobalArgv.isMset){
+		reader.setDumpSoFile(true);
+		reader.setDumpSoBase(GlobalArgv.memso);
+	}
+	if(!reader.read()) return false;
+	if(GlobalArgv.check){
+		DLOG("Enter check elf file");
+		reader.damagePrint();
+	}
+
+	// leave a way force to rebuild the section. Even though it is complete.
+	if(reader.getDamageLevel() == 0 && GlobalArgv.force == false){
+		LOG("\"%s\" is complete. Don't need repair.", GlobalArgv.inFileName.c_str());
+		return true;
+	}
+
+	/**
+	 * Because judge if a so-file section headers fully damage or 
+	 * just missing address and offset is difficult to me. For example, 
+	 * I don't know why in some file .got section are align 8 but the 
+	 * section record align 4. That lead the wrong result with the check 
+	 * function.
+	 * Because of my limit ability. I recommand you using -f option to 
+	 * force rebuild the section headers.
+	 * Hope you can help me with it.
+	 */
+	ELFRebuilder<ELF> rebuilder(reader, GlobalArgv.force);
+	rebuilder.setSymbolic(GlobalArgv.symbolic);
+	rebuilder.setGnuHash(GlobalArgv.gnuHash);
+	BuildIndex<ELF> references;
+	for(const std::string& path : GlobalArgv.references){
+		references.add(path.c_str());
+	}
+	if(references.size() != 0){
+		DLOG("%zu intact builds indexed.", references.size());
+		rebuilder.setReferences(&references);
+	}
+	if(!rebuilder.rebuild()){
+		ELOG("\"%s\" cannot be rebuilt.", GlobalArgv.inFileName.c_str());
+		return false;
+	}
+	
+	uint8_t* data = rebuilder.getRebuildData();
+	size_t data_size = rebuilder.getRebuildDataSize();
+	bool verified = !GlobalArgv.verify || verifyOutput<ELF>(data, data_size);
+	{
+		PhaseTimer timer(kPhaseWrite);
+		FILE* fout = fopen(GlobalArgv.outFileName.c_str(), "wb");
+		if(fout == NULL){
+			ELOG("\"%s\" open error.", GlobalArgv.outFileName.c_str());
+			return false;
+		}
+		size_t written = fwrite(data, sizeof(uint8_t), data_size, fout);
+		STAT_COUNT(kBytesWritten, written);
+		fclose(fout);
+	}
+
+	// a file which fails is still written, to be looked at
+	if(!verified){
+		ELOG("\"%s\" failed verification.", GlobalArgv.outFileName.c_str());
+		return false;
+	}
+	LOG("File rebuild success. Output has placed at \"%s\".", GlobalArgv.outFileName.c_str());
+	return true;
+}
+
+/**
+ * Build the DT_NEEDED graph of the libraries under the input directory
+ * and write it in the form asked by -G.
+ */
+bool dependencyGraph(){
+	DependencyGraph graph;
+	if(graph.scan(GlobalArgv.inFileName) == 0){
+		ELOG("No so-file found under \"%s\".", GlobalArgv.inFileName.c_str());
+		return false;
+	}
+	graph.build();
+	const char* out = GlobalArgv.outFileName.c_str();
+	bool ok = GlobalArgv.graph == "dot" ? graph.writeDot(out) : graph.writeBinary(out);
+	if(!ok){
+		ELOG("\"%s\" open error.", out);
+		return false;
+	}
+	LOG("%zu libraries, %zu DT_NEEDED edges, %zu of them outside the directory.", 
+		graph.getLibraryCount(), graph.getEdgeCount(), graph.getExternalCount());
+	LOG("Graph has placed at \"%s\".", out);
+	return true;
+}
+
+/**
+ * Compare two so-files section by section.
+ * Return the exit code, 0 if they are the same.
+ */
+template <typename ELF>
+int diff(const char* left, const char* right){
+	SectionDiff<ELF> sd(left, right);
+	if(!sd.load()) return 2;
+	return sd.compare() == 0 ? 0 : 1;
+}
+
+int diffMain(const char* left, const char* right){
+	unsigned char ldata = ELFDATANONE, rdata = ELFDATANONE;
+	unsigned char cls = peekElfClass(left, &ldata);
+	if(cls != peekElfClass(right, &rdata) || ldata != rdata){
+		ELOG("\"%s\" and \"%s\" are not of the same elf class.", left, right);
+		return 2;
+	}
+	if(cls == ELFCLASS32 && ldata == ELFDATA2LSB) return diff<ELF32>(left, right);
+	if(cls == ELFCLASS64 && ldata == ELFDATA2LSB) return diff<ELF64>(left, right);
+	if(cls == ELFCLASS32 && ldata == ELFDATA2MSB) return diff<ELF32BE>(left, right);
+	if(cls == ELFCLASS64 && ldata == ELFDATA2MSB) return diff<ELF64BE>(left, right);
+	ELOG("\"%s\" is not a valid 32-bit or 64-bit elf file.", left);
+	return 2;
+}
+
+/**
+ * Repair GlobalArgv.inFileName with the reader and rebuilder of its
+ * elf class. Return false if it is no so-file or the repair failed.
+ */
+bool repairFile(){
+	DLOG("InputFile: %s", GlobalArgv.inFileName.c_str());
+	DLOG("OutputFile: %s", GlobalArgv.outFileName.c_str());
+
+	// Pick the reader and rebuilder by the elf class and byte order once.
+	// All the work below is specialized for them at compile time.
+	unsigned char data = ELFDATANONE;
+	unsigned char cls = peekElfClass(GlobalArgv.inFileName.c_str(), &data);
+	if(cls == ELFCLASS32 && data == ELFDATA2LSB) return repair<ELF32>();
+	if(cls == ELFCLASS64 && data == ELFDATA2LSB) return repair<ELF64>();
+	if(cls == ELFCLASS32 && data == ELFDATA2MSB) return repair<ELF32BE>();
+	if(cls == ELFCLASS64 && data == ELFDATA2MSB) return repair<ELF64BE>();
+	ELOG("\"%s\" is not a valid 32-bit or 64-bit elf file.", GlobalArgv.inFileName.c_str());
+	return false;
+}
+
 int main(int argc, char *argv[]){
 
 	if(argc <= 1){
@@ -57,10 +245,20 @@ int main(int argc, char *argv[]){
 	GlobalArgv.force = false;
 	GlobalArgv.isMset = false;
 	GlobalArgv.memso = 0;
+	GlobalArgv.symbolic = false;
+	GlobalArgv.gnuHash = false;
+	GlobalArgv.verify = false;
 	GlobalArgv.verbose = false;
 	GlobalArgv.debug = false;
 	GlobalArgv.isValid = true;
 
+	// "sb diff a.so b.so", the options after it are read as usual
+	bool isDiff = strcmp(argv[1], "diff") == 0;
+	if(isDiff){
+		argc--;
+		argv++;
+	}
+
 	int opt;
 	int longIndex;
 	// I have try that getopt doesn't work with multiple option.
@@ -78,7 +276,27 @@ int main(int argc, char *argv[]){
 				break;
 			case 'm':
 				GlobalArgv.isMset = true;
-				GlobalArgv.memso = strtoul(optarg, NULL, 16);
+				GlobalArgv.memso = strtoull(optarg, NULL, 16);
+				break;
+			case 's':
+				GlobalArgv.symbolic = true;
+				break;
+			case 'r':
+				GlobalArgv.references.push_back(optarg);
+				break;
+			case 'g':
+				GlobalArgv.gnuHash = true;
+				break;
+			case 'V':
+				GlobalArgv.verify = true;
+				break;
+			case 'G':
+				GlobalArgv.graph = optarg;
+				if(GlobalArgv.graph != "dot" && GlobalArgv.graph != "bin") GlobalArgv.isValid = false;
+				break;
+			case 'S':
+				GlobalArgv.stats = optarg;
+				if(GlobalArgv.stats != "text" && GlobalArgv.stats != "json") GlobalArgv.isValid = false;
 				break;
 			case 'v':
 				GlobalArgv.verbose = true;
@@ -94,59 +312,47 @@ int main(int argc, char *argv[]){
 				break;
 		}
 	}
-	GlobalArgv.inFileName = argv[optind];	
+	if(optind >= argc || (isDiff && optind + 2 != argc)) GlobalArgv.isValid = false;
 
 	if(!GlobalArgv.isValid) { usage(); return 1; }
+	GlobalArgv.inFileName = argv[optind];
 	if(GlobalArgv.debug) { DEBUG = true; LOG("=====Debug modol=====");}
 	if(GlobalArgv.verbose) { VERBOSE = true; DLOG("verbose set"); }
-	if(GlobalArgv.outFileName.empty()){
-		GlobalArgv.outFileName = GlobalArgv.inFileName.substr(0, GlobalArgv.inFileName.size()-3) + "_repaired.so";
+	if(isDiff){
+		return diffMain(argv[optind], argv[optind+1]);
 	}
-	DLOG("InputFile: %s", GlobalArgv.inFileName.c_str());
-	DLOG("OutputFile: %s", GlobalArgv.outFileName.c_str());
-
-
-	ELFReader reader(GlobalArgv.inFileName.c_str());
-	if(GlobalArgv.isMset){
-		reader.setDumpSoFile(true);
-		reader.setDumpSoBase(GlobalArgv.memso);
+	if(!GlobalArgv.graph.empty()){
+		if(GlobalArgv.outFileName.empty()){
+			std::string dir = GlobalArgv.inFileName;
+			while(dir.size() > 1 && dir[dir.size()-1] == '/') dir.erase(dir.size()-1);
+			GlobalArgv.outFileName = dir + (GlobalArgv.graph == "dot" ? ".dot" : ".bin");
+		}
+		return dependencyGraph() ? 0 : 1;
 	}
-	reader.read();
-	if(GlobalArgv.check){
-		DLOG("Enter check elf file");
-		reader.damagePrint();
+	// -o names one output, so it can't be given with a batch
+	bool batch = optind + 1 < argc;
+	if(batch && !GlobalArgv.outFileName.empty()){
+		ELOG("-o cannot be used with more than one input file.");
+		return 1;
 	}
+	if(!GlobalArgv.stats.empty()) STATS = true;
 
-	// leave a way force to rebuild the section. Even though it is complete.
-	if(reader.getDamageLevel() == 0 && GlobalArgv.force == false){
-		LOG("\"%s\" is complete. Don't need repair.", GlobalArgv.inFileName.c_str());
-		return 0;
-	}
-
-	/**
-	 * Because judge if a so-file section headers fully damage or 
-	 * just missing address and offset is difficult to me. For example, 
-	 * I don't know why in some file .got section are align 8 but the 
-	 * section record align 4. That lead the wrong result with the check 
-	 * function.
-	 * Because of my limit ability. I recommand you using -f option to 
-	 * force rebuild the section headers.
-	 * Hope you can help me with it.
-	 */
-	ELFRebuilder rebuilder(reader, GlobalArgv.force);
-	rebuilder.rebuild();
-	
-	uint8_t* data = rebuilder.getRebuildData();
-	size_t data_size = rebuilder.getRebuildDataSize();
-	FILE* fout = fopen(GlobalArgv.outFileName.c_str(), "wb");
-	if(fout == NULL){
-		ELOG("\"%s\" open error.", GlobalArgv.outFileName.c_str());
-		exit(EXIT_FAILURE);
+	int ret = 0;
+	std::vector<Stats> stats(argc - optind);
+	for(int i = optind; i < argc; i++){
+		GlobalArgv.inFileName = argv[i];
+		if(batch || GlobalArgv.outFileName.empty()){
+			GlobalArgv.outFileName = GlobalArgv.inFileName.substr(0, GlobalArgv.inFileName.size()-3) + "_repaired.so";
+		}
+		stats[i - optind].file = argv[i];
+		// reset after everything above, which allocates
+		fileStats = Stats();
+		{
+			PhaseTimer timer(kPhaseTotal);
+			if(!repairFile()) ret = 1;
+		}
+		stats[i - optind].add(fileStats);
 	}
-	fwrite(data, sizeof(uint8_t), data_size, fout);
-	fclose(fout);
-
-	LOG("File rebuild success. Output has placed at \"%s\".", GlobalArgv.outFileName.c_str());
-	
-	return 0;
-}
\ No newline at end of file
+	if(STATS) printStats(stats, GlobalArgv.stats == "json", stderr);
+	return ret;
+}